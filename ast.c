@@ -1,8 +1,11 @@
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "parser.h"
 #include "scanner.h"
+#include "utility.h"
 
 // Convert AST node types to strings
 const char *ast_type_to_string(ASTNodeType type)
@@ -23,6 +26,8 @@ const char *ast_type_to_string(ASTNodeType type)
         return "IF_STATEMENT";
     case AST_WHILE:
         return "WHILE";
+    case AST_COUNTED_LOOP:
+        return "COUNTED_LOOP";
     case AST_CONDITION:
         return "CONDITION";
     case AST_ASSIGNMENT:
@@ -44,53 +49,357 @@ const char *ast_type_to_string(ASTNodeType type)
     }
 }
 
-// Build the AST
-ASTNode *build_ast()
+// Parse the next top-level statement, returning 1 on success, 0 at end of input, or -1 on a syntax error
+int parse_next_statement(int *i, uint32_t *statement)
 {
-    int i = 0;
-    ASTNode *root = NULL;
-    ASTNode *current = NULL;
+    // Skip any newline tokens to find the next useful token
+    while (get_token(*i)->type == NEW_LINE)
+        (*i)++;
 
-    while (i < token_count)
-    {
-        // Skip any newline tokens to find the next useful token
-        while (i < token_count && tokens[i].type == NEW_LINE)
-            i++;
+    if (get_token(*i)->type == END_OF_INPUT)
+        return 0;
 
-        if (i >= token_count)
-            break;
+    // Parse a statement starting at the current token's index
+    *statement = parse_statement(i);
+    if (!*statement)
+    {
+        size_t length;
+        const char *text = token_text(get_token(*i), &length);
+        syntax_error(*i, "Unexpected token '%.*s'", (int)length, text);
+        return -1;
+    }
+    return 1;
+}
 
-        // Parse a statement starting at the current token's index
-        ASTNode *statement_node = parse_statement(&i);
-        if (!statement_node)
-        {
-            fprintf(stderr, "Syntax error: Unexpected token '%s'\n", tokens[i].value);
-            return NULL;
-        }
+// Build the AST and return the arena index of its first statement
+uint32_t build_ast()
+{
+    int i = 0;
+    int status;
+    uint32_t root = AST_NULL;
+    uint32_t current = AST_NULL;
+    uint32_t statement_node;
 
+    // The first statement can be reached from wherever the caller places this sequence
+    start_basic_block();
+    while ((status = parse_next_statement(&i, &statement_node)) > 0)
+    {
         // Append the parsed statement to the AST
         if (!root)
             root = statement_node; // First statement becomes the root
         else
-            current->right = statement_node; // Link subsequent statements
+            ast_node(current)->right = statement_node; // Link subsequent statements
 
-        current = statement_node; // Update current to the latest statement
+        // Update current to the latest statement, stepping over an attached ELSE_STATEMENT
+        current = statement_node;
+        while (ast_node(current)->right)
+            current = ast_node(current)->right;
+    }
 
-        // Skip any trailing newline tokens before the next iteration
-        while (i < token_count && tokens[i].type == NEW_LINE)
-            i++;
+    return status < 0 ? AST_NULL : root; // Return the root of the constructed AST
+}
+
+// Move an arena loaded by load_ast() out of its read-only mapping, so nodes and text can be added to it
+static void detach_mapping()
+{
+    ASTArena *arena = &compiler->ast_arena;
+    ASTNode *nodes = malloc(arena->capacity * sizeof(*nodes));
+    char *text = malloc(arena->text_capacity + 1);
+    if (!nodes || !text)
+    {
+        fprintf(stderr, "Error: Out of memory for AST nodes.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(nodes, arena->nodes, arena->count * sizeof(*nodes));
+    memcpy(text, arena->text, arena->text_length);
+    munmap(arena->mapping, arena->mapping_size);
+    arena->nodes = nodes;
+    arena->text = text;
+    arena->mapping = NULL;
+    arena->mapping_size = 0;
+}
+
+// Store length bytes of node text in the arena once, zero terminated, and return its offset, so repeated names and
+// keywords share storage
+static int32_t intern_text(const char *text, size_t length)
+{
+    // Keep the atom table at most half full
+    if (compiler->ast_arena.atom_count * 2 >= compiler->ast_arena.atom_capacity)
+    {
+        uint32_t *old_atoms = compiler->ast_arena.atoms;
+        uint32_t old_capacity = compiler->ast_arena.atom_capacity;
+        compiler->ast_arena.atom_capacity = old_capacity ? old_capacity * 2 : 64;
+        compiler->ast_arena.atoms = calloc(compiler->ast_arena.atom_capacity, sizeof(*compiler->ast_arena.atoms));
+        for (uint32_t i = 0; i < old_capacity; i++)
+        {
+            if (!old_atoms[i])
+                continue;
+            const char *stored = compiler->ast_arena.text + old_atoms[i] - 1;
+            uint32_t slot = hash_text(stored, strlen(stored)) & (compiler->ast_arena.atom_capacity - 1);
+            while (compiler->ast_arena.atoms[slot])
+                slot = (slot + 1) & (compiler->ast_arena.atom_capacity - 1);
+            compiler->ast_arena.atoms[slot] = old_atoms[i];
+        }
+        free(old_atoms);
     }
 
-    return root; // Return the root of the constructed AST
+    // Look the text up, probing linearly from its hash slot
+    uint32_t slot = hash_text(text, length) & (compiler->ast_arena.atom_capacity - 1);
+    while (compiler->ast_arena.atoms[slot])
+    {
+        const char *stored = compiler->ast_arena.text + compiler->ast_arena.atoms[slot] - 1;
+        if (strlen(stored) == length && memcmp(stored, text, length) == 0)
+            return compiler->ast_arena.atoms[slot] - 1;
+        slot = (slot + 1) & (compiler->ast_arena.atom_capacity - 1);
+    }
+
+    // Append the new text to the arena
+    uint32_t size = length + 1;
+    if (compiler->ast_arena.mapping && compiler->ast_arena.text_length + size > compiler->ast_arena.text_capacity)
+        detach_mapping();
+    while (compiler->ast_arena.text_length + size > compiler->ast_arena.text_capacity)
+    {
+        uint32_t added = compiler->ast_arena.text_capacity ? compiler->ast_arena.text_capacity : 1024;
+        compiler->ast_arena.text_capacity += added;
+        COUNT_STAT(ast_bytes, added);
+        compiler->ast_arena.text = realloc(compiler->ast_arena.text, compiler->ast_arena.text_capacity);
+    }
+    uint32_t offset = compiler->ast_arena.text_length;
+    memcpy(compiler->ast_arena.text + offset, text, length);
+    compiler->ast_arena.text[offset + length] = '\0';
+    compiler->ast_arena.text_length += size;
+
+    compiler->ast_arena.atoms[slot] = offset + 1;
+    compiler->ast_arena.atom_count++;
+    return offset;
 }
 
-// Create a new AST node
-ASTNode *create_ast_node(ASTNodeType type, const char *value)
+// Reserve a node in the arena with no children or siblings and return its index
+static uint32_t allocate_node(ASTNodeType type)
 {
-    ASTNode *node = calloc(1, sizeof(*node)); // Allocate and zero-initialize memory
+    // Grow the arena when full, reserving index 0 for AST_NULL
+    if (compiler->ast_arena.count + 1 >= compiler->ast_arena.capacity)
+    {
+        if (compiler->ast_arena.mapping)
+            detach_mapping();
+        uint32_t added = compiler->ast_arena.capacity ? compiler->ast_arena.capacity : 1024;
+        compiler->ast_arena.capacity += added;
+        COUNT_STAT(ast_bytes, added * sizeof(*compiler->ast_arena.nodes));
+        compiler->ast_arena.nodes = realloc(compiler->ast_arena.nodes, compiler->ast_arena.capacity * sizeof(*compiler->ast_arena.nodes));
+        if (!compiler->ast_arena.nodes)
+        {
+            fprintf(stderr, "Error: Out of memory for AST nodes.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (compiler->ast_arena.count == 0)
+        compiler->ast_arena.count = 1;
+
+    uint32_t index = compiler->ast_arena.count++;
+    COUNT_STAT(ast_nodes, 1);
+    ASTNode *node = &compiler->ast_arena.nodes[index];
     node->type = type;
-    strncpy(node->value, value, sizeof(node->value) - 1); // Safely copy value
-    return node;
+    node->left = node->right = AST_NULL;
+    return index;
+}
+
+// Read a decimal literal of length digits the way atoi() does, saturating at LONG_MAX before the cast to int
+static int32_t parse_integer(const char *digits, size_t length)
+{
+    long value = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        int digit = digits[i] - '0';
+        if (value > (LONG_MAX - digit) / 10)
+            return (int32_t)LONG_MAX;
+        value = value * 10 + digit;
+    }
+    return (int32_t)value;
+}
+
+// Create a new AST node in the arena from length bytes of text, such as a lexeme read in place from the source, and
+// return its index
+uint32_t create_span_node(ASTNodeType type, const char *text, size_t length)
+{
+    uint32_t index = allocate_node(type);
+    ASTNode *node = &compiler->ast_arena.nodes[index];
+    // Integers hold their literal, identifiers and settings their symbol slot, and all other nodes their interned text
+    if (type == AST_INTEGER)
+        node->value = parse_integer(text, length);
+    else if (type == AST_IDENTIFIER || type == AST_SETTING)
+        node->value = intern_symbol(text, length);
+    else
+        node->value = intern_text(text, length);
+    return index;
+}
+
+// Create a new AST node in the arena and return its index
+uint32_t create_ast_node(ASTNodeType type, const char *value)
+{
+    return create_span_node(type, value, strlen(value));
+}
+
+// Give an existing node new interned text, such as an operator the optimizer has rewritten
+void set_node_text(uint32_t index, const char *text)
+{
+    int32_t offset = intern_text(text, strlen(text));
+    compiler->ast_arena.nodes[index].value = offset;
+}
+
+// Generation of the assignment a variable read now would see, counting the start of the basic block as assigning
+// every variable, since the value may come from more than one place there
+static uint32_t variable_generation(uint32_t slot)
+{
+    ASTArena *arena = &compiler->ast_arena;
+    if (slot < arena->assigned_capacity && arena->assigned[slot] > arena->block_start)
+        return arena->assigned[slot];
+    return arena->block_start;
+}
+
+// Identity of an operand for sharing expressions: a literal or parameter by its value, a variable by its slot and the
+// assignment it reads, and an expression by the chain it shares
+static uint64_t operand_key(const ASTNode *operand)
+{
+    switch (operand->type)
+    {
+    case AST_INTEGER:
+        return (uint64_t)1 << 62 | (uint32_t)operand->value;
+    case AST_PARAMETER:
+        return (uint64_t)2 << 62 | (uint32_t)operand->value;
+    case AST_IDENTIFIER:
+        return (uint64_t)3 << 62 | (uint64_t)(operand->value & 0x3FFFFFFF) << 32 | variable_generation(operand->value);
+    default:
+        return operand->left;
+    }
+}
+
+static uint32_t shape_slot(char operator, uint64_t left, uint64_t right)
+{
+    uint64_t hash = ((left * 0x9E3779B97F4A7C15u) ^ right ^ (uint64_t)(unsigned char)operator) * 0xC2B2AE3D27D4EB4Fu;
+    return (uint32_t)(hash >> 32) & (AST_SHAPE_SLOTS - 1);
+}
+
+// Record that the statement being parsed assigns a variable, so later reads of it no longer match earlier expressions
+void mark_assignment(uint32_t slot)
+{
+    ASTArena *arena = &compiler->ast_arena;
+    if (slot >= arena->assigned_capacity)
+    {
+        uint32_t capacity = arena->assigned_capacity ? arena->assigned_capacity : 16;
+        while (slot >= capacity)
+            capacity *= 2;
+        arena->assigned = realloc(arena->assigned, capacity * sizeof(*arena->assigned));
+        memset(arena->assigned + arena->assigned_capacity, 0, (capacity - arena->assigned_capacity) * sizeof(*arena->assigned));
+        arena->assigned_capacity = capacity;
+    }
+    arena->assigned[slot] = ++arena->generation;
+}
+
+// Start a new basic block, where control may arrive from more than one place, so no variable read in it matches a read
+// parsed before it
+void start_basic_block()
+{
+    compiler->ast_arena.block_start = ++compiler->ast_arena.generation;
+}
+
+// Create an EXPRESSION node applying an operator to two operand nodes nothing links to yet, and return its index.
+// Equal expressions reading the same assignments within a basic block share one operand chain, so the nodes beneath
+// them form a DAG and each distinct computation is stored once. A repeated expression's own operands go back to the
+// arena if nothing was allocated after them
+uint32_t create_expression_node(uint32_t left, char operator, uint32_t right)
+{
+    ASTArena *arena = &compiler->ast_arena;
+    if (!arena->shapes)
+        arena->shapes = calloc(AST_SHAPE_SLOTS, sizeof(*arena->shapes));
+
+    // The table is direct mapped, which bounds its size and keeps lookups to one probe in blocks of any length
+    uint64_t left_key = operand_key(&arena->nodes[left]);
+    uint64_t right_key = operand_key(&arena->nodes[right]);
+    ExpressionShape *shape = &arena->shapes[shape_slot(operator, left_key, right_key)];
+    if (shape->chain && shape->generation >= arena->block_start && shape->operator == operator &&
+        shape->left == left_key && shape->right == right_key)
+    {
+        if (right + 1 == arena->count && --arena->count == left + 1)
+            arena->count--;
+        uint32_t chain = shape->chain;
+        uint32_t expression = create_ast_node(AST_EXPRESSION, "EXPRESSION");
+        compiler->ast_arena.nodes[expression].left = chain;
+        return expression;
+    }
+
+    // Link a new chain, operand to operator to operand, and remember it
+    uint32_t operator_node = create_span_node(AST_OPERATOR, &operator, 1);
+    uint32_t expression = create_ast_node(AST_EXPRESSION, "EXPRESSION");
+    ASTNode *nodes = compiler->ast_arena.nodes;
+    nodes[expression].left = left;
+    nodes[left].right = operator_node;
+    nodes[operator_node].right = right;
+    *shape = (ExpressionShape){left_key, right_key, left, arena->generation, operator};
+    return expression;
+}
+
+// Copy a statement sequence and everything beneath it from an arena, which may be the current one, into the current arena.
+// Children are copied recursively and siblings in a loop, so the recursion only goes as deep as the nesting
+uint32_t copy_ast(const ASTArena *from, uint32_t index)
+{
+    uint32_t first = AST_NULL;
+    uint32_t previous = AST_NULL;
+    for (; index; index = from->nodes[index].right)
+    {
+        // Read the source node before allocating, as growing the current arena may move it
+        ASTNode source = from->nodes[index];
+        uint32_t copy = allocate_node(source.type);
+        if (source.type == AST_INTEGER || source.type == AST_IDENTIFIER || source.type == AST_SETTING)
+            compiler->ast_arena.nodes[copy].value = source.value;
+        else
+            compiler->ast_arena.nodes[copy].value = intern_text(from->text + source.value, strlen(from->text + source.value));
+
+        uint32_t left = copy_ast(from, source.left);
+        compiler->ast_arena.nodes[copy].left = left;
+        if (previous)
+            compiler->ast_arena.nodes[previous].right = copy;
+        else
+            first = copy;
+        previous = copy;
+    }
+    return first;
+}
+
+// Release every node and string in the arena at once, keeping its storage for reuse
+void reset_ast()
+{
+    // A mapped arena cannot be written to, so it is dropped instead
+    if (compiler->ast_arena.mapping)
+    {
+        free_ast();
+        return;
+    }
+    compiler->ast_arena.count = 1;
+    compiler->ast_arena.text_length = 0;
+    compiler->ast_arena.atom_count = 0;
+    if (compiler->ast_arena.atoms)
+        memset(compiler->ast_arena.atoms, 0, compiler->ast_arena.atom_capacity * sizeof(*compiler->ast_arena.atoms));
+
+    // Chains remembered for sharing are gone too, which starting a basic block makes sure no expression finds
+    start_basic_block();
+}
+
+// Give the arena's storage back once the compilation is finished
+void free_ast()
+{
+    if (compiler->ast_arena.mapping)
+    {
+        munmap(compiler->ast_arena.mapping, compiler->ast_arena.mapping_size);
+    }
+    else
+    {
+        free(compiler->ast_arena.nodes);
+        free(compiler->ast_arena.text);
+    }
+    free(compiler->ast_arena.atoms);
+    free(compiler->ast_arena.shapes);
+    free(compiler->ast_arena.assigned);
+    memset(&compiler->ast_arena, 0, sizeof(compiler->ast_arena));
 }
 
 ASTNodeType map_token_to_ast_type(State type)
@@ -108,18 +417,68 @@ ASTNodeType map_token_to_ast_type(State type)
     }
 }
 
-// Recursively prints the AST with indents
-void print_ast(ASTNode *root, int level)
+// Walk a statement sequence and every node beneath it in depth-first order without recursion.
+// The explicit stack holds one parent per nesting level, so it grows with nesting depth rather than program length
+void walk_ast(ASTNode *root, const ASTVisitor *visitor)
 {
-    if (!root)
-        return;
+    ASTNode *inline_stack[64];
+    ASTNode **stack = inline_stack;
+    int capacity = sizeof(inline_stack) / sizeof(*inline_stack);
+    int depth = 0;
+    ASTNode *node = root;
 
-    // Print the current node
-    printf("%*s%s: %s\n", level * 2, "", ast_type_to_string(root->type), root->value);
+    while (node || depth > 0)
+    {
+        // Once a child list is exhausted, finish its parent and move on to the parent's next sibling
+        if (!node)
+        {
+            node = stack[--depth];
+            if (visitor->post)
+                visitor->post(node, depth, visitor->data);
+            node = ast_right(node);
+            continue;
+        }
+
+        // Descend into the node's children unless the visitor asks to skip them
+        if ((!visitor->pre || visitor->pre(node, depth, visitor->data)) && node->left)
+        {
+            if (depth == capacity)
+            {
+                capacity *= 2;
+                ASTNode **grown = malloc(capacity * sizeof(*grown));
+                memcpy(grown, stack, depth * sizeof(*grown));
+                if (stack != inline_stack)
+                    free(stack);
+                stack = grown;
+            }
+            stack[depth++] = node;
+            node = ast_left(node);
+            continue;
+        }
+
+        if (visitor->post)
+            visitor->post(node, depth, visitor->data);
+        node = ast_right(node);
+    }
 
-    // Print the left subtree
-    print_ast(root->left, level + 1);
+    if (stack != inline_stack)
+        free(stack);
+}
 
-    // Print the right subtree
-    print_ast(root->right, level);
+// Print one node indented by its level in the tree
+static int print_node(ASTNode *node, int depth, void *data)
+{
+    int level = *(int *)data + depth;
+    if (node->type == AST_INTEGER)
+        fprintf(compiler->diagnostics, "%*s%s: %d\n", level * 2, "", ast_type_to_string(node->type), node->value);
+    else
+        fprintf(compiler->diagnostics, "%*s%s: %s\n", level * 2, "", ast_type_to_string(node->type), ast_text(node));
+    return 1;
+}
+
+// Prints the AST with indents
+void print_ast(ASTNode *root, int level)
+{
+    ASTVisitor visitor = {print_node, NULL, &level};
+    walk_ast(root, &visitor);
 }
@@ -2,7 +2,10 @@
 #ifndef AST_H
 #define AST_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include "scanner.h"
+#include "symbols.h"
 
 // Define AST Node types
 typedef enum
@@ -11,6 +14,7 @@ typedef enum
     AST_ASSIGNMENT,
     AST_COMMAND,
     AST_CONDITION,
+    AST_COUNTED_LOOP,
     AST_ELSE_STATEMENT,
     AST_EXPRESSION,
     AST_IDENTIFIER,
@@ -25,19 +29,75 @@ typedef enum
     AST_WHILE,
 } ASTNodeType;
 
+#define AST_NULL 0 // Arena index meaning "no node"; slot 0 of the arena is never handed out
+
 // Define the AST Node structure
 typedef struct ASTNode
 {
-    ASTNodeType type;
-    char value[100];       // Value of the node
-    struct ASTNode *left;  // Child nodes representing details of the command
-    struct ASTNode *right; // Sibling nodes representing the next command in the sequence
+    uint8_t type;   // ASTNodeType of the node
+    uint32_t left;  // Arena index of the first child node, detailing the command
+    uint32_t right; // Arena index of the next sibling node, the next command in the sequence
+    int32_t value;  // Literal for AST_INTEGER, symbol slot for AST_IDENTIFIER/AST_SETTING, otherwise the arena offset of the node's text
 } ASTNode;
 
+#define AST_SHAPE_SLOTS 4096 // Expressions remembered for sharing at once; one that collides with a newer one is forgotten
+
+// An operand chain shared by every equal expression, keyed by its operator and the identity of both operands
+typedef struct
+{
+    uint64_t left;
+    uint64_t right;
+    uint32_t chain;      // Arena index of the chain's first operand
+    uint32_t generation; // Generation the chain was created in, as it is only shared within that basic block
+    char operator;
+} ExpressionShape;
+
+// Contiguous storage for every node of the AST, released all at once by reset_ast()
+typedef struct
+{
+    ASTNode *nodes;
+    uint32_t count;
+    uint32_t capacity;
+    char *text;           // Interned node text, each string terminated by '\0'
+    uint32_t text_length;
+    uint32_t text_capacity;
+    uint32_t *atoms;      // Open-addressing hash of text offsets (plus one) used to intern node text
+    uint32_t atom_count;
+    uint32_t atom_capacity;
+    ExpressionShape *shapes; // AST_SHAPE_SLOTS operand chains expressions can share while parsing, by hash, or NULL
+    uint32_t *assigned;      // Generation of each variable's latest assignment, by symbol slot
+    uint32_t assigned_capacity;
+    uint32_t generation;     // Counts the assignments and basic blocks parsed so far
+    uint32_t block_start;    // Generation the current basic block started at
+    void *mapping;        // AST file that nodes and text point into after load_ast(), or NULL
+    size_t mapping_size;
+} ASTArena;
+
+// Callbacks for walk_ast(). pre runs before a node's children and returns 0 to skip them; post runs once they are done
+typedef struct
+{
+    int (*pre)(ASTNode *node, int depth, void *data);
+    void (*post)(ASTNode *node, int depth, void *data);
+    void *data;
+} ASTVisitor;
+
 const char *ast_type_to_string(ASTNodeType type);
-ASTNode *build_ast();
-ASTNode *create_ast_node(ASTNodeType type, const char *value);
+uint32_t build_ast();
+uint32_t copy_ast(const ASTArena *from, uint32_t index);
+uint32_t create_ast_node(ASTNodeType type, const char *value);
+uint32_t create_expression_node(uint32_t left, char operator, uint32_t right);
+uint32_t create_span_node(ASTNodeType type, const char *text, size_t length);
+void free_ast();
 ASTNodeType map_token_to_ast_type(State type);
+void mark_assignment(uint32_t slot);
+int parse_next_statement(int *i, uint32_t *statement);
 void print_ast(ASTNode *root, int level);
+void reset_ast();
+void set_node_text(uint32_t index, const char *text);
+void start_basic_block();
+void walk_ast(ASTNode *root, const ASTVisitor *visitor);
+
+// The arena lives in the compiler context, which also provides the node accessors
+#include "compiler.h"
 
 #endif
@@ -0,0 +1,166 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "astfile.h"
+#include "utility.h"
+
+_Static_assert(sizeof(ASTNode) == 16, "AST files store nodes with their in-memory layout");
+
+// Check every node of a mapped file before the arena points into it. Links must point to later slots, which rules out
+// cycles, every value must address text or a symbol that exists, and a shift must be by a literal count the engines
+// accept
+static int valid_nodes(const ASTFileHeader *header, const ASTNode *nodes, const char *text)
+{
+    for (uint32_t i = 1; i < header->node_count; i++)
+    {
+        const ASTNode *node = &nodes[i];
+        if (node->type > AST_WHILE)
+            return 0;
+        if ((node->left && (node->left <= i || node->left >= header->node_count)) ||
+            (node->right && (node->right <= i || node->right >= header->node_count)))
+            return 0;
+        if (node->type == AST_IDENTIFIER || node->type == AST_SETTING)
+        {
+            if ((uint32_t)node->value >= header->symbol_count)
+                return 0;
+        }
+        else if (node->type != AST_INTEGER && (node->value < 0 || (uint32_t)node->value >= header->text_length))
+        {
+            return 0;
+        }
+        int operation = node->type == AST_OPERATOR ? arithmetic_operator(text + node->value) : 0;
+        if ((operation == '<' || operation == '>') &&
+            (!node->right || nodes[node->right].type != AST_INTEGER || !valid_shift(nodes[node->right].value)))
+            return 0;
+    }
+    return 1;
+}
+
+// Write the statements under root and their variables as an AST file, returning 0 on success
+int save_ast(const char *path, ASTNode *root)
+{
+    // Copying into an empty arena leaves out the nodes optimization replaced, and numbers the rest so links point forward
+    uint32_t index = ast_index(root);
+    ASTArena original = compiler->ast_arena;
+    CompilerStats *stats = compiler->stats;
+    memset(&compiler->ast_arena, 0, sizeof(compiler->ast_arena));
+    compiler->stats = NULL;
+    uint32_t copy = copy_ast(&original, index);
+    compiler->stats = stats;
+    ASTArena *arena = &compiler->ast_arena;
+    if (arena->count == 0)
+    {
+        arena->nodes = calloc(1, sizeof(ASTNode));
+        arena->count = 1;
+    }
+
+    // Clear the padding after each type byte, so the same program always gives the same file
+    memset(arena->nodes, 0, sizeof(ASTNode));
+    for (uint32_t i = 1; i < arena->count; i++)
+        memset((char *)&arena->nodes[i] + sizeof(uint8_t), 0, offsetof(ASTNode, left) - sizeof(uint8_t));
+
+    ASTFileHeader header = {AST_FILE_MAGIC, AST_FILE_VERSION, AST_FILE_BYTE_ORDER, sizeof(ASTNode), arena->count, copy};
+    header.text_offset = sizeof(header) + arena->count * sizeof(ASTNode);
+    header.text_length = arena->text_length;
+    header.symbols_offset = header.text_offset + header.text_length;
+    header.symbol_count = compiler->symbol_table.count;
+    for (uint32_t slot = 0; slot < header.symbol_count; slot++)
+        header.symbols_length += strlen(get_symbol(slot)->identifier) + 1;
+
+    FILE *file = fopen(path, "wb");
+    int status = -1;
+    if (file)
+    {
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(arena->nodes, sizeof(ASTNode), arena->count, file);
+        fwrite(arena->text, 1, arena->text_length, file);
+        for (uint32_t slot = 0; slot < header.symbol_count; slot++)
+            fwrite(get_symbol(slot)->identifier, 1, strlen(get_symbol(slot)->identifier) + 1, file);
+        status = ferror(file) ? -1 : 0;
+        if (fclose(file) != 0)
+            status = -1;
+    }
+
+    free_ast();
+    compiler->ast_arena = original;
+    return status;
+}
+
+// Map an AST file written by save_ast() and make it the current arena, without parsing or allocating any node.
+// Returns 0 and the first statement in root, or -1 once the reason the file cannot be used has been reported
+int load_ast(const char *path, uint32_t *root)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    // The mapping is private and read-only. Nodes added later move the arena to the heap first
+    size_t size = info.st_size;
+    void *mapping = size >= sizeof(ASTFileHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: %s is not an AST file.\n", path);
+        return -1;
+    }
+
+    const ASTFileHeader *header = mapping;
+    const char *bytes = mapping;
+    const ASTNode *nodes = (const ASTNode *)(bytes + sizeof(*header));
+    const char *text = bytes + header->text_offset;
+    const char *names = bytes + header->symbols_offset;
+    const char *problem = NULL;
+    if (memcmp(header->magic, AST_FILE_MAGIC, sizeof(header->magic)) != 0)
+        problem = "is not an AST file";
+    else if (header->byte_order != AST_FILE_BYTE_ORDER || header->node_size != sizeof(ASTNode))
+        problem = "was written on a machine with another byte order or node layout";
+    else if (header->version != AST_FILE_VERSION)
+        problem = "was written by another version of the compiler";
+    else if (header->node_count == 0 || header->root >= header->node_count ||
+             header->text_offset != sizeof(*header) + (uint64_t)header->node_count * sizeof(ASTNode) ||
+             header->symbols_offset != (uint64_t)header->text_offset + header->text_length ||
+             (uint64_t)header->symbols_offset + header->symbols_length != size ||
+             (header->text_length && text[header->text_length - 1] != '\0') ||
+             (header->symbols_length && names[header->symbols_length - 1] != '\0') ||
+             !valid_nodes(header, nodes, text))
+        problem = "is damaged";
+
+    // Variables are the only part rebuilt, one table entry each, and must come back in the slots the nodes use
+    const char *name = names;
+    for (uint32_t slot = 0; !problem && slot < header->symbol_count; slot++)
+    {
+        if (name >= names + header->symbols_length || intern_symbol(name, strlen(name)) != slot)
+            problem = "is damaged";
+        else
+            name += strlen(name) + 1;
+    }
+
+    if (problem)
+    {
+        fprintf(stderr, "Error: %s %s.\n", path, problem);
+        munmap(mapping, size);
+        return -1;
+    }
+
+    free_ast();
+    ASTArena *arena = &compiler->ast_arena;
+    arena->nodes = (ASTNode *)nodes;
+    arena->count = arena->capacity = header->node_count;
+    arena->text = (char *)text;
+    arena->text_length = arena->text_capacity = header->text_length;
+    arena->mapping = mapping;
+    arena->mapping_size = size;
+    *root = header->root;
+    return 0;
+}
@@ -0,0 +1,36 @@
+// astfile.h
+#ifndef ASTFILE_H
+#define ASTFILE_H
+
+#include <stdint.h>
+#include "ast.h"
+
+#define AST_FILE_MAGIC "DDDAST\r\n" // Eight bytes that open every AST file
+#define AST_FILE_VERSION 2          // Bump whenever the layout below or the meaning of a node changes
+
+// Header of an AST file. The file holds the arena as it is in memory, so load_ast() can map it and use it in place:
+//   nodes:   node_count ASTNodes, slot 0 unused, every left and right index pointing further into the array
+//   text:    text_length bytes of '\0' terminated node text, addressed by the value of text nodes
+//   symbols: symbol_count '\0' terminated variable names, in the slot order identifier and setting nodes refer to
+// Every field is in the writer's byte order, which byte_order records
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // AST_FILE_BYTE_ORDER as the writer stored it
+    uint32_t node_size;  // sizeof(ASTNode)
+    uint32_t node_count;
+    uint32_t root;       // Index of the first top-level statement, or AST_NULL for an empty program
+    uint32_t text_offset;
+    uint32_t text_length;
+    uint32_t symbols_offset;
+    uint32_t symbols_length;
+    uint32_t symbol_count;
+} ASTFileHeader;
+
+#define AST_FILE_BYTE_ORDER 0x01020304
+
+int load_ast(const char *path, uint32_t *root);
+int save_ast(const char *path, ASTNode *root);
+
+#endif
@@ -0,0 +1,175 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "batch.h"
+#include "binary.h"
+#include "cache.h"
+#include "compiler.h"
+#include "peephole.h"
+
+// Files shared out between the worker threads, plus the totals they report back
+typedef struct
+{
+    char **paths;
+    int count;
+    const BatchOptions *options;
+    const GcodeCache *cache; // Shared Gcode cache, or NULL to compile every file
+    const ExecutionLimits *limits; // Bounds on each compilation, so no program can hold a worker forever, or NULL
+    atomic_int next; // Index of the next file to hand out
+    atomic_int failed;
+    atomic_llong input_bytes;
+    atomic_llong output_bytes;
+} BatchQueue;
+
+// Size of a file in bytes, or 0 if it cannot be read
+static long long file_size(const char *path)
+{
+    struct stat info;
+    return stat(path, &info) == 0 ? (long long)info.st_size : 0;
+}
+
+// Compile one file of the batch into a .gcode file beside it, or a .bin file with --binary, replacing a .ddd extension
+static int compile_batch_file(BatchQueue *queue, const char *path, FILE *diagnostics)
+{
+    const BatchOptions *options = queue->options;
+    const char *extension = options->binary ? ".bin" : ".gcode";
+    size_t length = strlen(path);
+    if (length > 4 && strcmp(path + length - 4, ".ddd") == 0)
+        length -= 4;
+    char *output_path = malloc(length + strlen(extension) + 1);
+    memcpy(output_path, path, length);
+    strcpy(output_path + length, extension);
+
+    FILE *input = fopen(path, "r");
+    GcodeSink sink;
+    if (!input || sink_open_file(&sink, output_path) != 0)
+    {
+        perror(input ? output_path : path);
+        if (input)
+            fclose(input);
+        free(output_path);
+        return EXIT_FAILURE;
+    }
+
+    CompilerContext context;
+    init_compiler(&context, &sink, diagnostics);
+    context.streaming = options->streaming;
+    context.use_tree_walker = options->use_tree_walker;
+    context.fast_lexer = options->fast_lexer;
+    context.unroll_factor = options->unroll_factor;
+    Peephole peephole;
+    if (options->peephole)
+    {
+        init_peephole(&peephole, options->peephole == 2);
+        context.peephole = &peephole;
+    }
+    BinaryGcode binary_encoder;
+    if (options->binary)
+    {
+        init_binary_gcode(&binary_encoder, options->peephole != 2, options->binary == 2);
+        context.binary_output = &binary_encoder;
+    }
+    ExecutionBudget budget;
+    if (queue->limits)
+    {
+        start_budget(&budget, queue->limits, &sink);
+        context.budget = &budget;
+    }
+    int status = queue->cache ? compile_cached(queue->cache, &context, input) : compile_input(&context, input);
+    free_compiler(&context);
+    fclose(input);
+
+    if (sink_close(&sink) != 0)
+        status = EXIT_FAILURE;
+    if (status != EXIT_SUCCESS)
+        fprintf(stderr, "%s: compilation failed\n", path);
+
+    atomic_fetch_add(&queue->input_bytes, file_size(path));
+    atomic_fetch_add(&queue->output_bytes, file_size(output_path));
+    free(output_path);
+    return status;
+}
+
+// Keep taking the next file from the queue until every file has been compiled
+static void *batch_worker(void *data)
+{
+    BatchQueue *queue = data;
+
+    // The AST dumps of a batch are not kept, only the Gcode and the errors
+    FILE *diagnostics = fopen("/dev/null", "w");
+    int index;
+    while ((index = atomic_fetch_add(&queue->next, 1)) < queue->count)
+    {
+        if (compile_batch_file(queue, queue->paths[index], diagnostics) != EXIT_SUCCESS)
+            atomic_fetch_add(&queue->failed, 1);
+    }
+    fclose(diagnostics);
+    return NULL;
+}
+
+// Read a manifest listing one input path per line, skipping blank lines
+char **read_manifest(const char *path, int *count)
+{
+    FILE *manifest = fopen(path, "r");
+    if (!manifest)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    char **paths = NULL;
+    int capacity = 0;
+    char line[4096];
+    *count = 0;
+    while (fgets(line, sizeof(line), manifest))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            paths = realloc(paths, capacity * sizeof(*paths));
+        }
+        paths[(*count)++] = strdup(line);
+    }
+    fclose(manifest);
+    return paths;
+}
+
+// Compile many files on a pool of threads, each with its own compiler context, and report the overall throughput
+int run_batch(char **paths, int count, int jobs, const BatchOptions *options, const GcodeCache *cache,
+              const ExecutionLimits *limits)
+{
+    BatchQueue queue = {paths, count, options, cache, limits};
+    if (jobs <= 0)
+        jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > count)
+        jobs = count > 0 ? count : 1;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t *threads = malloc(jobs * sizeof(*threads));
+    for (int t = 0; t < jobs; t++)
+        pthread_create(&threads[t], NULL, batch_worker, &queue);
+    for (int t = 0; t < jobs; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    int failed = atomic_load(&queue.failed);
+    fprintf(stderr, "Compiled %d files (%d failed) on %d threads in %.3f s: %.1f files/s, %.2f MB/s of source, %.2f MB/s of Gcode\n",
+            count, failed, jobs, seconds, count / seconds,
+            atomic_load(&queue.input_bytes) / seconds / 1e6, atomic_load(&queue.output_bytes) / seconds / 1e6);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,23 @@
+// batch.h
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "budget.h"
+#include "cache.h"
+
+// Options every file of a batch is compiled with
+typedef struct
+{
+    int streaming;
+    int use_tree_walker;
+    int fast_lexer;
+    int unroll_factor;
+    int peephole; // 1 for --peephole, 2 for --strip-comments
+    int binary;   // 1 for --binary, 2 for --compress
+} BatchOptions;
+
+char **read_manifest(const char *path, int *count);
+int run_batch(char **paths, int count, int jobs, const BatchOptions *options, const GcodeCache *cache,
+              const ExecutionLimits *limits);
+
+#endif
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Compile many generated programs with the batch driver at increasing thread counts.
+# Usage: bench/batch.sh [files] [statements_per_file]
+set -e
+cd "$(dirname "$0")/.."
+
+FILES=${1:-400}
+STATEMENTS=${2:-2000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+flex -o "$WORK/lex.yy.c" scanner.l
+gcc -O2 -I. "$WORK/lex.yy.c" ast.c astfile.c batch.c binary.c budget.c bytecode.c cache.c cfg.c compiler.c lexer.c loops.c main.c parallel.c parser.c peephole.c propagate.c server.c simplify.c sink.c source.c stats.c symbols.c utility.c gcode.c -o "$WORK/main" -pthread
+
+# Each file creates its variables, then assigns and prints them in a long straight line with a loop at the end
+mkdir "$WORK/programs"
+for ((f = 0; f < FILES; f++)); do
+    {
+        echo "CREATE X LOW"
+        echo "CREATE Y MEDIUM"
+        echo "CREATE Z HIGH"
+        for ((s = 0; s < STATEMENTS; s += 4)); do
+            echo "X = Y + $((s + f))"
+            echo "Y = X * 3"
+            echo "Z = Z - X"
+            echo "PRINT Z"
+        done
+        echo "WHILE (X > 0) { X = X / 2 }"
+        echo "PRINT X"
+    } > "$WORK/programs/p$f.ddd"
+done
+ls "$WORK"/programs/*.ddd > "$WORK/manifest.txt"
+
+# Double the threads up to the number of cores, so the scaling shows in the files/s column
+CORES=$(nproc)
+jobs=1
+while [ "$jobs" -lt "$CORES" ]; do
+    "$WORK/main" --manifest "$WORK/manifest.txt" -j "$jobs" 2>&1 | tail -n 1
+    jobs=$((jobs * 2))
+done
+"$WORK/main" --manifest "$WORK/manifest.txt" -j "$CORES" 2>&1 | tail -n 1
@@ -0,0 +1,153 @@
+// Compare reading text Gcode with decoding binary Gcode of the same program, and print the results as one line of JSON.
+// Usage: binary <program.gcode> <program.bin> <compressed.bin>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "binary.h"
+
+#define ROUNDS 5 // Each reading is timed this many times and the fastest run is kept
+
+typedef struct
+{
+    uint64_t lines;
+    int64_t sum; // Keeps the compiler from dropping the work
+} Totals;
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static unsigned char *read_file(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    rewind(file);
+    unsigned char *data = malloc(*length + 1);
+    if (fread(data, 1, *length, file) != *length)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    data[*length] = '\0';
+    fclose(file);
+    return data;
+}
+
+// Read text Gcode the way a host would: find each line's command and the value of its axis word
+static void parse_text(const unsigned char *data, size_t length, Totals *totals)
+{
+    const char *line = (const char *)data;
+    const char *end = line + length;
+    while (line < end)
+    {
+        const char *next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        const char *word = NULL;
+        if (strncmp(line, "G92 ", 4) == 0)
+            word = line + 4;
+        else if (strncmp(line, "M117 ", 5) == 0)
+            word = line + 5;
+        else if (strncmp(line, "; Updated ", 10) == 0)
+            word = line + 10;
+        if (word)
+        {
+            // Axis words are the letter followed by the value, update comments spell it out
+            word++;
+            if (strncmp(word, " to ", 4) == 0)
+                word += 4;
+            totals->sum += strtol(word, NULL, 10);
+            totals->lines++;
+        }
+        line = next;
+    }
+}
+
+static void count_line(const GcodeLine *line, void *data)
+{
+    Totals *totals = data;
+    totals->sum += line->value;
+    totals->lines++;
+}
+
+static void decode_records(const unsigned char *data, size_t length, Totals *totals)
+{
+    int comments;
+    if (decode_binary_gcode(data, length, count_line, totals, &comments) != 0)
+        exit(EXIT_FAILURE);
+}
+
+static void decode_text(const unsigned char *data, size_t length, Totals *totals)
+{
+    GcodeSink sink;
+    sink_open_memory(&sink);
+    if (write_binary_as_text(data, length, &sink) != 0)
+        exit(EXIT_FAILURE);
+    totals->lines += sink.written;
+    sink_close(&sink);
+}
+
+// Fastest of several runs of one reader, in seconds
+static double time_reader(void (*reader)(const unsigned char *, size_t, Totals *), const unsigned char *data, size_t length, Totals *totals)
+{
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        memset(totals, 0, sizeof(*totals));
+        double start = now();
+        reader(data, length, totals);
+        double seconds = now() - start;
+        if (round == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+// Throughputs are in bytes of text Gcode per second, so the formats compare directly
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: %s <program.gcode> <program.bin> <compressed.bin>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t text_length, binary_length, compressed_length;
+    unsigned char *text = read_file(argv[1], &text_length);
+    unsigned char *binary = read_file(argv[2], &binary_length);
+    unsigned char *compressed = read_file(argv[3], &compressed_length);
+
+    Totals parsed, decoded, unpacked, as_text;
+    double parse_s = time_reader(parse_text, text, text_length, &parsed);
+    double decode_s = time_reader(decode_records, binary, binary_length, &decoded);
+    double decompress_s = time_reader(decode_records, compressed, compressed_length, &unpacked);
+    double text_s = time_reader(decode_text, compressed, compressed_length, &as_text);
+
+    // Every reader must find the same lines, and the decoded text must be as long as the original
+    if (decoded.lines != parsed.lines || decoded.sum != parsed.sum || unpacked.lines != parsed.lines ||
+        unpacked.sum != parsed.sum || as_text.lines != text_length)
+    {
+        fprintf(stderr, "Error: The binary streams do not match the text.\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("{\"text_bytes\":%zu,\"binary_bytes\":%zu,\"compressed_bytes\":%zu,\"lines\":%llu,"
+           "\"parse_text_s\":%.6f,\"decode_binary_s\":%.6f,\"decode_compressed_s\":%.6f,\"decode_to_text_s\":%.6f,"
+           "\"parse_text_mb_s\":%.1f,\"decode_binary_mb_s\":%.1f,\"decode_compressed_mb_s\":%.1f}\n",
+           text_length, binary_length, compressed_length, (unsigned long long)decoded.lines, parse_s, decode_s,
+           decompress_s, text_s, text_length / parse_s / 1e6, text_length / decode_s / 1e6, text_length / decompress_s / 1e6);
+
+    free(text);
+    free(binary);
+    free(compressed);
+    return EXIT_SUCCESS;
+}
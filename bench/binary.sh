@@ -0,0 +1,30 @@
+#!/bin/bash
+# Compare the size of text, binary, and compressed binary Gcode and how fast each is read back, on generated programs.
+# Usage: bench/binary.sh [max_statements] [depth] [trips] [variables] [seed]
+set -e
+cd "$(dirname "$0")/.."
+
+MAX=${1:-1000000}
+DEPTH=${2:-3}
+TRIPS=${3:-10}
+VARIABLES=${4:-3}
+SEED=${5:-1}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+flex -o "$WORK/lex.yy.c" scanner.l
+gcc -O2 -I. "$WORK/lex.yy.c" ast.c astfile.c batch.c binary.c budget.c bytecode.c cache.c cfg.c compiler.c lexer.c loops.c main.c parallel.c parser.c peephole.c propagate.c server.c simplify.c sink.c source.c stats.c symbols.c utility.c gcode.c -o "$WORK/main" -pthread
+gcc -O2 -I. "$WORK/lex.yy.c" ast.c astfile.c binary.c budget.c bytecode.c cfg.c compiler.c lexer.c loops.c parallel.c parser.c peephole.c propagate.c sink.c source.c stats.c symbols.c utility.c gcode.c bench/binary.c -o "$WORK/binary" -pthread
+gcc -O2 bench/generate.c -o "$WORK/generate"
+
+for ((statements = 1000; statements <= MAX; statements *= 10)); do
+    "$WORK/generate" "$statements" "$DEPTH" "$TRIPS" "$VARIABLES" "$SEED" > "$WORK/program.ddd"
+    "$WORK/main" -o "$WORK/program.gcode" "$WORK/program.ddd" 2>/dev/null
+    "$WORK/main" --binary -o "$WORK/program.bin" "$WORK/program.ddd" 2>/dev/null
+    "$WORK/main" --compress -o "$WORK/compressed.bin" "$WORK/program.ddd" 2>/dev/null
+
+    # Decoding must give back the text output byte for byte
+    "$WORK/main" --decode "$WORK/compressed.bin" | cmp -s - "$WORK/program.gcode" || { echo "Decoded Gcode differs at $statements statements" >&2; exit 1; }
+    result=$("$WORK/binary" "$WORK/program.gcode" "$WORK/program.bin" "$WORK/compressed.bin")
+    echo "{\"statements\":$statements,${result#\{}"
+done
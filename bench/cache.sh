@@ -0,0 +1,28 @@
+#!/bin/bash
+# Compile the same generated programs with an empty Gcode cache, then again with every one of them cached.
+# Usage: bench/cache.sh [files] [statements_per_file]
+set -e
+cd "$(dirname "$0")/.."
+
+FILES=${1:-200}
+STATEMENTS=${2:-5000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+flex -o "$WORK/lex.yy.c" scanner.l
+gcc -O2 -I. "$WORK/lex.yy.c" ast.c astfile.c batch.c binary.c budget.c bytecode.c cache.c cfg.c compiler.c lexer.c loops.c main.c parallel.c parser.c peephole.c propagate.c server.c simplify.c sink.c source.c stats.c symbols.c utility.c gcode.c -o "$WORK/main" -pthread
+gcc -O2 bench/generate.c -o "$WORK/generate"
+
+mkdir "$WORK/programs"
+for ((f = 0; f < FILES; f++)); do
+    "$WORK/generate" "$STATEMENTS" 3 10 3 "$f" > "$WORK/programs/p$f.ddd"
+done
+ls "$WORK"/programs/*.ddd > "$WORK/manifest.txt"
+
+for run in uncached cold warm; do
+    option=()
+    [ "$run" != uncached ] && option=(--cache "$WORK/cache")
+    printf '%-9s' "$run"
+    "$WORK/main" --manifest "$WORK/manifest.txt" -j 1 "${option[@]}" 2>&1 | tail -n 1
+done
+"$WORK/main" --cache "$WORK/cache" --cache-stats
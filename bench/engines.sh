@@ -0,0 +1,69 @@
+#!/bin/bash
+# Compare the tree-walking interpreter (--tree) with the bytecode VM on loop-heavy programs.
+# Usage: bench/engines.sh [outer_iterations] [inner_iterations]
+set -e
+cd "$(dirname "$0")/.."
+
+OUTER=${1:-2000}
+INNER=${2:-1000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+flex -o "$WORK/lex.yy.c" scanner.l
+gcc -O2 -I. "$WORK/lex.yy.c" ast.c astfile.c batch.c binary.c budget.c bytecode.c cache.c cfg.c compiler.c lexer.c loops.c main.c parallel.c parser.c peephole.c propagate.c server.c simplify.c sink.c source.c stats.c symbols.c utility.c gcode.c -o "$WORK/main" -pthread
+
+# Nested counting loops: every iteration updates three variables
+cat > "$WORK/nested.ddd" <<DDD
+CREATE X LOW
+CREATE Y LOW
+CREATE Z LOW
+X = 0
+WHILE (X < $OUTER) {
+X = X + 1
+Y = 0
+WHILE (Y < $INNER) {
+Y = Y + 1
+Z = Z + Y
+Z = Z / 2
+}
+}
+PRINT Z
+DDD
+
+# A single long loop with a branch in its body
+cat > "$WORK/branchy.ddd" <<DDD
+CREATE X LOW
+CREATE Y LOW
+X = 0
+WHILE (X < $((OUTER * INNER))) {
+X = X + 1
+IF (Y < 100) {
+Y = Y + 7
+} ELSE {
+Y = Y - 100
+}
+}
+PRINT Y
+DDD
+
+# Nested formulas whose repeated subexpressions the VM computes once per iteration
+cat > "$WORK/formulas.ddd" <<DDD
+CREATE X LOW
+CREATE Y LOW
+CREATE Z LOW
+X = 0
+WHILE (X < $((OUTER * INNER))) {
+Y = (X * 3 + Z / 5) * (X * 3 + Z / 5) / ((X * 3 + Z / 5) + 1) - Z / 5
+Z = (Y - X * 3) / 2 + (Y - X * 3) / 4
+X = X + 1
+}
+PRINT Z
+DDD
+
+TIMEFORMAT=%R
+printf "%-14s %10s %10s\n" program tree vm
+for program in nested branchy formulas; do
+    tree=$( { time "$WORK/main" --tree "$WORK/$program.ddd" > /dev/null 2>&1; } 2>&1 )
+    vm=$( { time "$WORK/main" "$WORK/$program.ddd" > /dev/null 2>&1; } 2>&1 )
+    printf "%-14s %9ss %9ss\n" "$program" "$tree" "$vm"
+done
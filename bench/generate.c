@@ -0,0 +1,145 @@
+// Generate a valid .ddd program of a given size and shape for benchmarking the compiler phases.
+// Usage: generate <statements> [depth] [trips] [variables] [seed]
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *names[] = {"X", "Y", "Z"}; // The only identifiers the language has
+static const char *parameters[] = {"LOW", "MEDIUM", "HIGH"};
+
+typedef struct
+{
+    long statements; // Statements still to write, counting IF, ELSE, and WHILE as one each
+    int depth;       // Deepest nesting of IF and WHILE blocks
+    int trips;       // Iterations of every WHILE loop
+    int variables;   // Number of variables the program uses, from 1 to 3
+    uint64_t seed;
+    int counters;    // Variables below this index count an enclosing loop and must not be assigned
+} Generator;
+
+// Small deterministic generator, so a seed always gives the same program
+static uint32_t next_random(Generator *generator, uint32_t bound)
+{
+    generator->seed = generator->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)(generator->seed >> 33) % bound;
+}
+
+static void indent(int level)
+{
+    for (int i = 0; i < level; i++)
+        fputs("    ", stdout);
+}
+
+// Write an assignment that keeps values small, so loops of any length neither overflow nor divide by zero
+static void write_assignment(Generator *generator, int level)
+{
+    int target = generator->counters + next_random(generator, generator->variables - generator->counters);
+    const char *source = names[next_random(generator, generator->variables)];
+    indent(level);
+    switch (next_random(generator, 4))
+    {
+    case 0:
+        printf("%s = %s + %u\n", names[target], source, next_random(generator, 100));
+        break;
+    case 1:
+        printf("%s = %s - %u\n", names[target], source, next_random(generator, 100));
+        break;
+    case 2:
+        printf("%s = %s / %u\n", names[target], source, 2 + next_random(generator, 8));
+        break;
+    default:
+        printf("%s = %u * %u\n", names[target], next_random(generator, 100), next_random(generator, 100));
+        break;
+    }
+}
+
+static void write_block(Generator *generator, int level, long statements);
+
+// Write one statement, opening a nested block while the depth and the statement budget allow it
+static void write_statement(Generator *generator, int level, long budget)
+{
+    uint32_t kind = next_random(generator, 10);
+    long inner = budget - 2 < 8 ? budget - 2 : 2 + next_random(generator, 7);
+
+    // Each WHILE counts with a variable of its own, so only as many loops nest as there are variables to spare
+    if (kind == 0 && level < generator->depth && inner >= 1 && generator->counters < generator->variables - 1)
+    {
+        const char *counter = names[generator->counters];
+        indent(level);
+        printf("%s = 0\n", counter);
+        indent(level);
+        printf("WHILE (%s < %d) {\n", counter, generator->trips);
+        generator->statements -= 2;
+        generator->counters++;
+        write_block(generator, level + 1, inner - 1);
+        indent(level + 1);
+        printf("%s = %s + 1\n", counter, counter);
+        generator->statements--;
+        generator->counters--;
+        indent(level);
+        puts("}");
+    }
+    else if (kind == 1 && level < generator->depth && inner >= 2)
+    {
+        indent(level);
+        printf("IF (%s > %u) {\n", names[next_random(generator, generator->variables)], next_random(generator, 100));
+        generator->statements -= 2;
+        write_block(generator, level + 1, inner / 2);
+        indent(level);
+        puts("} ELSE {");
+        write_block(generator, level + 1, inner - inner / 2);
+        indent(level);
+        puts("}");
+    }
+    else if (kind < 5)
+    {
+        indent(level);
+        printf("PRINT %s\n", names[next_random(generator, generator->variables)]);
+        generator->statements--;
+    }
+    else if (generator->counters < generator->variables)
+    {
+        write_assignment(generator, level);
+        generator->statements--;
+    }
+    else
+    {
+        indent(level);
+        printf("PRINT %s\n", names[0]);
+        generator->statements--;
+    }
+}
+
+// Write statements until a block's share of the budget, or the whole program's, is used up
+static void write_block(Generator *generator, int level, long statements)
+{
+    long stop = generator->statements - statements;
+    do
+        write_statement(generator, level, generator->statements - stop);
+    while (generator->statements > stop && generator->statements > 0);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <statements> [depth] [trips] [variables] [seed]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Generator generator = {atol(argv[1]), argc > 2 ? atoi(argv[2]) : 3, argc > 3 ? atoi(argv[3]) : 10,
+                           argc > 4 ? atoi(argv[4]) : 3, argc > 5 ? strtoull(argv[5], NULL, 10) : 1, 0};
+    if (generator.variables < 1 || generator.variables > 3)
+    {
+        fprintf(stderr, "Error: Programs can only use 1 to 3 variables (X, Y, and Z).\n");
+        return EXIT_FAILURE;
+    }
+
+    // Every variable is created first, then the rest of the budget goes to the program body
+    for (int v = 0; v < generator.variables; v++)
+        printf("CREATE %s %s\n", names[v], parameters[next_random(&generator, 3)]);
+    generator.statements -= generator.variables;
+    while (generator.statements > 0)
+        write_statement(&generator, 0, generator.statements);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+// Per-call latency of compiling small programs held in memory, against the temp-file route it replaces
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "compiler.h"
+
+// Small programs of the kind a print queue builds for each job
+static const char *programs[] = {
+    "CREATE X LOW\nPRINT X\n",
+    "CREATE X LOW\nCREATE Y MEDIUM\nX = Y + 5\nIF (X > 10) {\n    PRINT X\n} ELSE {\n    PRINT Y\n}\n",
+    "CREATE X LOW\nCREATE Z HIGH\nWHILE (X < 40) {\n    X = X + 1\n    Z = Z - X\n    PRINT Z\n}\nSET SPEED HIGH\n",
+};
+
+typedef enum
+{
+    IN_PLACE,
+    COPIED,
+    TEMP_FILE,
+} Route;
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Compile one program by the given route into a memory sink, as a caller would for each job
+static int compile_once(Route route, const char *source, size_t length, char *padded, FILE *diagnostics, GcodeSink *sink)
+{
+    CompilerContext context;
+    init_compiler(&context, sink, diagnostics);
+    int status;
+
+    switch (route)
+    {
+    case IN_PLACE:
+        status = compile_buffer(&context, padded, length + COMPILER_BUFFER_PADDING);
+        break;
+    case COPIED:
+        status = compile_bytes(&context, source, length);
+        break;
+    default:
+    {
+        // What the service did before: write the program out, then read it back
+        char path[] = "/tmp/latencyXXXXXX";
+        int fd = mkstemp(path);
+        FILE *file = fdopen(fd, "w+");
+        fwrite(source, 1, length, file);
+        rewind(file);
+        status = compile_input(&context, file);
+        fclose(file);
+        unlink(path);
+        break;
+    }
+    }
+    free_compiler(&context);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    int calls = argc > 1 ? atoi(argv[1]) : 20000;
+    static const char *route_names[] = {"compile_buffer", "compile_bytes", "temp file"};
+    FILE *diagnostics = fopen("/dev/null", "w");
+    double *latencies = malloc(calls * sizeof(double));
+
+    printf("%-8s %-15s %10s %10s %10s\n", "program", "route", "median us", "p99 us", "calls/s");
+    for (size_t p = 0; p < sizeof(programs) / sizeof(programs[0]); p++)
+    {
+        // The in-place route needs the source followed by its zero padding, which a caller builds once
+        size_t length = strlen(programs[p]);
+        char *padded = calloc(length + COMPILER_BUFFER_PADDING, 1);
+        memcpy(padded, programs[p], length);
+
+        for (Route route = IN_PLACE; route <= TEMP_FILE; route++)
+        {
+            GcodeSink sink;
+            sink_open_memory(&sink);
+            double started = now();
+            for (int call = 0; call < calls; call++)
+            {
+                // The sink keeps its buffer between calls, as a long-running caller would
+                sink.length = 0;
+                double start = now();
+                if (compile_once(route, programs[p], length, padded, diagnostics, &sink) != EXIT_SUCCESS)
+                {
+                    fprintf(stderr, "Program %zu failed to compile\n", p + 1);
+                    return EXIT_FAILURE;
+                }
+                latencies[call] = now() - start;
+            }
+            double elapsed = now() - started;
+            sink_close(&sink);
+
+            qsort(latencies, calls, sizeof(double), compare_doubles);
+            printf("%-8zu %-15s %10.2f %10.2f %10.0f\n", p + 1, route_names[route], latencies[calls / 2] * 1e6,
+                   latencies[(int)(calls * 0.99)] * 1e6, calls / elapsed);
+        }
+        free(padded);
+    }
+
+    free(latencies);
+    fclose(diagnostics);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,12 @@
+#!/bin/bash
+# Measure the per-call latency of compiling small in-memory programs with the library entry points.
+# Usage: bench/latency.sh [calls_per_program]
+set -e
+cd "$(dirname "$0")/.."
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+flex -o "$WORK/lex.yy.c" scanner.l
+gcc -O2 -I. "$WORK/lex.yy.c" ast.c astfile.c binary.c budget.c bytecode.c cfg.c compiler.c lexer.c loops.c parallel.c parser.c peephole.c propagate.c simplify.c sink.c source.c stats.c symbols.c utility.c gcode.c bench/latency.c -o "$WORK/latency" -pthread
+"$WORK/latency" "${1:-20000}"
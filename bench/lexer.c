@@ -0,0 +1,125 @@
+// Scan a program with the flex scanner and with the hand-written lexer, check that both give the same tokens, and
+// print how fast each one reads the source as one line of JSON.
+// Usage: lexer <program.ddd>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "compiler.h"
+
+#define ROUNDS 5 // Each scanner is timed this many times and the fastest run is kept
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static FILE *open_program(const char *path)
+{
+    FILE *input = fopen(path, "r");
+    if (!input)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    return input;
+}
+
+// Scan a whole file with one scanner, returning the number of tokens. Opening the file is timed too, since the
+// hand-written lexer maps it there
+static int scan_file(CompilerContext *context, const char *path, double *seconds)
+{
+    compiler = context;
+    double start = now();
+    FILE *input = open_program(path);
+    open_scanner(input);
+    int count = 0;
+    while (get_token(count)->type != END_OF_INPUT)
+        count++;
+    close_scanner();
+    fclose(input);
+    *seconds = now() - start;
+    return count;
+}
+
+// Fastest of several scans, in seconds
+static double time_scanner(CompilerContext *context, const char *path, int *tokens)
+{
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        double seconds;
+        *tokens = scan_file(context, path, &seconds);
+        if (round == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+// Scan with both scanners side by side, switching compilations token by token. Returns 0 if the streams match
+static int compare_streams(CompilerContext *flex, CompilerContext *lexer, const char *path)
+{
+    FILE *flex_input = open_program(path);
+    FILE *lexer_input = open_program(path);
+    compiler = flex;
+    open_scanner(flex_input);
+    compiler = lexer;
+    open_scanner(lexer_input);
+
+    int status = 0;
+    for (int index = 0;; index++)
+    {
+        compiler = flex;
+        Token expected = *get_token(index);
+        compiler = lexer;
+        Token *token = get_token(index);
+        if (token->type != expected.type || token->offset != expected.offset || token->length != expected.length)
+        {
+            fprintf(stderr, "Error: Token %d is type %d at %u+%u from flex but type %d at %u+%u from the lexer.\n", index,
+                    expected.type, expected.offset, expected.length, token->type, token->offset, token->length);
+            status = -1;
+            break;
+        }
+        if (expected.type == END_OF_INPUT)
+            break;
+    }
+
+    compiler = flex;
+    close_scanner();
+    compiler = lexer;
+    close_scanner();
+    fclose(flex_input);
+    fclose(lexer_input);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <program.ddd>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    CompilerContext flex, lexer;
+    init_compiler(&flex, NULL, stderr);
+    init_compiler(&lexer, NULL, stderr);
+    lexer.fast_lexer = 1;
+    if (compare_streams(&flex, &lexer, argv[1]) != 0)
+        return EXIT_FAILURE;
+
+    FILE *input = open_program(argv[1]);
+    fseek(input, 0, SEEK_END);
+    long bytes = ftell(input);
+    fclose(input);
+
+    int flex_tokens, lexer_tokens;
+    double flex_s = time_scanner(&flex, argv[1], &flex_tokens);
+    double lexer_s = time_scanner(&lexer, argv[1], &lexer_tokens);
+
+    printf("{\"bytes\":%ld,\"tokens\":%d,\"flex_s\":%.6f,\"lexer_s\":%.6f,\"flex_mb_s\":%.1f,\"lexer_mb_s\":%.1f,"
+           "\"speedup\":%.2f}\n",
+           bytes, lexer_tokens, flex_s, lexer_s, bytes / flex_s / 1e6, bytes / lexer_s / 1e6, flex_s / lexer_s);
+    return EXIT_SUCCESS;
+}
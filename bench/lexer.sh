@@ -0,0 +1,28 @@
+#!/bin/bash
+# Compare how fast the flex scanner and the hand-written --fast-lexer read generated programs, after checking that
+# both give the same token stream for them and for the sample programs.
+# Usage: bench/lexer.sh [max_statements] [depth] [trips] [variables] [seed]
+set -e
+cd "$(dirname "$0")/.."
+
+MAX=${1:-1000000}
+DEPTH=${2:-3}
+TRIPS=${3:-10}
+VARIABLES=${4:-3}
+SEED=${5:-1}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+flex -o "$WORK/lex.yy.c" scanner.l
+gcc -O2 -I. "$WORK/lex.yy.c" ast.c astfile.c binary.c budget.c bytecode.c cfg.c compiler.c lexer.c loops.c parallel.c parser.c peephole.c propagate.c simplify.c sink.c source.c stats.c symbols.c utility.c gcode.c bench/lexer.c -o "$WORK/lexer" -pthread
+gcc -O2 bench/generate.c -o "$WORK/generate"
+
+for program in test_*.ddd; do
+    "$WORK/lexer" "$program" > /dev/null || { echo "Token streams differ on $program" >&2; exit 1; }
+done
+
+for ((statements = 1000; statements <= MAX; statements *= 10)); do
+    "$WORK/generate" "$statements" "$DEPTH" "$TRIPS" "$VARIABLES" "$SEED" > "$WORK/program.ddd"
+    result=$("$WORK/lexer" "$WORK/program.ddd")
+    echo "{\"statements\":$statements,${result#\{}"
+done
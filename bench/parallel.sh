@@ -0,0 +1,69 @@
+#!/bin/bash
+# Time -j on a program that splits into independent loops, and check that a program failing early stops as fast as
+# a serial run even though segments after the failure never end.
+# Usage: bench/parallel.sh [segments] [trips]
+set -e
+cd "$(dirname "$0")/.."
+
+SEGMENTS=${1:-16}
+TRIPS=${2:-1000000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+flex -o "$WORK/lex.yy.c" scanner.l
+gcc -O2 -I. "$WORK/lex.yy.c" ast.c astfile.c batch.c binary.c budget.c bytecode.c cache.c cfg.c compiler.c lexer.c loops.c main.c parallel.c parser.c peephole.c propagate.c server.c simplify.c sink.c source.c stats.c symbols.c utility.c gcode.c -o "$WORK/main" -pthread
+
+# Every segment starts by assigning each variable a constant, then runs a loop no closed form covers
+{
+    echo "CREATE X LOW"
+    echo "CREATE Y LOW"
+    echo "CREATE Z LOW"
+    for ((s = 0; s < SEGMENTS; s++)); do
+        echo "X = 0"
+        echo "Y = $s"
+        echo "Z = 0"
+        echo "WHILE (X < $TRIPS) {"
+        echo "X = X + 1"
+        echo "Y = Y * 3 + X"
+        echo "Y = Y / 2"
+        echo "Z = Z + Y"
+        echo "}"
+        echo "PRINT Z"
+    done
+} > "$WORK/split.ddd"
+
+# Fails on a division by zero after one long loop. The segments after it run another long loop and one that never
+# ends, so a -j run only finishes if they are cancelled
+cat > "$WORK/fails.ddd" <<DDD
+CREATE X LOW
+CREATE Y LOW
+CREATE Z LOW
+WHILE (Z < $((TRIPS * 3))) {
+Z = Z + 1
+}
+X = 0
+Y = 5 / X
+Y = 1
+Z = 0
+WHILE (Z < $((TRIPS * 3))) {
+Z = Z + 1
+}
+WHILE (Y > 0) {
+X = 1
+}
+DDD
+
+TIMEFORMAT=%R
+printf "%-8s %8s %10s\n" program threads seconds
+for program in split fails; do
+    "$WORK/main" "$WORK/$program.ddd" > "$WORK/serial.gcode" 2> /dev/null && serial=0 || serial=$?
+    for threads in 1 2 4 8; do
+        { time timeout 60 "$WORK/main" -j $threads "$WORK/$program.ddd" > "$WORK/parallel.gcode" 2> /dev/null; } 2> "$WORK/time" && status=0 || status=$?
+        seconds=$(cat "$WORK/time")
+        if [ "$status" != "$serial" ] || ! cmp -s "$WORK/serial.gcode" "$WORK/parallel.gcode"; then
+            echo "$program -j $threads: exit status $status or Gcode differs from the serial run" >&2
+            exit 1
+        fi
+        printf "%-8s %8s %9ss\n" "$program" "$threads" "$seconds"
+    done
+done
@@ -0,0 +1,118 @@
+// Time each compiler phase on one program and print the results as a single line of JSON.
+// Usage: phases [--tree] <program.ddd> <output.gcode>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "bytecode.h"
+#include "compiler.h"
+#include "gcode.h"
+#include "utility.h"
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    int use_tree_walker = argc > 1 && strcmp(argv[1], "--tree") == 0;
+    if (argc != 3 + use_tree_walker)
+    {
+        fprintf(stderr, "Usage: %s [--tree] <program.ddd> <output.gcode>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *path = argv[1 + use_tree_walker];
+    const char *output_path = argv[2 + use_tree_walker];
+
+    FILE *input = fopen(path, "r");
+    GcodeSink sink;
+    if (!input || sink_open_file(&sink, output_path) != 0)
+    {
+        perror(input ? output_path : path);
+        return EXIT_FAILURE;
+    }
+
+    // The phases are run one by one here, so the compilation is set up by hand instead of through compile_input()
+    FILE *diagnostics = fopen("/dev/null", "w");
+    CompilerContext context;
+    init_compiler(&context, &sink, diagnostics);
+    compiler = &context;
+    if (setjmp(context.failure) != 0)
+    {
+        fprintf(stderr, "%s: compilation failed\n", path);
+        return EXIT_FAILURE;
+    }
+
+    // Scan the whole input once on its own, then again as build_ast() pulls tokens, so build_ast includes scanning
+    double start = now();
+    open_scanner(input);
+    int tokens = 0;
+    while (get_token(tokens)->type != END_OF_INPUT)
+        tokens++;
+    close_scanner();
+    double scan = now() - start;
+    rewind(input);
+
+    start = now();
+    open_scanner(input);
+    ASTNode *ast = ast_node(build_ast());
+    close_scanner();
+    double parse = now() - start;
+    uint32_t nodes = context.ast_arena.count;
+
+    start = now();
+    fold_constants(ast);
+    double fold = now() - start;
+
+    start = now();
+    propagate_constants(ast);
+    double propagate = now() - start;
+
+    start = now();
+    mark_counted_loops(ast);
+    double counted = now() - start;
+
+    start = now();
+    ast = eliminate_dead_code(ast);
+    double dead_code = now() - start;
+
+    // The tree walker generates Gcode in one go, while the VM lowers the AST first and then runs it
+    double lower = 0;
+    start = now();
+    if (use_tree_walker)
+    {
+        generate_gcode(ast);
+    }
+    else
+    {
+        BytecodeProgram *program = compile_bytecode(ast);
+        lower = now() - start;
+        start = now();
+        run_bytecode(program);
+        free_bytecode(program);
+    }
+    double run = now() - start;
+
+    int failed = sink_close(&sink) != 0;
+    struct stat output;
+    struct rusage usage;
+    stat(output_path, &output);
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\"engine\":\"%s\",\"tokens\":%d,\"ast_nodes\":%u,\"scan_s\":%.6f,\"build_ast_s\":%.6f,\"fold_constants_s\":%.6f,"
+           "\"propagate_constants_s\":%.6f,\"mark_counted_loops_s\":%.6f,\"eliminate_dead_code_s\":%.6f,\"lower_s\":%.6f,"
+           "\"generate_gcode_s\":%.6f,\"peak_rss_kb\":%ld,\"output_bytes\":%lld}\n",
+           use_tree_walker ? "tree" : "vm", tokens, nodes, scan, parse, fold, propagate, counted, dead_code, lower, run,
+           usage.ru_maxrss, (long long)output.st_size);
+
+    free_compiler(&context);
+    compiler = NULL;
+    fclose(diagnostics);
+    fclose(input);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Time every compiler phase on generated programs from 1K to 10M statements, one JSON object per line.
+# Save the output of two commits and compare them line by line to spot regressions.
+# Usage: bench/phases.sh [max_statements] [depth] [trips] [variables] [seed] > results.jsonl
+set -e
+cd "$(dirname "$0")/.."
+
+MAX=${1:-10000000}
+DEPTH=${2:-3}
+TRIPS=${3:-10}
+VARIABLES=${4:-3}
+SEED=${5:-1}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+flex -o "$WORK/lex.yy.c" scanner.l
+gcc -O2 -I. "$WORK/lex.yy.c" ast.c astfile.c binary.c budget.c bytecode.c cfg.c compiler.c lexer.c loops.c parallel.c parser.c peephole.c propagate.c simplify.c sink.c source.c stats.c symbols.c utility.c gcode.c bench/phases.c -o "$WORK/phases" -pthread
+gcc -O2 bench/generate.c -o "$WORK/generate"
+
+for ((statements = 1000; statements <= MAX; statements *= 10)); do
+    "$WORK/generate" "$statements" "$DEPTH" "$TRIPS" "$VARIABLES" "$SEED" > "$WORK/program.ddd"
+    bytes=$(wc -c < "$WORK/program.ddd")
+    for engine in vm tree; do
+        flag=$([ "$engine" = tree ] && echo --tree || true)
+        result=$("$WORK/phases" $flag "$WORK/program.ddd" "$WORK/program.gcode")
+        echo "{\"commit\":\"$COMMIT\",\"statements\":$statements,\"depth\":$DEPTH,\"trips\":$TRIPS,\"variables\":$VARIABLES,\"seed\":$SEED,\"input_bytes\":$bytes,${result#\{}"
+    done
+done
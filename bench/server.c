@@ -0,0 +1,107 @@
+// Edit-to-Gcode latency of the compile server against compiling the whole program again.
+// Usage: server <program.ddd> [edits]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "server.h"
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Find the start of the top-level line closest to a fraction of the way through the source
+static size_t top_level_line(const char *source, size_t length, double fraction)
+{
+    size_t target = (size_t)(length * fraction);
+    int depth = 0;
+    size_t line = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (source[i] == '{')
+            depth++;
+        else if (source[i] == '}')
+            depth--;
+        else if (source[i] == '\n' && depth == 0)
+        {
+            line = i + 1;
+            if (i >= target && line < length && source[line] != '}' && source[line] != ' ')
+                return line;
+        }
+    }
+    return line;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <program.ddd> [edits]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int edits = argc > 2 ? atoi(argv[2]) : 20;
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t length = ftell(file);
+    rewind(file);
+    char *source = malloc(length + 64);
+    if (fread(source, 1, length, file) != length)
+        return EXIT_FAILURE;
+    fclose(file);
+
+    CompileServer server;
+    ServerReport report;
+    GcodeSink gcode;
+    init_server(&server, 0, NULL);
+    sink_open_memory(&gcode);
+
+    // The first request compiles everything, like a standalone run
+    double start = now();
+    if (server_compile(&server, source, length, &gcode, &report) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    printf("%-22s %10.3f ms  (%u chunks, %zu bytes of Gcode)\n", "cold compile", (now() - start) * 1e3, report.chunks, gcode.length);
+
+    // Each edit inserts a PRINT before a top-level line, and the next edit takes it out again
+    const char *inserted = "PRINT X\n";
+    size_t inserted_length = strlen(inserted);
+    char *edited = malloc(length + inserted_length);
+    const double positions[] = {0.1, 0.5, 0.9};
+    for (int p = 0; p < 3; p++)
+    {
+        size_t line = top_level_line(source, length, positions[p]);
+        memcpy(edited, source, line);
+        memcpy(edited + line, inserted, inserted_length);
+        memcpy(edited + line + inserted_length, source + line, length - line);
+
+        double total = 0;
+        ServerReport last = {0};
+        for (int e = 0; e < edits; e++)
+        {
+            gcode.length = 0;
+            start = now();
+            int insert = e % 2 == 0;
+            if (server_compile(&server, insert ? edited : source, insert ? length + inserted_length : length, &gcode, &report) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            total += now() - start;
+            if (insert)
+                last = report;
+        }
+        printf("edit at %3.0f%%           %10.3f ms  (parsed %u, propagated %u, analyzed %u, generated %u chunks)\n",
+               positions[p] * 100, total / edits * 1e3, last.parsed, last.propagated, last.analyzed, last.generated);
+    }
+
+    free(edited);
+    free(source);
+    sink_close(&gcode);
+    free_server(&server);
+    return EXIT_SUCCESS;
+}
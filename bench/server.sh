@@ -0,0 +1,16 @@
+#!/bin/bash
+# Measure how long the compile server takes to turn a one-line edit of a large program into Gcode.
+# Usage: bench/server.sh [statements] [edits]
+set -e
+cd "$(dirname "$0")/.."
+
+STATEMENTS=${1:-200000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+flex -o "$WORK/lex.yy.c" scanner.l
+gcc -O2 -I. "$WORK/lex.yy.c" ast.c astfile.c binary.c budget.c bytecode.c cfg.c compiler.c lexer.c loops.c parallel.c parser.c peephole.c propagate.c server.c simplify.c sink.c source.c stats.c symbols.c utility.c gcode.c bench/server.c -o "$WORK/server" -pthread
+gcc -O2 bench/generate.c -o "$WORK/generate"
+
+"$WORK/generate" "$STATEMENTS" > "$WORK/program.ddd"
+"$WORK/server" "$WORK/program.ddd" "${2:-20}"
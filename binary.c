@@ -0,0 +1,515 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "binary.h"
+
+#define BLOCK_HEADER_SIZE 13   // Flags byte, stored length, raw length, and checksum
+#define RECORD_MARGIN 24       // Bytes a record takes at most, apart from the strings it defines
+#define MINIMUM_MATCH 4        // Shortest repeat the compressor encodes as a match
+#define LAST_LITERALS 8        // Bytes at the end of a block that are always stored as literals
+#define MATCH_HASH_BITS 12
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table()
+{
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320u : crc >> 1;
+        crc_table[byte] = crc;
+    }
+}
+
+// CRC-32 as used by zip and PNG
+static uint32_t crc32(const unsigned char *data, size_t length)
+{
+    pthread_once(&crc_once, build_crc_table);
+    uint32_t crc = 0xffffffffu;
+    for (size_t i = 0; i < length; i++)
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffu;
+}
+
+static void put_u32(unsigned char *out, uint32_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+static uint32_t get_u32(const unsigned char *in)
+{
+    return in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static size_t put_varint(unsigned char *out, uint32_t value)
+{
+    size_t length = 0;
+    while (value >= 0x80)
+    {
+        out[length++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[length++] = value;
+    return length;
+}
+
+// Read a varint of at most 32 bits, returning 0 if it runs past the end of the data
+static int get_varint(const unsigned char *data, size_t length, size_t *position, uint32_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 35 && *position < length; shift += 7)
+    {
+        unsigned char byte = data[(*position)++];
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+// Add to a length already stored in a token nibble, in LZ4's style of 255-valued bytes and a final smaller one
+static int put_length(unsigned char *out, size_t *position, size_t capacity, size_t extra)
+{
+    for (; extra >= 255; extra -= 255)
+    {
+        if (*position >= capacity)
+            return 0;
+        out[(*position)++] = 255;
+    }
+    if (*position >= capacity)
+        return 0;
+    out[(*position)++] = extra;
+    return 1;
+}
+
+static int get_length(const unsigned char *in, size_t length, size_t *position, size_t *value)
+{
+    unsigned char byte;
+    do
+    {
+        if (*position >= length)
+            return 0;
+        byte = in[(*position)++];
+        *value += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+// Write one sequence of literals, followed by a match unless match_length is 0
+static int put_sequence(unsigned char *out, size_t *position, size_t capacity, const unsigned char *literals,
+                        size_t literal_length, size_t offset, size_t match_length)
+{
+    if (*position >= capacity)
+        return 0;
+    size_t token = (*position)++;
+    size_t match_code = match_length ? match_length - MINIMUM_MATCH : 0;
+    out[token] = (literal_length < 15 ? literal_length : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if (literal_length >= 15 && !put_length(out, position, capacity, literal_length - 15))
+        return 0;
+    if (literal_length > capacity - *position)
+        return 0;
+    memcpy(out + *position, literals, literal_length);
+    *position += literal_length;
+    if (!match_length)
+        return 1;
+
+    if (capacity - *position < 2)
+        return 0;
+    out[(*position)++] = offset;
+    out[(*position)++] = offset >> 8;
+    return match_code < 15 || put_length(out, position, capacity, match_code - 15);
+}
+
+// Greedy LZ77 in the LZ4 block layout, finding repeats through a hash of the next four bytes.
+// Returns the compressed length, or 0 when the result would not fit in capacity
+static size_t compress_block(const unsigned char *in, size_t length, unsigned char *out, size_t capacity)
+{
+    uint32_t table[1 << MATCH_HASH_BITS] = {0}; // Last position plus one where each hashed sequence started
+    size_t anchor = 0;
+    size_t position = 0;
+    size_t i = 0;
+
+    while (length >= LAST_LITERALS && i + LAST_LITERALS <= length)
+    {
+        uint32_t sequence;
+        memcpy(&sequence, in + i, 4);
+        uint32_t slot = (sequence * 2654435761u) >> (32 - MATCH_HASH_BITS);
+        size_t candidate = table[slot];
+        table[slot] = i + 1;
+        if (!candidate || i - (candidate - 1) > 0xffff || memcmp(in + candidate - 1, in + i, MINIMUM_MATCH) != 0)
+        {
+            i++;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t match_length = MINIMUM_MATCH;
+        while (i + match_length + LAST_LITERALS <= length && in[match + match_length] == in[i + match_length])
+            match_length++;
+        if (!put_sequence(out, &position, capacity, in + anchor, i - anchor, i - match, match_length))
+            return 0;
+        i += match_length;
+        anchor = i;
+    }
+    return put_sequence(out, &position, capacity, in + anchor, length - anchor, 0, 0) ? position : 0;
+}
+
+// Undo compress_block(), checking every length and offset against both buffers
+static int decompress_block(const unsigned char *in, size_t length, unsigned char *out, size_t raw_length)
+{
+    size_t i = 0;
+    size_t position = 0;
+    while (i < length)
+    {
+        unsigned char token = in[i++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !get_length(in, length, &i, &literals))
+            return 0;
+        if (literals > length - i || literals > raw_length - position)
+            return 0;
+        memcpy(out + position, in + i, literals);
+        i += literals;
+        position += literals;
+
+        // The last sequence has no match
+        if (i == length)
+            break;
+        if (length - i < 2)
+            return 0;
+        size_t offset = in[i] | in[i + 1] << 8;
+        i += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !get_length(in, length, &i, &match_length))
+            return 0;
+        match_length += MINIMUM_MATCH;
+        if (offset == 0 || offset > position || match_length > raw_length - position)
+            return 0;
+
+        // Matches may overlap the bytes they produce, so they are copied a byte at a time
+        for (size_t k = 0; k < match_length; k++, position++)
+            out[position] = out[position - offset];
+    }
+    return position == raw_length;
+}
+
+void init_binary_gcode(BinaryGcode *encoder, int comments, int compress)
+{
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->comments = comments;
+    encoder->compress = compress;
+}
+
+static void reserve(BinaryGcode *encoder, size_t length)
+{
+    if (encoder->length + length <= encoder->capacity)
+        return;
+    while (encoder->length + length > encoder->capacity)
+        encoder->capacity = encoder->capacity ? encoder->capacity * 2 : BINARY_BLOCK_SIZE + RECORD_MARGIN;
+    encoder->block = realloc(encoder->block, encoder->capacity);
+    if (!encoder->block)
+    {
+        fprintf(stderr, "Error: Out of memory for binary Gcode.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void write_stream_header(BinaryGcode *encoder, GcodeSink *sink)
+{
+    if (encoder->started)
+        return;
+    unsigned char header[9];
+    memcpy(header, BINARY_MAGIC, 7);
+    header[7] = BINARY_VERSION;
+    header[8] = encoder->comments ? BINARY_FLAG_COMMENTS : 0;
+    sink_write(sink, (const char *)header, sizeof(header));
+    encoder->started = 1;
+}
+
+// Checksum, compress if asked and worth it, and write the block being filled, then start the next one from scratch
+static void flush_block(BinaryGcode *encoder, GcodeSink *sink)
+{
+    write_stream_header(encoder, sink);
+    if (encoder->length)
+    {
+        const unsigned char *payload = encoder->block;
+        size_t stored = encoder->length;
+        unsigned char header[BLOCK_HEADER_SIZE] = {0};
+        if (encoder->compress)
+        {
+            if (!encoder->packed)
+                encoder->packed = malloc(encoder->capacity);
+            encoder->packed = realloc(encoder->packed, encoder->capacity);
+            size_t packed = compress_block(encoder->block, encoder->length, encoder->packed, encoder->length - 1);
+            if (packed)
+            {
+                payload = encoder->packed;
+                stored = packed;
+                header[0] = BINARY_FLAG_COMPRESSED;
+            }
+        }
+        put_u32(header + 1, stored);
+        put_u32(header + 5, encoder->length);
+        put_u32(header + 9, crc32(encoder->block, encoder->length));
+        sink_write(sink, (const char *)header, sizeof(header));
+        sink_write(sink, (const char *)payload, stored);
+    }
+
+    for (uint32_t i = 0; i < encoder->string_count; i++)
+        free(encoder->strings[i]);
+    encoder->string_count = 0;
+    encoder->length = 0;
+}
+
+// Find a string among those the block defined, defining it if it is new. Names come from the symbol table and
+// keep their address for the whole compilation, so they are matched by pointer before their text is compared
+static uint32_t find_string(BinaryGcode *encoder, const char *text, int is_name)
+{
+    for (uint32_t i = 0; i < encoder->string_count; i++)
+    {
+        if (is_name && encoder->names[i] == text)
+            return i;
+        if (strcmp(encoder->strings[i], text) == 0)
+        {
+            if (is_name)
+                encoder->names[i] = text;
+            return i;
+        }
+    }
+
+    uint32_t index = encoder->string_count++;
+    size_t length = strlen(text);
+    encoder->strings[index] = strdup(text);
+    encoder->names[index] = is_name ? text : NULL;
+    encoder->last_values[index] = 0;
+    reserve(encoder, length + 6);
+    encoder->block[encoder->length++] = 0;
+    encoder->length += put_varint(encoder->block + encoder->length, length);
+    memcpy(encoder->block + encoder->length, text, length);
+    encoder->length += length;
+    return index;
+}
+
+// Append one line to the block, writing the block out first once it is full or out of string slots
+void encode_binary_line(BinaryGcode *encoder, GcodeSink *sink, const GcodeLine *line)
+{
+    if (line->kind == GCODE_DROPPED)
+        return;
+    if (encoder->length >= BINARY_BLOCK_SIZE || encoder->string_count + 2 > BINARY_STRINGS)
+        flush_block(encoder, sink);
+
+    uint32_t name = find_string(encoder, line->name, 1);
+    uint32_t parameter = line->kind == GCODE_INITIALIZE ? find_string(encoder, line->parameter, 0) : 0;
+    reserve(encoder, RECORD_MARGIN);
+
+    unsigned char *out = encoder->block + encoder->length;
+    size_t length = 0;
+    out[length++] = line->kind | (name < 63 ? name : 63) << 2;
+    if (name >= 63)
+        length += put_varint(out + length, name);
+    if (line->kind == GCODE_INITIALIZE)
+        length += put_varint(out + length, parameter);
+
+    // Values change by small steps from line to line, which zigzag coding keeps to a byte or two in either direction
+    int32_t change = (int32_t)((uint32_t)line->value - encoder->last_values[name]);
+    length += put_varint(out + length, ((uint32_t)change << 1) ^ (uint32_t)(change >> 31));
+    encoder->last_values[name] = line->value;
+    encoder->length += length;
+}
+
+// Write the last block and the end marker, which tells a decoder that the stream is complete
+void finish_binary_gcode(BinaryGcode *encoder, GcodeSink *sink)
+{
+    flush_block(encoder, sink);
+    unsigned char end[BLOCK_HEADER_SIZE] = {0};
+    sink_write(sink, (const char *)end, sizeof(end));
+    free(encoder->block);
+    free(encoder->packed);
+    encoder->block = encoder->packed = NULL;
+    encoder->capacity = 0;
+    encoder->started = 0;
+}
+
+// Decode one raw block, passing each line it holds to the callback
+static int decode_block(const unsigned char *block, size_t length, void (*callback)(const GcodeLine *, void *), void *data)
+{
+    char *strings[BINARY_STRINGS];
+    uint32_t last_values[BINARY_STRINGS];
+    uint32_t string_count = 0;
+    size_t position = 0;
+    int valid = 1;
+
+    while (valid && position < length)
+    {
+        unsigned char first = block[position++];
+        GcodeLineKind kind = first & 3;
+        uint32_t name = first >> 2;
+        uint32_t value;
+        if (kind == GCODE_DROPPED)
+        {
+            uint32_t text_length;
+            valid = name == 0 && string_count < BINARY_STRINGS && get_varint(block, length, &position, &text_length) &&
+                    text_length <= length - position;
+            if (!valid)
+                break;
+            strings[string_count] = malloc(text_length + 1);
+            memcpy(strings[string_count], block + position, text_length);
+            strings[string_count][text_length] = '\0';
+            last_values[string_count++] = 0;
+            position += text_length;
+            continue;
+        }
+
+        GcodeLine line = {kind, 0, NULL, NULL};
+        uint32_t parameter = 0;
+        valid = (name < 63 || get_varint(block, length, &position, &name)) && name < string_count &&
+                (kind != GCODE_INITIALIZE || (get_varint(block, length, &position, &parameter) && parameter < string_count)) &&
+                get_varint(block, length, &position, &value);
+        if (!valid)
+            break;
+        last_values[name] += (value >> 1) ^ (0u - (value & 1));
+        line.value = (int32_t)last_values[name];
+        line.name = strings[name];
+        line.parameter = strings[parameter];
+        callback(&line, data);
+    }
+
+    for (uint32_t i = 0; i < string_count; i++)
+        free(strings[i]);
+    return valid;
+}
+
+// Decode a whole binary Gcode stream, checking each block's checksum before passing its lines to the callback.
+// comments is set from the header before the first line. Returns 0, or -1 once the problem has been reported
+int decode_binary_gcode(const unsigned char *data, size_t length, void (*line)(const GcodeLine *line, void *data), void *callback_data, int *comments)
+{
+    if (length < 9 || memcmp(data, BINARY_MAGIC, 7) != 0)
+    {
+        fprintf(stderr, "Error: Not a binary Gcode stream.\n");
+        return -1;
+    }
+    if (data[7] != BINARY_VERSION)
+    {
+        fprintf(stderr, "Error: Binary Gcode version %d is not supported.\n", data[7]);
+        return -1;
+    }
+    *comments = data[8] & BINARY_FLAG_COMMENTS;
+
+    unsigned char *raw = NULL;
+    size_t position = 9;
+    uint64_t block = 0;
+    const char *problem = NULL;
+    for (;; block++)
+    {
+        if (length - position < BLOCK_HEADER_SIZE)
+        {
+            problem = "ends before its end marker";
+            break;
+        }
+        const unsigned char *header = data + position;
+        size_t stored = get_u32(header + 1);
+        size_t raw_length = get_u32(header + 5);
+        position += BLOCK_HEADER_SIZE;
+        if (stored == 0 && raw_length == 0)
+        {
+            if (position != length)
+                problem = "has data after its end marker";
+            break;
+        }
+        if (stored > length - position || raw_length > 4 * BINARY_BLOCK_SIZE)
+        {
+            problem = "has a block longer than the stream";
+            break;
+        }
+
+        const unsigned char *payload = data + position;
+        if (header[0] & BINARY_FLAG_COMPRESSED)
+        {
+            raw = realloc(raw, raw_length ? raw_length : 1);
+            if (!decompress_block(payload, stored, raw, raw_length))
+            {
+                problem = "has a block that does not decompress";
+                break;
+            }
+            payload = raw;
+        }
+        else if (stored != raw_length)
+        {
+            problem = "has a block with inconsistent lengths";
+            break;
+        }
+        if (crc32(payload, raw_length) != get_u32(header + 9))
+        {
+            problem = "has a block whose checksum does not match";
+            break;
+        }
+        if (!decode_block(payload, raw_length, line, callback_data))
+        {
+            problem = "has a malformed record";
+            break;
+        }
+        position += stored;
+    }
+
+    free(raw);
+    if (problem)
+    {
+        fprintf(stderr, "Error: Binary Gcode %s (block %llu).\n", problem, (unsigned long long)block);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct
+{
+    GcodeSink *sink;
+    int comments;
+} TextOutput;
+
+static void write_text_line(const GcodeLine *line, void *data)
+{
+    TextOutput *output = data;
+    write_gcode_line(output->sink, line, output->comments);
+}
+
+// Turn a binary stream back into the text the compiler would have written, for checking it against a text build
+int write_binary_as_text(const unsigned char *data, size_t length, GcodeSink *sink)
+{
+    TextOutput output = {sink, 1};
+    return decode_binary_gcode(data, length, write_text_line, &output, &output.comments);
+}
+
+// Decode a binary Gcode file written with --binary to text in the sink, returning 0 or -1 once the problem is reported
+int decode_binary_file(const char *path, GcodeSink *sink)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    size_t size = info.st_size;
+    void *mapping = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: %s is not a binary Gcode file.\n", path);
+        return -1;
+    }
+    int status = write_binary_as_text(mapping, size, sink);
+    munmap(mapping, size);
+    return status;
+}
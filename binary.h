@@ -0,0 +1,49 @@
+// binary.h
+#ifndef BINARY_H
+#define BINARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "gcode.h"
+
+#define BINARY_MAGIC "DDDGBIN"    // First seven bytes of a binary Gcode stream, followed by the version byte
+#define BINARY_VERSION 1
+#define BINARY_BLOCK_SIZE (1 << 16) // Encoded lines gathered before a block is checksummed, compressed, and written
+#define BINARY_STRINGS 64           // Distinct names and parameters one block can define
+#define BINARY_FLAG_COMMENTS 1      // Header flag: decode to text with the comments write_gcode_line() adds
+#define BINARY_FLAG_COMPRESSED 1    // Block flag: the payload is LZ compressed
+
+// Binary Gcode is the same line stream as the text output, in blocks that each decode on their own:
+//   header: BINARY_MAGIC, BINARY_VERSION, header flags
+//   block:  flags byte, stored length, raw length, CRC-32 of the raw payload (each 32 bits, little endian), payload
+//   end:    a block with both lengths 0
+// A raw payload is a sequence of records. The first byte holds the line kind in its low two bits, or 0 to define a
+// string, and the index of the line's name in the rest (63 meaning a varint index follows):
+//   define:     0, varint length, bytes          the next string index of the block
+//   initialize: kind|name, varint parameter, zigzag varint value change
+//   update:     kind|name, zigzag varint value change
+//   print:      kind|name, zigzag varint value change
+// Every value is stored as its change from the last value recorded for the same name in the block, which starts at 0
+typedef struct BinaryGcode
+{
+    unsigned char *block;  // Raw payload of the block being filled
+    size_t length;
+    size_t capacity;
+    int comments;          // Decoders restore the comments of the text output
+    int compress;          // Try compressing each block, keeping whichever is smaller
+    int started;           // The stream header has been written
+    unsigned char *packed; // Compressed copy of the block
+    char *strings[BINARY_STRINGS];       // Copies of the strings defined in the current block
+    const char *names[BINARY_STRINGS];   // Symbol names they were last matched with, compared by pointer first
+    uint32_t last_values[BINARY_STRINGS];
+    uint32_t string_count;
+} BinaryGcode;
+
+int decode_binary_file(const char *path, GcodeSink *sink);
+int decode_binary_gcode(const unsigned char *data, size_t length, void (*line)(const GcodeLine *line, void *data), void *callback_data, int *comments);
+void encode_binary_line(BinaryGcode *encoder, GcodeSink *sink, const GcodeLine *line);
+void finish_binary_gcode(BinaryGcode *encoder, GcodeSink *sink);
+void init_binary_gcode(BinaryGcode *encoder, int comments, int compress);
+int write_binary_as_text(const unsigned char *data, size_t length, GcodeSink *sink);
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <time.h>
+#include "budget.h"
+#include "utility.h"
+
+static double read_clock()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Start counting a compilation against its limits. The clock starts now, and bytes count from the sink's position
+void start_budget(ExecutionBudget *budget, const ExecutionLimits *limits, const GcodeSink *sink)
+{
+    budget->statement_limit = limits->statements ? limits->statements : UINT64_MAX;
+    budget->line_limit = limits->lines ? limits->lines : UINT64_MAX;
+    budget->byte_limit = limits->bytes ? limits->bytes : UINT64_MAX;
+    budget->deadline = limits->seconds > 0 ? read_clock() + limits->seconds : 0;
+    budget->statements = 0;
+    budget->lines = 0;
+    budget->first_byte = sink->written;
+    budget->ticks = BUDGET_CLOCK_INTERVAL;
+    budget->statement = AST_NULL;
+    budget->loop = AST_NULL;
+    budget->exhausted = NULL;
+    budget->cancel = NULL;
+}
+
+// The slow path of spend_statement() and spend_line(): read the clock if it is due, and work out which limit ran out.
+// line is set for a line about to be written rather than a statement about to run, which is counted if every limit
+// still allows it. A cancelled run fails at once without a report, as whoever cancelled it discards what it produced
+int check_budget(ExecutionBudget *budget, int line)
+{
+    if (budget->ticks == 0)
+    {
+        budget->ticks = BUDGET_CLOCK_INTERVAL;
+        if (budget->cancel && atomic_load(budget->cancel))
+            fail_compilation();
+        if (budget->deadline && read_clock() >= budget->deadline)
+            budget->exhausted = "--timeout";
+    }
+    if (!budget->exhausted)
+    {
+        if (!line && budget->statements >= budget->statement_limit)
+            budget->exhausted = "--max-statements";
+        else if (line && budget->lines >= budget->line_limit)
+            budget->exhausted = "--max-lines";
+        else if (line && compiler->gcode_output->written - budget->first_byte >= budget->byte_limit)
+            budget->exhausted = "--max-bytes";
+    }
+    if (budget->exhausted)
+        return 1;
+    if (line)
+        budget->lines++;
+    else
+        budget->statements++;
+    return 0;
+}
+
+// Describe a statement by its kind and the variable it works on, like "ASSIGNMENT on X"
+static void describe_statement(const ASTNode *node, char *text, size_t size)
+{
+    const char *variable = node->left && ast_left(node)->type == AST_IDENTIFIER ? ast_text(ast_left(node)) : NULL;
+    if (node->type == AST_WHILE || node->type == AST_COUNTED_LOOP || node->type == AST_IF_STATEMENT)
+        variable = node->left && ast_left(node)->left ? ast_text(ast_left(ast_left(node))) : NULL;
+    snprintf(text, size, "%s%s%s", ast_type_to_string(node->type), variable ? " on " : "", variable ? variable : "");
+}
+
+// Report which limit stopped the run and the statement it stopped at, with a warning when the WHILE running it provably
+// never ends, then fail the compilation. The Gcode written up to the stop is kept
+_Noreturn void stop_execution(ExecutionBudget *budget)
+{
+    char statement[64] = "end of the program";
+    if (budget->statement)
+        describe_statement(ast_node(budget->statement), statement, sizeof(statement));
+    fprintf(stderr, "Error: Execution stopped by %s after %llu statements and %llu Gcode lines, at %s%s",
+            budget->exhausted, (unsigned long long)budget->statements, (unsigned long long)budget->lines,
+            budget->loop && budget->loop == budget->statement ? "an iteration of " : "", statement);
+    if (budget->loop && budget->loop != budget->statement)
+    {
+        char loop[64];
+        describe_statement(ast_node(budget->loop), loop, sizeof(loop));
+        fprintf(stderr, " inside %s", loop);
+    }
+    fprintf(stderr, "\n");
+
+    ASTNode *loop = ast_node(budget->loop);
+    if (loop && loop_never_ends(loop))
+        fprintf(stderr, "Warning: The WHILE on %s never ends once entered, as nothing in its body changes %s\n",
+                ast_text(ast_left(ast_left(loop))), ast_text(ast_left(ast_left(loop))));
+    fail_compilation();
+}
@@ -0,0 +1,63 @@
+// budget.h
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "compiler.h"
+
+#define BUDGET_CLOCK_INTERVAL 4096 // Statements and lines between two readings of the clock
+
+// Limits on one run of a program, each 0 for none. A WHILE whose variable never changes runs forever, so services
+// that compile programs they did not write set these to get their worker back
+typedef struct
+{
+    uint64_t statements; // Statements executed, counting every iteration of a loop body
+    uint64_t lines;      // Gcode lines written
+    uint64_t bytes;      // Gcode bytes written
+    double seconds;      // Wall time from the start of the compilation
+} ExecutionLimits;
+
+// What a compilation has used of its limits so far, and where the engine is, so a stop can be reported precisely
+typedef struct ExecutionBudget
+{
+    uint64_t statement_limit; // Limits with 0 replaced by UINT64_MAX, so each check is a single comparison
+    uint64_t line_limit;
+    uint64_t byte_limit;
+    double deadline;          // Clock reading the run must end by, or 0
+    uint64_t statements;      // Statements run so far
+    uint64_t lines;           // Lines written so far
+    uint64_t first_byte;      // Bytes the sink had taken before the compilation
+    uint32_t ticks;           // Statements and lines left until the clock is read again
+    uint32_t statement;       // Arena index of the statement running
+    uint32_t loop;            // Arena index of the innermost WHILE running, or AST_NULL
+    const char *exhausted;    // Option whose limit ran out, or NULL
+    atomic_int *cancel;       // Set by another thread once the run's output is no longer wanted, or NULL
+} ExecutionBudget;
+
+int check_budget(ExecutionBudget *budget, int line);
+void start_budget(ExecutionBudget *budget, const ExecutionLimits *limits, const GcodeSink *sink);
+_Noreturn void stop_execution(ExecutionBudget *budget);
+
+// Count a statement the engine is about to run inside loop. Returns 1 once a limit is used up and the run must stop
+static inline int spend_statement(ExecutionBudget *budget, uint32_t statement, uint32_t loop)
+{
+    budget->statement = statement;
+    budget->loop = loop;
+    if (budget->statements >= budget->statement_limit || --budget->ticks == 0 || budget->exhausted)
+        return check_budget(budget, 0);
+    budget->statements++;
+    return 0;
+}
+
+// Count a Gcode line about to be written. Returns 1 if a limit is used up, and the line must be dropped
+static inline int spend_line(ExecutionBudget *budget)
+{
+    if (budget->lines >= budget->line_limit || compiler->gcode_output->written - budget->first_byte >= budget->byte_limit ||
+        --budget->ticks == 0 || budget->exhausted)
+        return check_budget(budget, 1);
+    budget->lines++;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,611 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+#include "bytecode.h"
+#include "gcode.h"
+#include "utility.h"
+
+// Grow an array field of the program so it can hold at least one more element
+#define RESERVE(array, count, capacity, initial)                                   \
+    do                                                                             \
+    {                                                                              \
+        if ((count) == (capacity))                                                 \
+        {                                                                          \
+            (capacity) = (capacity) ? (capacity) * 2 : (initial);                  \
+            (array) = realloc((array), (capacity) * sizeof(*(array)));             \
+            if (!(array))                                                          \
+            {                                                                      \
+                fprintf(stderr, "Error: Out of memory while lowering bytecode.\n"); \
+                exit(EXIT_FAILURE);                                                \
+            }                                                                      \
+        }                                                                          \
+    } while (0)
+
+// Append an instruction and return its index so jumps can be patched later
+static uint32_t emit_instruction(BytecodeProgram *program, Opcode op, uint32_t a, uint32_t b, uint32_t c)
+{
+    RESERVE(program->code, program->count, program->capacity, 256);
+    program->code[program->count] = (Instruction){op, a, b, c};
+    return program->count++;
+}
+
+// Allocate a register beyond the variables, starting with the given value
+static uint32_t new_register(BytecodeProgram *program, int32_t value)
+{
+    RESERVE(program->registers, program->register_count, program->register_capacity, 64);
+    program->registers[program->register_count] = value;
+    return program->register_count++;
+}
+
+// Return the register holding a constant, sharing one register between every use of the same value
+static uint32_t constant_register(BytecodeProgram *program, int32_t value)
+{
+    // Keep the constant table at most half full
+    if (program->constant_count * 2 >= program->constant_capacity)
+    {
+        uint32_t *old_slots = program->constant_slots;
+        uint32_t old_capacity = program->constant_capacity;
+        program->constant_capacity = old_capacity ? old_capacity * 2 : 64;
+        program->constant_slots = calloc(program->constant_capacity, sizeof(*program->constant_slots));
+        for (uint32_t i = 0; i < old_capacity; i++)
+        {
+            if (!old_slots[i])
+                continue;
+            uint32_t slot = ((uint32_t)program->registers[old_slots[i] - 1] * 2654435761u) & (program->constant_capacity - 1);
+            while (program->constant_slots[slot])
+                slot = (slot + 1) & (program->constant_capacity - 1);
+            program->constant_slots[slot] = old_slots[i];
+        }
+        free(old_slots);
+    }
+
+    uint32_t slot = ((uint32_t)value * 2654435761u) & (program->constant_capacity - 1);
+    while (program->constant_slots[slot])
+    {
+        if (program->registers[program->constant_slots[slot] - 1] == value)
+            return program->constant_slots[slot] - 1;
+        slot = (slot + 1) & (program->constant_capacity - 1);
+    }
+
+    uint32_t reg = new_register(program, value);
+    program->constant_slots[slot] = reg + 1;
+    program->constant_count++;
+    return reg;
+}
+
+// Store a parameter name for OP_INIT or OP_PARAMETER and return its index
+static uint32_t add_string(BytecodeProgram *program, const char *text)
+{
+    RESERVE(program->strings, program->string_count, program->string_capacity, 16);
+    program->strings[program->string_count] = text;
+    return program->string_count++;
+}
+
+// Map an arithmetic operator to its opcode, rejecting the same operators as do_math
+static Opcode arithmetic_opcode(const char *operator)
+{
+    switch (arithmetic_operator(operator))
+    {
+    case '+':
+        return OP_ADD;
+    case '-':
+        return OP_SUBTRACT;
+    case '*':
+        return OP_MULTIPLY;
+    case '/':
+        return OP_DIVIDE;
+    case '<':
+        return OP_SHIFT_LEFT;
+    case '>':
+        return OP_SHIFT_RIGHT;
+    default:
+        fprintf(stderr, "Error: Unsupported operator '%s'\n", operator);
+        fail_compilation();
+    }
+}
+
+// Map a comparison operator to the jump taken when it holds, or when it fails if negate is set
+static Opcode branch_opcode(const char *operator, int negate)
+{
+    switch (operator[0])
+    {
+    case '>':
+        if (operator[1] == '=')
+            return negate ? OP_JUMP_LT : OP_JUMP_GE;
+        return negate ? OP_JUMP_LE : OP_JUMP_GT;
+    case '<':
+        if (operator[1] == '=')
+            return negate ? OP_JUMP_GT : OP_JUMP_LE;
+        return negate ? OP_JUMP_GE : OP_JUMP_LT;
+    case '=':
+        return negate ? OP_JUMP_NE : OP_JUMP_EQ;
+    case '!':
+        return negate ? OP_JUMP_EQ : OP_JUMP_NE;
+    default:
+        fprintf(stderr, "Error: Unsupported operator '%s'\n", operator);
+        fail_compilation();
+    }
+}
+
+// Bit standing for a variable in the set an expression depends on. Slots 64 apart share a bit, which only makes a write
+// forget more values than it needs to
+static inline uint64_t variable_bit(uint32_t slot)
+{
+    return (uint64_t)1 << (slot & 63);
+}
+
+// Forget the values computed so far, as the next instruction can be reached from elsewhere
+static void start_block(BytecodeProgram *program)
+{
+    program->block_stamp = ++program->stamp;
+}
+
+// Record a write to a variable's register, which stales every value that read it or was left in it
+static void note_write(BytecodeProgram *program, uint32_t slot)
+{
+    program->written[slot & 63] = ++program->stamp;
+}
+
+// Find a register still holding the value of an operand chain computed in this basic block, adding the variables the
+// value depends on to reads
+static int find_value(BytecodeProgram *program, uint32_t chain, uint64_t *reads, uint32_t *reg)
+{
+    if (!program->value_capacity)
+        return 0;
+    uint32_t slot = (chain * 2654435761u) & (program->value_capacity - 1);
+    while (program->values[slot].chain && program->values[slot].chain != chain)
+        slot = (slot + 1) & (program->value_capacity - 1);
+
+    ExpressionValue *value = &program->values[slot];
+    if (!value->chain || value->stamp <= program->block_stamp)
+        return 0;
+    for (uint64_t bits = value->reads; bits; bits &= bits - 1)
+    {
+        if (program->written[__builtin_ctzll(bits)] > value->stamp)
+            return 0;
+    }
+    *reads |= value->reads;
+    *reg = value->reg;
+    return 1;
+}
+
+// Remember the register an operand chain's value was just computed into, for later uses of the chain in the block
+static void remember_value(BytecodeProgram *program, uint32_t chain, uint32_t reg, uint64_t reads)
+{
+    // Keep the value table at most half full
+    if (program->value_count * 2 >= program->value_capacity)
+    {
+        ExpressionValue *old_values = program->values;
+        uint32_t old_capacity = program->value_capacity;
+        program->value_capacity = old_capacity ? old_capacity * 2 : 64;
+        program->values = calloc(program->value_capacity, sizeof(*program->values));
+        for (uint32_t i = 0; i < old_capacity; i++)
+        {
+            if (!old_values[i].chain)
+                continue;
+            uint32_t slot = (old_values[i].chain * 2654435761u) & (program->value_capacity - 1);
+            while (program->values[slot].chain)
+                slot = (slot + 1) & (program->value_capacity - 1);
+            program->values[slot] = old_values[i];
+        }
+        free(old_values);
+    }
+
+    uint32_t slot = (chain * 2654435761u) & (program->value_capacity - 1);
+    while (program->values[slot].chain && program->values[slot].chain != chain)
+        slot = (slot + 1) & (program->value_capacity - 1);
+    if (!program->values[slot].chain)
+        program->value_count++;
+    if (reg < program->symbol_count)
+        reads |= variable_bit(reg);
+    program->values[slot] = (ExpressionValue){chain, reg, ++program->stamp, reads};
+}
+
+// Lower an expression into the target register, adding the variables it reads to reads
+static void lower_expression(BytecodeProgram *program, ASTNode *expression, uint32_t target, uint64_t *reads);
+
+// Return the register holding an operand's value, adding the variables it reads to reads. An expression is computed
+// into a fresh temporary, unless an equal one computed earlier in the basic block still holds its value
+static uint32_t lower_operand(BytecodeProgram *program, ASTNode *operand, uint64_t *reads)
+{
+    switch (operand->type)
+    {
+    case AST_INTEGER:
+        return constant_register(program, operand->value);
+    case AST_IDENTIFIER:
+        *reads |= variable_bit(operand->value);
+        return operand->value;
+    case AST_PARAMETER:
+    {
+        // An unsupported parameter only stops the run if the statement reading it runs, as in generate_gcode
+        int value;
+        if (lookup_initial_value(ast_text(operand), &value))
+            return constant_register(program, value);
+        uint32_t temporary = new_register(program, 0);
+        emit_instruction(program, OP_PARAMETER, temporary, 0, add_string(program, ast_text(operand)));
+        return temporary;
+    }
+    case AST_EXPRESSION:
+    {
+        uint32_t temporary;
+        if (find_value(program, operand->left, reads, &temporary))
+            return temporary;
+        uint64_t operand_reads = 0;
+        temporary = new_register(program, 0);
+        lower_expression(program, operand, temporary, &operand_reads);
+        remember_value(program, operand->left, temporary, operand_reads);
+        *reads |= operand_reads;
+        return temporary;
+    }
+    default:
+        return constant_register(program, 0);
+    }
+}
+
+static void lower_expression(BytecodeProgram *program, ASTNode *expression, uint32_t target, uint64_t *reads)
+{
+    ASTNode *left = ast_left(expression);
+    ASTNode *operator_node = ast_right(left);
+    uint32_t left_register = lower_operand(program, left, reads);
+    uint32_t right_register = lower_operand(program, ast_right(operator_node), reads);
+    emit_instruction(program, arithmetic_opcode(ast_text(operator_node)), target, left_register, right_register);
+}
+
+static int lower_statement(ASTNode *node, int depth, void *data);
+
+// Lower a sequence of statements in order
+static void lower_statements(BytecodeProgram *program, ASTNode *statement)
+{
+    ASTVisitor visitor = {lower_statement, NULL, program};
+    walk_ast(statement, &visitor);
+}
+
+// Lower one statement. Control statements lower their own blocks, so children are never walked
+static int lower_statement(ASTNode *node, int depth, void *data)
+{
+    BytecodeProgram *program = data;
+    if (program->checks_budget && node->type != AST_ELSE_STATEMENT)
+        emit_instruction(program, OP_STEP, ast_index(node), program->running_loop, 0);
+
+    switch (node->type)
+    {
+    case AST_COMMAND:
+        if (node->left && ast_left(node)->right)
+        {
+            emit_instruction(program, OP_INIT, ast_left(node)->value, 0, add_string(program, ast_text(ast_right(ast_left(node)))));
+            note_write(program, ast_left(node)->value);
+        }
+        break;
+    case AST_ASSIGNMENT:
+    {
+        if (!node->left || !ast_left(node)->right || !ast_right(ast_left(node))->right)
+            break;
+
+        // Compute the value straight into the variable's register, unless the block already holds it, then record the update
+        ASTNode *identifier = ast_left(node);
+        ASTNode *operand = ast_right(ast_right(identifier));
+        uint64_t reads = 0;
+        uint32_t held;
+        if (operand->type == AST_EXPRESSION && !find_value(program, operand->left, &reads, &held))
+        {
+            lower_expression(program, operand, identifier->value, &reads);
+            note_write(program, identifier->value);
+
+            // A value computed from the variable's old contents is not what the chain means once it is replaced
+            if (!(reads & variable_bit(identifier->value)))
+                remember_value(program, operand->left, identifier->value, reads);
+        }
+        else
+        {
+            if (operand->type != AST_EXPRESSION)
+                held = lower_operand(program, operand, &reads);
+            if (held != identifier->value)
+                emit_instruction(program, OP_MOVE, identifier->value, held, 0);
+            note_write(program, identifier->value);
+        }
+        emit_instruction(program, OP_UPDATE, identifier->value, 0, 0);
+        break;
+    }
+    case AST_PRINT:
+        if (node->left)
+            emit_instruction(program, OP_PRINT, ast_left(node)->value, 0, 0);
+        break;
+    case AST_IF_STATEMENT:
+    {
+        if (!node->left)
+        {
+            fprintf(stderr, "Error: IF statement missing condition\n");
+            break;
+        }
+
+        ASTNode *condition = ast_left(node);
+        ASTNode *variable = ast_left(condition);
+        ASTNode *operator_node = ast_right(variable);
+        uint64_t reads = 0;
+        uint32_t compare_register = lower_operand(program, ast_right(operator_node), &reads);
+
+        // Skip the IF block when the condition fails. Each block, and the code after them, starts without known values
+        uint32_t skip = emit_instruction(program, branch_opcode(ast_text(operator_node), 1), variable->value, compare_register, 0);
+        start_block(program);
+        lower_statements(program, control_body(ast_right(condition)));
+
+        // An attached ELSE runs its block instead, and the IF block jumps over it
+        if (node->right && ast_right(node)->type == AST_ELSE_STATEMENT)
+        {
+            uint32_t over_else = emit_instruction(program, OP_JUMP, 0, 0, 0);
+            program->code[skip].c = program->count;
+            start_block(program);
+            lower_statements(program, control_body(ast_left(ast_right(node))));
+            program->code[over_else].c = program->count;
+        }
+        else
+        {
+            program->code[skip].c = program->count;
+        }
+        start_block(program);
+        break;
+    }
+    case AST_COUNTED_LOOP:
+    case AST_WHILE:
+    {
+        if (!node->left)
+        {
+            fprintf(stderr, "Error: WHILE node missing condition\n");
+            break;
+        }
+
+        ASTNode *condition = ast_left(node);
+        ASTNode *variable = ast_left(condition);
+        ASTNode *operator_node = ast_right(variable);
+        ASTNode *compare_operand = ast_right(operator_node);
+
+        // The comparison value is read once before the loop starts, so snapshot a variable into its own register
+        uint64_t reads = 0;
+        uint32_t compare_register = lower_operand(program, compare_operand, &reads);
+        if (compare_operand->type == AST_IDENTIFIER)
+        {
+            uint32_t snapshot = new_register(program, 0);
+            emit_instruction(program, OP_MOVE, snapshot, compare_register, 0);
+            compare_register = snapshot;
+        }
+
+        // A counted loop first tries its closed form, which jumps past the loop when it applies
+        int step;
+        uint32_t closed_form = 0;
+        int counted = node->type == AST_COUNTED_LOOP && match_counted_loop(node, &step);
+        if (counted)
+        {
+            RESERVE(program->loops, program->loop_count, program->loop_capacity, 8);
+            program->loops[program->loop_count] = (CountedLoop){ast_text(operator_node), compare_register, step};
+            closed_form = emit_instruction(program, OP_COUNTED, variable->value, program->loop_count++, 0);
+        }
+
+        // Test once on entry, then again at the bottom of the body so each iteration takes a single jump
+        uint32_t skip = emit_instruction(program, branch_opcode(ast_text(operator_node), 1), variable->value, compare_register, 0);
+        uint32_t top = program->count;
+        uint32_t outer_loop = program->running_loop;
+        if (program->checks_budget)
+            emit_instruction(program, OP_STEP, ast_index(node), ast_index(node), 0);
+        if (program->counts_iterations)
+            emit_instruction(program, OP_ITERATE, 0, 0, 0);
+        program->running_loop = ast_index(node);
+        start_block(program);
+        lower_statements(program, control_body(ast_right(condition)));
+        program->running_loop = outer_loop;
+        emit_instruction(program, branch_opcode(ast_text(operator_node), 0), variable->value, compare_register, top);
+        program->code[skip].c = program->count;
+        if (counted)
+            program->code[closed_form].c = program->count;
+        start_block(program);
+        break;
+    }
+    default:
+        break;
+    }
+    return 0;
+}
+
+// Lower a sequence of statements into register bytecode
+BytecodeProgram *compile_bytecode(ASTNode *root)
+{
+    BytecodeProgram *program = calloc(1, sizeof(*program));
+
+    // The first registers belong to the variables, in symbol slot order
+    program->symbol_count = compiler->symbol_table.count;
+    for (uint32_t slot = 0; slot < program->symbol_count; slot++)
+        new_register(program, 0);
+
+    // Only --stats pays for counting loop iterations, with one extra instruction per iteration
+    program->counts_iterations = compiler->stats != NULL;
+
+    // Limits cost one instruction per statement and loop iteration, and nothing while none is set
+    program->checks_budget = compiler->budget != NULL;
+    lower_statements(program, root);
+    emit_instruction(program, OP_HALT, 0, 0, 0);
+    return program;
+}
+
+void free_bytecode(BytecodeProgram *program)
+{
+    if (!program)
+        return;
+    free(program->code);
+    free(program->registers);
+    free(program->strings);
+    free(program->loops);
+    free(program->constant_slots);
+    free(program->values);
+    free(program);
+}
+
+#if defined(__GNUC__)
+#define DISPATCH() goto *dispatch_table[pc->op]
+#define OPCODE(name) name##_LABEL:
+#else
+#define DISPATCH() goto dispatch
+#define OPCODE(name) case name:
+#endif
+
+// Run a lowered program, reading and writing variables through the symbol table and outputting the same Gcode as generate_gcode
+void run_bytecode(const BytecodeProgram *program)
+{
+    // The context owns the register file, so a run that fails partway leaves it to release_program()
+    int32_t *r = compiler->registers = malloc(program->register_count * sizeof(*r));
+    memcpy(r, program->registers, program->register_count * sizeof(*r));
+    for (uint32_t slot = 0; slot < program->symbol_count; slot++)
+        r[slot] = get_symbol(slot)->value;
+
+    const Instruction *code = program->code;
+    const Instruction *pc = code;
+    ExecutionBudget *budget = compiler->budget;
+    uint64_t iterations = 0;
+
+#if defined(__GNUC__)
+    // Threaded dispatch: every handler jumps straight to the next instruction's handler
+    static const void *const dispatch_table[OP_COUNT] = {
+        [OP_HALT] = &&OP_HALT_LABEL,
+        [OP_MOVE] = &&OP_MOVE_LABEL,
+        [OP_ADD] = &&OP_ADD_LABEL,
+        [OP_SUBTRACT] = &&OP_SUBTRACT_LABEL,
+        [OP_MULTIPLY] = &&OP_MULTIPLY_LABEL,
+        [OP_DIVIDE] = &&OP_DIVIDE_LABEL,
+        [OP_SHIFT_LEFT] = &&OP_SHIFT_LEFT_LABEL,
+        [OP_SHIFT_RIGHT] = &&OP_SHIFT_RIGHT_LABEL,
+        [OP_INIT] = &&OP_INIT_LABEL,
+        [OP_PARAMETER] = &&OP_PARAMETER_LABEL,
+        [OP_UPDATE] = &&OP_UPDATE_LABEL,
+        [OP_PRINT] = &&OP_PRINT_LABEL,
+        [OP_JUMP] = &&OP_JUMP_LABEL,
+        [OP_JUMP_LT] = &&OP_JUMP_LT_LABEL,
+        [OP_JUMP_LE] = &&OP_JUMP_LE_LABEL,
+        [OP_JUMP_GT] = &&OP_JUMP_GT_LABEL,
+        [OP_JUMP_GE] = &&OP_JUMP_GE_LABEL,
+        [OP_JUMP_EQ] = &&OP_JUMP_EQ_LABEL,
+        [OP_JUMP_NE] = &&OP_JUMP_NE_LABEL,
+        [OP_COUNTED] = &&OP_COUNTED_LABEL,
+        [OP_STEP] = &&OP_STEP_LABEL,
+        [OP_ITERATE] = &&OP_ITERATE_LABEL,
+    };
+    DISPATCH();
+#else
+dispatch:
+#endif
+    switch (pc->op)
+    {
+        OPCODE(OP_MOVE)
+        r[pc->a] = r[pc->b];
+        pc++;
+        DISPATCH();
+        OPCODE(OP_ADD)
+        r[pc->a] = r[pc->b] + r[pc->c];
+        pc++;
+        DISPATCH();
+        OPCODE(OP_SUBTRACT)
+        r[pc->a] = r[pc->b] - r[pc->c];
+        pc++;
+        DISPATCH();
+        OPCODE(OP_MULTIPLY)
+        r[pc->a] = r[pc->b] * r[pc->c];
+        pc++;
+        DISPATCH();
+        OPCODE(OP_DIVIDE)
+        if (r[pc->c] == 0)
+        {
+            fprintf(stderr, "Error: Division by zero\n");
+            fail_compilation();
+        }
+        r[pc->a] = r[pc->b] / r[pc->c];
+        pc++;
+        DISPATCH();
+        OPCODE(OP_SHIFT_LEFT)
+        if (!valid_shift(r[pc->c]))
+        {
+            fprintf(stderr, "Error: Shift count %d is out of range\n", r[pc->c]);
+            fail_compilation();
+        }
+        r[pc->a] = (int32_t)((uint32_t)r[pc->b] << r[pc->c]);
+        pc++;
+        DISPATCH();
+        OPCODE(OP_SHIFT_RIGHT)
+        if (!valid_shift(r[pc->c]))
+        {
+            fprintf(stderr, "Error: Shift count %d is out of range\n", r[pc->c]);
+            fail_compilation();
+        }
+        r[pc->a] = (r[pc->b] + ((r[pc->b] >> 31) & ((1 << r[pc->c]) - 1))) >> r[pc->c];
+        pc++;
+        DISPATCH();
+        OPCODE(OP_INIT)
+        r[pc->a] = map_initial_value(program->strings[pc->c]);
+        emit_initialize(get_symbol(pc->a)->identifier, program->strings[pc->c], r[pc->a]);
+        pc++;
+        DISPATCH();
+        OPCODE(OP_PARAMETER)
+        r[pc->a] = map_initial_value(program->strings[pc->c]);
+        pc++;
+        DISPATCH();
+        OPCODE(OP_UPDATE)
+        emit_update(get_symbol(pc->a)->identifier, r[pc->a]);
+        pc++;
+        DISPATCH();
+        OPCODE(OP_PRINT)
+        emit_print(get_symbol(pc->a)->identifier, r[pc->a]);
+        pc++;
+        DISPATCH();
+        OPCODE(OP_JUMP)
+        pc = code + pc->c;
+        DISPATCH();
+        OPCODE(OP_JUMP_LT)
+        pc = r[pc->a] < r[pc->b] ? code + pc->c : pc + 1;
+        DISPATCH();
+        OPCODE(OP_JUMP_LE)
+        pc = r[pc->a] <= r[pc->b] ? code + pc->c : pc + 1;
+        DISPATCH();
+        OPCODE(OP_JUMP_GT)
+        pc = r[pc->a] > r[pc->b] ? code + pc->c : pc + 1;
+        DISPATCH();
+        OPCODE(OP_JUMP_GE)
+        pc = r[pc->a] >= r[pc->b] ? code + pc->c : pc + 1;
+        DISPATCH();
+        OPCODE(OP_JUMP_EQ)
+        pc = r[pc->a] == r[pc->b] ? code + pc->c : pc + 1;
+        DISPATCH();
+        OPCODE(OP_JUMP_NE)
+        pc = r[pc->a] != r[pc->b] ? code + pc->c : pc + 1;
+        DISPATCH();
+        OPCODE(OP_COUNTED)
+        {
+            const CountedLoop *loop = &program->loops[pc->b];
+            int value = r[pc->a];
+            if (emit_counted_loop(get_symbol(pc->a)->identifier, &value, loop->operator, r[loop->compare_register], loop->step))
+            {
+                r[pc->a] = value;
+                pc = code + pc->c;
+            }
+            else
+            {
+                pc++;
+            }
+            DISPATCH();
+        }
+        OPCODE(OP_STEP)
+        if (spend_statement(budget, pc->a, pc->b))
+            stop_execution(budget);
+        pc++;
+        DISPATCH();
+        OPCODE(OP_ITERATE)
+        iterations++;
+        pc++;
+        DISPATCH();
+        OPCODE(OP_HALT)
+        break;
+    }
+
+    // Write the final variable values back so later statements (and streaming mode) see them
+    for (uint32_t slot = 0; slot < program->symbol_count; slot++)
+        get_symbol(slot)->value = r[slot];
+    COUNT_STAT(loop_iterations, iterations);
+    free(r);
+    compiler->registers = NULL;
+}
@@ -0,0 +1,95 @@
+// bytecode.h
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stdint.h>
+#include "ast.h"
+
+// Register bytecode opcodes. Registers 0..symbol_count-1 are the program's variables, the rest hold constants and temporaries
+typedef enum
+{
+    OP_HALT,
+    OP_MOVE,     // r[a] = r[b]
+    OP_ADD,      // r[a] = r[b] + r[c]
+    OP_SUBTRACT, // r[a] = r[b] - r[c]
+    OP_MULTIPLY, // r[a] = r[b] * r[c]
+    OP_DIVIDE,   // r[a] = r[b] / r[c]
+    OP_SHIFT_LEFT, // r[a] = r[b] * 2^r[c]
+    OP_SHIFT_RIGHT, // r[a] = r[b] / 2^r[c], rounding toward zero
+    OP_INIT,     // r[a] = r[b], output the G92 initializing variable a with parameter text c
+    OP_PARAMETER, // r[a] = the value of parameter text c, stopping the run if it has none
+    OP_UPDATE,   // Output the comment recording variable a's new value
+    OP_PRINT,    // Output the M117 displaying variable a
+    OP_JUMP,     // Continue at instruction c
+    OP_JUMP_LT,  // Continue at instruction c if r[a] < r[b]
+    OP_JUMP_LE,  // Continue at instruction c if r[a] <= r[b]
+    OP_JUMP_GT,  // Continue at instruction c if r[a] > r[b]
+    OP_JUMP_GE,  // Continue at instruction c if r[a] >= r[b]
+    OP_JUMP_EQ,  // Continue at instruction c if r[a] == r[b]
+    OP_JUMP_NE,  // Continue at instruction c if r[a] != r[b]
+    OP_COUNTED,  // Run counted loop b on variable a in closed form and continue at instruction c, or fall through if it would not end
+    OP_STEP,     // Count statement a, run inside WHILE b, against the budget and stop the run once it is used up
+    OP_ITERATE,  // Add one to the WHILE iterations the run counts for --stats, outside the 32-bit registers
+    OP_COUNT,
+} Opcode;
+
+typedef struct
+{
+    uint32_t op;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+} Instruction;
+
+// A WHILE recognized by mark_counted_loops, which stops comparing its variable with a register once stepping it reaches the bound
+typedef struct
+{
+    const char *operator;
+    uint32_t compare_register;
+    int32_t step;
+} CountedLoop;
+
+// A register holding the value of an operand chain computed earlier in the basic block being lowered
+typedef struct
+{
+    uint32_t chain;  // Arena index of the chain's first operand, or AST_NULL for an empty slot
+    uint32_t reg;
+    uint32_t stamp;  // When the value was computed
+    uint64_t reads;  // Variables the value depends on, including the one it was left in, one bit per slot mod 64
+} ExpressionValue;
+
+// A lowered program together with the initial contents of its register file
+typedef struct BytecodeProgram
+{
+    Instruction *code;
+    uint32_t count;
+    uint32_t capacity;
+    int32_t *registers;       // Initial register values: constants are filled in, variables are loaded at run time
+    uint32_t register_count;
+    uint32_t register_capacity;
+    uint32_t symbol_count;    // Registers below this index mirror the symbol table
+    const char **strings;     // Parameter names referenced by OP_INIT and OP_PARAMETER
+    uint32_t string_count;
+    uint32_t string_capacity;
+    CountedLoop *loops;       // Closed forms referenced by OP_COUNTED
+    uint32_t loop_count;
+    uint32_t loop_capacity;
+    uint32_t *constant_slots; // Open-addressing hash of constant registers (plus one), keyed by value
+    uint32_t constant_capacity;
+    uint32_t constant_count;
+    ExpressionValue *values;  // Open-addressing hash of the values computed in the current basic block, keyed by chain
+    uint32_t value_capacity;
+    uint32_t value_count;
+    uint32_t stamp;           // Counts the values computed and variables written so far
+    uint32_t block_stamp;     // Stamp the current basic block started at
+    uint32_t written[64];     // Stamp of the latest write to a variable, by slot mod 64
+    int counts_iterations;    // Set when --stats is on and every loop iteration starts with an OP_ITERATE
+    int checks_budget;        // Set when the run has limits and every statement and loop iteration starts with an OP_STEP
+    uint32_t running_loop;    // Innermost WHILE being lowered, or AST_NULL
+} BytecodeProgram;
+
+BytecodeProgram *compile_bytecode(ASTNode *root);
+void free_bytecode(BytecodeProgram *program);
+void run_bytecode(const BytecodeProgram *program);
+
+#endif
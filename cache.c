@@ -0,0 +1,309 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "binary.h"
+#include "cache.h"
+#include "peephole.h"
+
+#define CACHE_EVICTION_SLACK 10  // Percent below the limit an eviction goes down to, so the next few stores need none
+#define CACHE_TEMPORARY_AGE 3600 // Seconds before a temporary file is taken to be left over from a crashed compilation
+
+// An entry found while evicting, ordered by when it was last written or served
+typedef struct
+{
+    char *name;
+    struct timespec used;
+    uint64_t size;
+} CacheEntry;
+
+static inline uint64_t rotate_left(uint64_t value, int shift)
+{
+    return (value << shift) | (value >> (64 - shift));
+}
+
+static inline uint64_t mix_bits(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+// MurmurHash3 (x64, 128 bits). It runs at several GB/s, and 128 bits keep distinct sources from ever sharing an entry
+static void hash_bytes(const char *data, size_t length, uint64_t seed, uint64_t hash[2])
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+    uint64_t k1, k2;
+    size_t blocks = length / 16;
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+        h1 ^= rotate_left(k1 * c1, 31) * c2;
+        h1 = (rotate_left(h1, 27) + h2) * 5 + 0x52dce729;
+        h2 ^= rotate_left(k2 * c2, 33) * c1;
+        h2 = (rotate_left(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+
+    // The last partial block is zero padded, which leaves the halves it does not reach unchanged
+    char tail[16] = {0};
+    memcpy(tail, data + blocks * 16, length % 16);
+    memcpy(&k1, tail, 8);
+    memcpy(&k2, tail + 8, 8);
+    h1 ^= rotate_left(k1 * c1, 31) * c2;
+    h2 ^= rotate_left(k2 * c2, 33) * c1;
+
+    h1 ^= length;
+    h2 ^= length;
+    h1 += h2;
+    h2 += h1;
+    h1 = mix_bits(h1);
+    h2 = mix_bits(h2);
+    hash[0] = h1 + h2;
+    hash[1] = hash[0] + h2;
+}
+
+// Path of a file inside the cache directory, to be freed by the caller
+static char *cache_path(const GcodeCache *cache, const char *name)
+{
+    size_t length = strlen(cache->directory) + strlen(name) + 2;
+    char *path = malloc(length);
+    snprintf(path, length, "%s/%s", cache->directory, name);
+    return path;
+}
+
+static int older_entry(const void *a, const void *b)
+{
+    const struct timespec *first = &((const CacheEntry *)a)->used;
+    const struct timespec *second = &((const CacheEntry *)b)->used;
+    if (first->tv_sec != second->tv_sec)
+        return first->tv_sec < second->tv_sec ? -1 : 1;
+    return (first->tv_nsec > second->tv_nsec) - (first->tv_nsec < second->tv_nsec);
+}
+
+// Delete the least recently used entries until the cache is back under its limit, returning the bytes still stored.
+// Temporary files abandoned by crashed compilations are cleared out on the way
+static uint64_t evict_entries(const GcodeCache *cache)
+{
+    DIR *directory = opendir(cache->directory);
+    if (!directory)
+        return 0;
+
+    CacheEntry *entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+    struct dirent *item;
+    while ((item = readdir(directory)))
+    {
+        const char *name = item->d_name;
+        size_t length = strlen(name);
+        int temporary = strncmp(name, "tmp.", 4) == 0;
+        if (!temporary && (length <= 6 || strcmp(name + length - 6, ".gcode") != 0))
+            continue;
+
+        struct stat info;
+        if (fstatat(dirfd(directory), name, &info, 0) != 0)
+            continue;
+        if (temporary)
+        {
+            if (now - info.st_mtime > CACHE_TEMPORARY_AGE)
+                unlinkat(dirfd(directory), name, 0);
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            entries = realloc(entries, capacity * sizeof(*entries));
+        }
+        entries[count++] = (CacheEntry){strdup(name), info.st_mtim, (uint64_t)info.st_size};
+        total += info.st_size;
+    }
+
+    qsort(entries, count, sizeof(*entries), older_entry);
+    uint64_t target = cache->limit / 100 * (100 - CACHE_EVICTION_SLACK);
+    for (size_t i = 0; i < count; i++)
+    {
+        // Another compilation may be streaming this entry, which keeps working after the unlink
+        if (total > target && unlinkat(dirfd(directory), entries[i].name, 0) == 0)
+            total -= entries[i].size;
+        free(entries[i].name);
+    }
+    free(entries);
+    closedir(directory);
+    return total;
+}
+
+// Add to the shared totals while holding an exclusive lock on them, evicting entries if the cache outgrew its limit
+static void update_totals(const GcodeCache *cache, uint64_t hits, uint64_t misses, uint64_t stored)
+{
+    char *path = cache_path(cache, "totals");
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+    if (fd < 0)
+        return;
+
+    CacheTotals totals;
+    if (flock(fd, LOCK_EX) == 0)
+    {
+        if (pread(fd, &totals, sizeof(totals), 0) != sizeof(totals))
+            memset(&totals, 0, sizeof(totals));
+        totals.hits += hits;
+        totals.misses += misses;
+        totals.bytes += stored;
+        if (cache->limit && totals.bytes > cache->limit)
+            totals.bytes = evict_entries(cache);
+        if (pwrite(fd, &totals, sizeof(totals), 0) != sizeof(totals))
+            fprintf(stderr, "Warning: Failed to update the totals of cache %s.\n", cache->directory);
+    }
+    close(fd);
+}
+
+// Read a whole source into memory, followed by the zero bytes compile_buffer() needs
+static char *read_source(FILE *input, size_t *length)
+{
+    size_t capacity = 1 << 16;
+    char *data = malloc(capacity);
+    size_t count;
+
+    *length = 0;
+    while ((count = fread(data + *length, 1, capacity - *length - COMPILER_BUFFER_PADDING, input)) > 0)
+    {
+        *length += count;
+        if (capacity - *length <= COMPILER_BUFFER_PADDING)
+        {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    if (ferror(input))
+    {
+        free(data);
+        return NULL;
+    }
+    memset(data + *length, 0, COMPILER_BUFFER_PADDING);
+    return data;
+}
+
+// Use a directory as the Gcode cache, creating it if needed. limit is in bytes, 0 for none
+int open_cache(GcodeCache *cache, const char *directory, uint64_t limit)
+{
+    struct stat info;
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST)
+        return -1;
+    if (stat(directory, &info) != 0 || !S_ISDIR(info.st_mode))
+        return -1;
+    cache->directory = directory;
+    cache->limit = limit;
+    return 0;
+}
+
+// Read the hit, miss, and size totals of a cache. A cache that was never used reads as all zeros
+int read_cache_totals(const GcodeCache *cache, CacheTotals *totals)
+{
+    memset(totals, 0, sizeof(*totals));
+    char *path = cache_path(cache, "totals");
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    int status = flock(fd, LOCK_SH) == 0 && pread(fd, totals, sizeof(*totals), 0) >= 0 ? 0 : -1;
+    close(fd);
+    return status;
+}
+
+// Compile a program through the cache. A hit streams the stored Gcode into the context's sink without scanning,
+// parsing, optimizing, or running anything. A miss compiles as usual while a copy of the Gcode goes to a temporary
+// file, which is renamed into place only once the compilation succeeded, so readers never see a partial entry
+int compile_cached(const GcodeCache *cache, CompilerContext *context, FILE *input)
+{
+    size_t length;
+    char *source = read_source(input, &length);
+    if (!source)
+    {
+        fprintf(stderr, "Error: Failed to read the source.\n");
+        return EXIT_FAILURE;
+    }
+
+    // The key covers everything that decides the Gcode: the compiler version, the options, and the source bytes
+    int peephole = context->peephole ? 1 + context->peephole->strip_comments : 0;
+    int binary = context->binary_output ? 1 + context->binary_output->compress : 0;
+    uint64_t seed = (uint64_t)(uint32_t)context->unroll_factor << 32 | (uint64_t)GCODE_CACHE_VERSION << 8 | binary << 4 |
+                    peephole << 2 | context->streaming << 1 | context->use_tree_walker;
+    uint64_t hash[2];
+    char name[48];
+    hash_bytes(source, length, seed, hash);
+    snprintf(name, sizeof(name), "%016llx%016llx.gcode", (unsigned long long)hash[0], (unsigned long long)hash[1]);
+    char *path = cache_path(cache, name);
+
+    GcodeSink *output = context->gcode_output;
+    size_t written = output->written;
+    int status;
+
+    // A stored entry was written without the run's limits, so a run with limits compiles to enforce them
+    int fd = context->budget ? -1 : open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        // Serving an entry makes it the most recently used one
+        futimens(fd, NULL);
+        status = sink_write_fd(output, fd) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        close(fd);
+        update_totals(cache, 1, 0, 0);
+        if (context->stats)
+        {
+            context->stats->cache_hits++;
+            context->stats->gcode_bytes += output->written - written;
+        }
+        free(path);
+        free(source);
+        return status;
+    }
+
+    // Without a temporary file, for example in a read-only cache, the program is still compiled, just not stored
+    char *temporary = cache_path(cache, "tmp.XXXXXX");
+    GcodeSink copy;
+    int copy_fd = mkstemp(temporary);
+    if (copy_fd >= 0)
+    {
+        fchmod(copy_fd, 0644);
+        sink_open_fd(&copy, copy_fd);
+        copy.owns_fd = 1;
+        output->copy = &copy;
+    }
+
+    status = compile_buffer(context, source, length + COMPILER_BUFFER_PADDING);
+    output->copy = NULL;
+    uint64_t stored = 0;
+    if (copy_fd >= 0)
+    {
+        uint64_t size = copy.written;
+        if (sink_close(&copy) == 0 && status == EXIT_SUCCESS && rename(temporary, path) == 0)
+            stored = size;
+        else
+            unlink(temporary);
+    }
+    update_totals(cache, 0, 1, stored);
+    if (context->stats)
+        context->stats->cache_misses++;
+
+    free(temporary);
+    free(path);
+    free(source);
+    return status;
+}
@@ -0,0 +1,33 @@
+// cache.h
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "compiler.h"
+
+// Part of every cache key. Bump it whenever a compiler change alters the Gcode produced for some program,
+// so entries written by older builds are never served again
+#define GCODE_CACHE_VERSION 3
+
+// A directory of Gcode files, each named by the hash of the source and options that produced it.
+// Any number of threads and processes on one machine may share it
+typedef struct
+{
+    const char *directory;
+    uint64_t limit; // Bytes of Gcode kept before the least recently used entries are evicted, or 0 for no limit
+} GcodeCache;
+
+// Running totals stored in the cache directory, covering every compilation that used it
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes; // Gcode currently stored
+} CacheTotals;
+
+int compile_cached(const GcodeCache *cache, CompilerContext *context, FILE *input);
+int open_cache(GcodeCache *cache, const char *directory, uint64_t limit);
+int read_cache_totals(const GcodeCache *cache, CacheTotals *totals);
+
+#endif
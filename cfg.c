@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cfg.h"
+#include "gcode.h"
+
+// Current position while the graph is being built
+typedef struct
+{
+    ControlFlowGraph *cfg;
+    uint32_t block;  // Block that new items are appended to, always the most recently created one
+    uint8_t in_loop;
+} CFGBuilder;
+
+// Start a new, empty basic block after every existing one
+static uint32_t new_block(ControlFlowGraph *cfg)
+{
+    if (cfg->block_count == cfg->block_capacity)
+    {
+        cfg->block_capacity = cfg->block_capacity ? cfg->block_capacity * 2 : 16;
+        cfg->blocks = realloc(cfg->blocks, cfg->block_capacity * sizeof(BasicBlock));
+    }
+    BasicBlock *block = &cfg->blocks[cfg->block_count];
+    memset(block, 0, sizeof(*block));
+    block->first_item = cfg->item_count;
+    return cfg->block_count++;
+}
+
+static void add_edge(ControlFlowGraph *cfg, uint32_t from, uint32_t to)
+{
+    BasicBlock *block = &cfg->blocks[from];
+    block->successors[block->successor_count++] = to;
+}
+
+// Append a program point to the builder's current block
+static void add_item(CFGBuilder *builder, ASTNode *node, CFGItemKind kind)
+{
+    ControlFlowGraph *cfg = builder->cfg;
+    if (cfg->item_count == cfg->item_capacity)
+    {
+        cfg->item_capacity = cfg->item_capacity ? cfg->item_capacity * 2 : 64;
+        cfg->items = realloc(cfg->items, cfg->item_capacity * sizeof(CFGItem));
+    }
+    cfg->items[cfg->item_count++] = (CFGItem){ast_index(node), kind, builder->in_loop, 0};
+    cfg->blocks[builder->block].item_count++;
+}
+
+static void add_statements(CFGBuilder *builder, ASTNode *statement);
+
+// Add one statement to the graph, splitting blocks where IF and WHILE branch
+static int add_statement(ASTNode *node, int depth, void *data)
+{
+    CFGBuilder *builder = data;
+    ControlFlowGraph *cfg = builder->cfg;
+
+    switch (node->type)
+    {
+    case AST_IF_STATEMENT:
+    {
+        if (!node->left)
+            break;
+        add_item(builder, node, CFG_BRANCH);
+        uint32_t branch = builder->block;
+
+        builder->block = new_block(cfg);
+        add_edge(cfg, branch, builder->block);
+        add_statements(builder, control_body(ast_right(ast_left(node))));
+        uint32_t then_end = builder->block;
+
+        // Without an ELSE, a false condition goes straight to the statement after the IF
+        uint32_t else_end = branch;
+        if (node->right && ast_right(node)->type == AST_ELSE_STATEMENT)
+        {
+            builder->block = new_block(cfg);
+            add_edge(cfg, branch, builder->block);
+            add_statements(builder, control_body(ast_left(ast_right(node))));
+            else_end = builder->block;
+        }
+
+        builder->block = new_block(cfg);
+        add_edge(cfg, then_end, builder->block);
+        add_edge(cfg, else_end, builder->block);
+        break;
+    }
+    case AST_WHILE:
+    case AST_COUNTED_LOOP:
+    {
+        if (!node->left)
+            break;
+
+        // The comparison operand is read once before the loop, the variable at the top of every iteration
+        add_item(builder, node, CFG_LOOP_ENTRY);
+        uint32_t entry = builder->block;
+        uint32_t head = new_block(cfg);
+        add_edge(cfg, entry, head);
+        builder->block = head;
+        add_item(builder, node, CFG_LOOP_TEST);
+
+        builder->block = new_block(cfg);
+        add_edge(cfg, head, builder->block);
+        builder->in_loop++;
+        add_statements(builder, control_body(ast_right(ast_left(node))));
+        builder->in_loop--;
+        add_edge(cfg, builder->block, head);
+
+        builder->block = new_block(cfg);
+        add_edge(cfg, head, builder->block);
+        break;
+    }
+    case AST_ELSE_STATEMENT:
+        // Added together with the IF it belongs to
+        break;
+    default:
+        add_item(builder, node, CFG_STATEMENT);
+        break;
+    }
+    return 0;
+}
+
+static void add_statements(CFGBuilder *builder, ASTNode *statement)
+{
+    ASTVisitor visitor = {add_statement, NULL, builder};
+    walk_ast(statement, &visitor);
+}
+
+// Build the control-flow graph of a statement sequence. Block 0 is the entry and blocks follow program order
+ControlFlowGraph *build_cfg(ASTNode *root)
+{
+    ControlFlowGraph *cfg = calloc(1, sizeof(ControlFlowGraph));
+    CFGBuilder builder = {cfg, new_block(cfg), 0};
+    add_statements(&builder, root);
+    cfg->set_words = compiler->symbol_table.count / 64 + 1;
+    return cfg;
+}
+
+void free_cfg(ControlFlowGraph *cfg)
+{
+    if (!cfg)
+        return;
+    free(cfg->blocks);
+    free(cfg->items);
+    free(cfg->uses);
+    free(cfg->defs);
+    free(cfg->live_in);
+    free(cfg->live_out);
+    free(cfg);
+}
+
+// Add every variable an operand, expression, or condition reads to the set
+static int mark_read(ASTNode *node, int depth, void *data)
+{
+    if (node->type == AST_IDENTIFIER)
+        set_insert(data, node->value);
+    return 1;
+}
+
+static void add_reads(ASTNode *first, uint64_t *set)
+{
+    ASTVisitor visitor = {mark_read, NULL, set};
+    walk_ast(first, &visitor);
+}
+
+// Get the variable an item writes, returning 0 if it writes none
+static int item_def(const CFGItem *item, uint32_t *slot)
+{
+    ASTNode *node = ast_node(item->node);
+    if (item->kind != CFG_STATEMENT || (node->type != AST_ASSIGNMENT && node->type != AST_COMMAND) || !node->left)
+        return 0;
+    *slot = ast_left(node)->value;
+    return 1;
+}
+
+// Add the variables an item reads to the set
+static void item_uses(const CFGItem *item, uint64_t *set)
+{
+    ASTNode *node = ast_node(item->node);
+    switch (item->kind)
+    {
+    case CFG_STATEMENT:
+        if (node->type == AST_ASSIGNMENT && node->left && ast_left(node)->right)
+            add_reads(ast_right(ast_right(ast_left(node))), set);
+        else if (node->type == AST_PRINT && node->left)
+            set_insert(set, ast_left(node)->value);
+        break;
+    case CFG_BRANCH:
+        add_reads(ast_left(ast_left(node)), set);
+        break;
+    case CFG_LOOP_ENTRY:
+        add_reads(ast_right(ast_right(ast_left(ast_left(node)))), set);
+        break;
+    case CFG_LOOP_TEST:
+        set_insert(set, ast_left(ast_left(node))->value);
+        break;
+    }
+}
+
+// Step the set of live variables backwards over one item
+void transfer_liveness(const CFGItem *item, uint64_t *live)
+{
+    uint32_t slot;
+    if (item->removed)
+        return;
+    if (item_def(item, &slot))
+        set_remove(live, slot);
+    item_uses(item, live);
+}
+
+// Compute the variables live on entry to and exit from every block, iterating until nothing changes
+void analyze_liveness(ControlFlowGraph *cfg)
+{
+    uint32_t words = cfg->set_words;
+    size_t size = (size_t)cfg->block_count * words * sizeof(uint64_t);
+    cfg->uses = realloc(cfg->uses, size);
+    cfg->defs = realloc(cfg->defs, size);
+    cfg->live_in = realloc(cfg->live_in, size);
+    cfg->live_out = realloc(cfg->live_out, size);
+    memset(cfg->uses, 0, size);
+    memset(cfg->defs, 0, size);
+    memset(cfg->live_in, 0, size);
+
+    // Summarize each block by what it reads before writing and what it writes
+    for (uint32_t b = 0; b < cfg->block_count; b++)
+    {
+        BasicBlock *block = &cfg->blocks[b];
+        uint64_t *uses = cfg->uses + (size_t)b * words;
+        uint64_t *defs = cfg->defs + (size_t)b * words;
+        for (uint32_t i = block->item_count; i-- > 0;)
+        {
+            const CFGItem *item = &cfg->items[block->first_item + i];
+            uint32_t slot;
+            if (!item->removed && item_def(item, &slot))
+                set_insert(defs, slot);
+            transfer_liveness(item, uses);
+        }
+    }
+
+    // Blocks are in program order, so visiting them backwards settles most graphs in one or two rounds
+    int changed;
+    do
+    {
+        changed = 0;
+        for (uint32_t b = cfg->block_count; b-- > 0;)
+        {
+            BasicBlock *block = &cfg->blocks[b];
+            uint64_t *out = cfg->live_out + (size_t)b * words;
+            uint64_t *in = cfg->live_in + (size_t)b * words;
+            const uint64_t *uses = cfg->uses + (size_t)b * words;
+            const uint64_t *defs = cfg->defs + (size_t)b * words;
+
+            // Only the last block leaves the graph, and whatever runs after it may read variables
+            if (block->successor_count == 0 && cfg->exit_live)
+                memcpy(out, cfg->exit_live, words * sizeof(uint64_t));
+            else
+                memset(out, 0, words * sizeof(uint64_t));
+            for (uint32_t s = 0; s < block->successor_count; s++)
+            {
+                const uint64_t *successor_in = cfg->live_in + (size_t)block->successors[s] * words;
+                for (uint32_t w = 0; w < words; w++)
+                    out[w] |= successor_in[w];
+            }
+
+            for (uint32_t w = 0; w < words; w++)
+            {
+                uint64_t live = uses[w] | (out[w] & ~defs[w]);
+                if (live != in[w])
+                {
+                    in[w] = live;
+                    changed = 1;
+                }
+            }
+        }
+    } while (changed);
+}
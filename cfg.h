@@ -0,0 +1,73 @@
+// cfg.h
+#ifndef CFG_H
+#define CFG_H
+
+#include <stdint.h>
+#include "ast.h"
+
+// What a CFG item does at its program point
+typedef enum
+{
+    CFG_STATEMENT,  // A CREATE, SET, assignment, or PRINT
+    CFG_BRANCH,     // An IF comparing its variable with its operand
+    CFG_LOOP_ENTRY, // A WHILE reading its comparison operand once before the loop
+    CFG_LOOP_TEST,  // A WHILE comparing its variable at the top of every iteration
+} CFGItemKind;
+
+// One program point inside a basic block
+typedef struct
+{
+    uint32_t node;   // Arena index of the statement
+    uint8_t kind;    // CFGItemKind
+    uint8_t in_loop; // Set when the item runs inside a WHILE body
+    uint8_t removed; // Set once the item is found to be a dead store, so it no longer reads or writes anything
+} CFGItem;
+
+// A straight-line run of items, entered only at its first item and left only after its last
+typedef struct
+{
+    uint32_t first_item;
+    uint32_t item_count;
+    uint32_t successors[2];
+    uint32_t successor_count;
+} BasicBlock;
+
+// Control-flow graph of a statement sequence, plus the per-block variable sets of the liveness analysis
+typedef struct
+{
+    BasicBlock *blocks;
+    uint32_t block_count;
+    uint32_t block_capacity;
+    CFGItem *items;
+    uint32_t item_count;
+    uint32_t item_capacity;
+    uint32_t set_words; // 64-bit words in one set of symbol slots
+    uint64_t *uses;     // Variables each block reads before writing them
+    uint64_t *defs;     // Variables each block writes
+    uint64_t *live_in;  // Variables live on entry to each block
+    uint64_t *live_out; // Variables live on exit from each block
+    const uint64_t *exit_live; // Variables still read after the graph ends, or NULL if none are
+} ControlFlowGraph;
+
+// Membership tests and updates for the variable sets, indexed by symbol slot
+static inline int set_contains(const uint64_t *set, uint32_t slot)
+{
+    return (set[slot / 64] >> (slot % 64)) & 1;
+}
+
+static inline void set_insert(uint64_t *set, uint32_t slot)
+{
+    set[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+static inline void set_remove(uint64_t *set, uint32_t slot)
+{
+    set[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+void analyze_liveness(ControlFlowGraph *cfg);
+ControlFlowGraph *build_cfg(ASTNode *root);
+void free_cfg(ControlFlowGraph *cfg);
+void transfer_liveness(const CFGItem *item, uint64_t *live);
+
+#endif
@@ -0,0 +1,245 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "astfile.h"
+#include "binary.h"
+#include "budget.h"
+#include "bytecode.h"
+#include "compiler.h"
+#include "gcode.h"
+#include "parallel.h"
+#include "peephole.h"
+#include "utility.h"
+
+_Thread_local CompilerContext *compiler = NULL; // The compilation running on this thread
+
+// Start a compilation that writes Gcode to output and AST dumps and optimizer messages to diagnostics
+void init_compiler(CompilerContext *context, GcodeSink *output, FILE *diagnostics)
+{
+    memset(context, 0, sizeof(*context));
+    context->gcode_output = output;
+    context->diagnostics = diagnostics;
+    context->unroll_factor = DEFAULT_UNROLL_FACTOR;
+}
+
+// Release the bytecode a run that failed partway still holds, and its register file
+void release_program(CompilerContext *context)
+{
+    free_bytecode(context->program);
+    context->program = NULL;
+    free(context->registers);
+    context->registers = NULL;
+}
+
+// Release the AST and the symbols of a finished compilation
+void free_compiler(CompilerContext *context)
+{
+    CompilerContext *previous = compiler;
+    compiler = context;
+    free_ast();
+    free_symbols();
+    compiler = previous;
+}
+
+// Stop the current compilation once its error has been reported, so compile_input() returns a failure
+_Noreturn void fail_compilation()
+{
+    if (!compiler)
+        exit(EXIT_FAILURE);
+    longjmp(compiler->failure, 1);
+}
+
+// Fail a run whose last statements used up a limit, which only dropped lines as no later statement was left to stop at
+static void check_finished_run()
+{
+    if (compiler->budget && compiler->budget->exhausted)
+        stop_execution(compiler->budget);
+}
+
+// Output the Gcode for a sequence of statements with the selected engine
+static void run_program(ASTNode *root)
+{
+    double start = stats_clock();
+    if (run_parallel(root))
+    {
+        record_phase(PHASE_GENERATE, start);
+        return;
+    }
+    if (compiler->use_tree_walker)
+    {
+        generate_gcode(root);
+        if (compiler->peephole)
+            flush_peephole(compiler->peephole, compiler->gcode_output);
+        record_phase(PHASE_GENERATE, start);
+        check_finished_run();
+        return;
+    }
+
+    compiler->program = compile_bytecode(root);
+    record_phase(PHASE_LOWER, start);
+    start = stats_clock();
+    run_bytecode(compiler->program);
+    record_phase(PHASE_GENERATE, start);
+
+    // Held lines point into the program's strings, so they are written before it goes
+    if (compiler->peephole)
+        flush_peephole(compiler->peephole, compiler->gcode_output);
+    free_bytecode(compiler->program);
+    compiler->program = NULL;
+    check_finished_run();
+}
+
+// Write the lines the peephole stage still holds after a failed run as well, report what it removed, and end a binary
+// stream, so everything the compilation produced is in the sink before it returns
+static void finish_output(CompilerContext *context)
+{
+    if (context->peephole)
+    {
+        flush_peephole(context->peephole, context->gcode_output);
+        report_peephole(context->peephole, context->diagnostics);
+        if (context->stats)
+        {
+            context->stats->peephole_lines_removed += context->peephole->lines_in - context->peephole->lines_out;
+            context->stats->peephole_bytes_removed += context->peephole->bytes_in - context->peephole->bytes_out;
+        }
+    }
+    if (context->binary_output)
+        finish_binary_gcode(context->binary_output, context->gcode_output);
+}
+
+// Parse, fold, and emit one top-level statement at a time so memory stays bounded by nesting depth
+static int stream_gcode()
+{
+    int i = 0;
+    int status;
+    uint32_t statement;
+
+    for (;;)
+    {
+        double start = stats_clock();
+        status = parse_next_statement(&i, &statement);
+        record_phase(PHASE_BUILD_AST, start);
+        if (status <= 0)
+            break;
+
+        start = stats_clock();
+        fold_constants(ast_node(statement));
+        record_phase(PHASE_FOLD_CONSTANTS, start);
+        start = stats_clock();
+        mark_counted_loops(ast_node(statement));
+        record_phase(PHASE_COUNTED_LOOPS, start);
+        run_program(ast_node(statement));
+        reset_ast();
+    }
+    return status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Build, optimize, and run the whole program, printing the AST before and after optimization. A program with a syntax
+// error fails without running anything, as it would when streamed
+static int compile_program()
+{
+    double start = stats_clock();
+    int syntax_errors = compiler->syntax_errors;
+    ASTNode *ast = ast_node(build_ast());
+    record_phase(PHASE_BUILD_AST, start);
+    if (compiler->syntax_errors != syntax_errors)
+        return EXIT_FAILURE;
+    fprintf(compiler->diagnostics, "Original Abstract Syntax Tree:\n");
+    print_ast(ast, 0);
+
+    ast = optimize_ast(ast);
+    fprintf(compiler->diagnostics, "\nOptimized Abstract Syntax Tree:\n");
+    print_ast(ast, 0);
+    if (compiler->ast_output && save_ast(compiler->ast_output, ast) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write the AST to %s.\n", compiler->ast_output);
+        fail_compilation();
+    }
+
+    fprintf(compiler->diagnostics, "\nGenerated GCode:\n");
+    run_program(ast);
+    return EXIT_SUCCESS;
+}
+
+// Run the compilation on the input the scanner has just opened, then release the scanner and everything the run holds
+static int compile_scanned(CompilerContext *context, CompilerContext *previous)
+{
+    volatile int status = EXIT_FAILURE;
+    size_t written = context->gcode_output->written;
+
+    if (setjmp(context->failure) == 0)
+        status = context->streaming ? stream_gcode() : compile_program();
+    finish_output(context);
+    release_program(context);
+    close_scanner();
+
+    // Scanning runs inside build_ast, so its time is taken out of the parse time
+    if (context->stats)
+    {
+        context->stats->seconds[PHASE_BUILD_AST] -= context->stats->seconds[PHASE_SCAN];
+        context->stats->tokens += context->token_count;
+        context->stats->gcode_bytes += context->gcode_output->written - written;
+    }
+    compiler = previous;
+    return status;
+}
+
+// Compile a program from an open file with the given context, returning EXIT_SUCCESS or EXIT_FAILURE
+int compile_input(CompilerContext *context, FILE *input)
+{
+    CompilerContext *previous = compiler;
+    compiler = context;
+    open_scanner(input);
+    return compile_scanned(context, previous);
+}
+
+// Compile a program held in memory without copying it. data holds the source followed by
+// COMPILER_BUFFER_PADDING zero bytes, size counts them too, and tokens point into the buffer until the call returns
+int compile_buffer(CompilerContext *context, char *data, size_t size)
+{
+    CompilerContext *previous = compiler;
+    compiler = context;
+    if (!open_scanner_buffer(data, size))
+    {
+        fprintf(stderr, "Error: Source buffer must end with %d zero bytes.\n", COMPILER_BUFFER_PADDING);
+        close_scanner();
+        compiler = previous;
+        return EXIT_FAILURE;
+    }
+    return compile_scanned(context, previous);
+}
+
+// Compile a program held in a read-only buffer of length bytes. Without the padding, flex copies it a block at a time,
+// though the hand-written lexer still scans it in place
+int compile_bytes(CompilerContext *context, const char *data, size_t length)
+{
+    CompilerContext *previous = compiler;
+    compiler = context;
+    open_scanner_bytes(data, length);
+    return compile_scanned(context, previous);
+}
+
+// Output the Gcode of an AST file saved with --emit-ast. The file is mapped as the arena, so nothing is scanned, parsed,
+// or optimized, and only the variables are allocated
+int compile_ast_file(CompilerContext *context, const char *path)
+{
+    CompilerContext *previous = compiler;
+    volatile int status = EXIT_FAILURE;
+    size_t written = context->gcode_output->written;
+    uint32_t root;
+
+    compiler = context;
+    if (setjmp(context->failure) == 0 && load_ast(path, &root) == 0)
+    {
+        run_program(ast_node(root));
+        status = EXIT_SUCCESS;
+    }
+    finish_output(context);
+    release_program(context);
+
+    if (context->stats)
+        context->stats->gcode_bytes += context->gcode_output->written - written;
+    compiler = previous;
+    return status;
+}
@@ -0,0 +1,111 @@
+// compiler.h
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <time.h>
+#include "ast.h"
+#include "scanner.h"
+#include "sink.h"
+#include "source.h"
+#include "stats.h"
+#include "symbols.h"
+
+#define COMPILER_BUFFER_PADDING 2 // Zero bytes that must follow the source given to compile_buffer()
+#define DEFAULT_UNROLL_FACTOR 4   // Copies of a loop body unrolling puts between condition checks, unless --unroll says otherwise
+
+// Everything one compilation reads and writes, so several can run at once on different threads
+typedef struct CompilerContext
+{
+    void *scanner;               // Reentrant flex scanner reading the input, or NULL with fast_lexer set
+    Source source;               // The whole source, which every token points into
+    Token tokens[TOKEN_WINDOW];  // Ring buffer holding the most recently scanned tokens
+    Token end_of_input;          // Returned for any position past the last token, placed at the end of the source
+    int token_count;             // Total number of tokens scanned so far
+    int input_exhausted;
+    int syntax_errors;           // Syntax errors reported so far
+    ASTArena ast_arena;          // Holds every node of the AST being compiled
+    SymbolTable symbol_table;    // Every variable seen so far, indexed by slot
+    FILE *diagnostics;           // Channel for AST dumps and optimizer messages, kept apart from the Gcode output
+    GcodeSink *gcode_output;     // Where every line of generated Gcode is written
+    int streaming;               // Set by --stream to compile one top-level statement at a time
+    int fast_lexer;              // Set by --fast-lexer to scan with the hand-written lexer instead of flex
+    int use_tree_walker;         // Set by --tree to run programs with generate_gcode instead of the bytecode VM
+    struct BytecodeProgram *program; // Bytecode being run, released by release_program() if the run fails
+    int32_t *registers;          // Register file of the bytecode being run, released along with it
+    CompilerStats *stats;        // Measurements collected for --stats, or NULL while it is off
+    const char *ast_output;      // Set by --emit-ast to save the optimized AST to this file
+    struct Peephole *peephole;   // Set by --peephole to hold generated lines back and remove redundant ones, or NULL
+    struct BinaryGcode *binary_output; // Set by --binary to encode the Gcode as binary blocks instead of text, or NULL
+    int jobs;                    // Set by -j to emit independent segments of the program on this many threads
+    int unroll_factor;           // Set by --unroll to the most copies of a WHILE body between condition checks; 1 turns unrolling off
+    struct ExecutionBudget *budget; // Set by --max-statements, --max-lines, --max-bytes, and --timeout to bound the run, or NULL
+    jmp_buf failure;             // Where fail_compilation() returns to once an error has been reported
+} CompilerContext;
+
+// The compilation running on this thread
+extern _Thread_local CompilerContext *compiler;
+
+int compile_ast_file(CompilerContext *context, const char *path);
+int compile_buffer(CompilerContext *context, char *data, size_t size);
+int compile_bytes(CompilerContext *context, const char *data, size_t length);
+int compile_input(CompilerContext *context, FILE *input);
+_Noreturn void fail_compilation();
+void free_compiler(CompilerContext *context);
+void init_compiler(CompilerContext *context, GcodeSink *output, FILE *diagnostics);
+void release_program(CompilerContext *context);
+
+// Resolve an arena index to its node, or NULL for AST_NULL. Pointers stay valid until the next create_ast_node()
+static inline ASTNode *ast_node(uint32_t index)
+{
+    return index ? &compiler->ast_arena.nodes[index] : NULL;
+}
+
+static inline ASTNode *ast_left(const ASTNode *node)
+{
+    return ast_node(node->left);
+}
+
+static inline ASTNode *ast_right(const ASTNode *node)
+{
+    return ast_node(node->right);
+}
+
+static inline uint32_t ast_index(const ASTNode *node)
+{
+    return node ? (uint32_t)(node - compiler->ast_arena.nodes) : AST_NULL;
+}
+
+// Look up a variable by the slot stored in its IDENTIFIER nodes
+static inline Symbol *get_symbol(uint32_t slot)
+{
+    return &compiler->symbol_table.symbols[slot];
+}
+
+// Text of a non-integer node, such as an identifier, operator, or keyword
+static inline const char *ast_text(const ASTNode *node)
+{
+    if (node->type == AST_IDENTIFIER || node->type == AST_SETTING)
+        return get_symbol(node->value)->identifier;
+    return compiler->ast_arena.text + node->value;
+}
+
+// Read the clock for timing a phase, or return 0 without reading it while --stats is off
+static inline double stats_clock()
+{
+    if (!compiler->stats)
+        return 0;
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Add the time since start, taken with stats_clock(), to a phase
+static inline void record_phase(StatsPhase phase, double start)
+{
+    if (compiler->stats)
+        compiler->stats->seconds[phase] += stats_clock() - start;
+}
+
+#endif
@@ -1,28 +1,190 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include "binary.h"
+#include "budget.h"
 #include "gcode.h"
+#include "peephole.h"
 #include "utility.h"
 
+// Format one generated line, leaving out its comment if comments is 0. Lines that are only a comment then write nothing
+void write_gcode_line(GcodeSink *sink, const GcodeLine *line, int comments)
+{
+    switch (line->kind)
+    {
+    case GCODE_INITIALIZE:
+        sink_write(sink, "G92 ", 4);
+        sink_write_string(sink, line->name);
+        sink_write_int(sink, line->value);
+        if (!comments)
+            break;
+        sink_write(sink, " ; Initialize ", 14);
+        sink_write_string(sink, line->name);
+        sink_write(sink, " to ", 4);
+        sink_write_string(sink, line->parameter);
+        sink_write(sink, " (", 2);
+        sink_write_int(sink, line->value);
+        sink_write(sink, ")", 1);
+        break;
+    case GCODE_UPDATE:
+        if (!comments)
+            return;
+        sink_write(sink, "; Updated ", 10);
+        sink_write_string(sink, line->name);
+        sink_write(sink, " to ", 4);
+        sink_write_int(sink, line->value);
+        break;
+    case GCODE_PRINT:
+        sink_write(sink, "M117 ", 5);
+        sink_write_string(sink, line->name);
+        sink_write_int(sink, line->value);
+        if (comments)
+        {
+            sink_write(sink, " ; Printed value of ", 20);
+            sink_write_string(sink, line->name);
+        }
+        break;
+    default:
+        return;
+    }
+    sink_write(sink, "\n", 1);
+}
+
+static size_t int_length(int value)
+{
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    size_t length = value < 0 ? 2 : 1;
+    for (; magnitude >= 10; magnitude /= 10)
+        length++;
+    return length;
+}
+
+// Bytes write_gcode_line() writes for a line, without formatting it
+size_t gcode_line_length(const GcodeLine *line, int comments)
+{
+    size_t name = strlen(line->name);
+    switch (line->kind)
+    {
+    case GCODE_INITIALIZE:
+        return 4 + name + int_length(line->value) + (comments ? 14 + name + 4 + strlen(line->parameter) + 2 + int_length(line->value) + 1 : 0) + 1;
+    case GCODE_UPDATE:
+        return comments ? 10 + name + 4 + int_length(line->value) + 1 : 0;
+    case GCODE_PRINT:
+        return 5 + name + int_length(line->value) + (comments ? 20 + name : 0) + 1;
+    default:
+        return 0;
+    }
+}
+
+// Write a finished line in the selected output format: binary Gcode with --binary, text otherwise
+void output_gcode_line(GcodeSink *sink, const GcodeLine *line, int comments)
+{
+    if (compiler->binary_output)
+        encode_binary_line(compiler->binary_output, sink, line);
+    else
+        write_gcode_line(sink, line, comments);
+}
+
+// Hand a generated line to the peephole window when --peephole is on, or straight to the output.
+// Once a limit of the run is used up, lines are dropped until the engine reaches its next statement and stops
+static inline void emit_line(GcodeLineKind kind, const char *name, const char *parameter, int value)
+{
+    GcodeLine line = {kind, value, name, parameter};
+    if (compiler->budget && spend_line(compiler->budget))
+        return;
+    COUNT_STAT(gcode_lines, 1);
+    if (compiler->peephole)
+        peephole_line(compiler->peephole, compiler->gcode_output, &line);
+    else
+        output_gcode_line(compiler->gcode_output, &line, 1);
+}
+
+// Output the Gcode that initializes a variable
+void emit_initialize(const char *name, const char *parameter, int value)
+{
+    emit_line(GCODE_INITIALIZE, name, parameter, value);
+}
+
+// Output the Gcode comment recording a variable's new value
+void emit_update(const char *name, int value)
+{
+    emit_line(GCODE_UPDATE, name, NULL, value);
+}
+
+// Output the Gcode that displays a variable's value
+void emit_print(const char *name, int value)
+{
+    emit_line(GCODE_PRINT, name, NULL, value);
+}
+
+// Run a counted loop in closed form: set the variable to its final value and output the update comment of every iteration.
+// Returns 0 without changing anything when the loop would not end, so the caller runs it step by step instead
+int emit_counted_loop(const char *name, int *value, const char *operator, int bound, int step)
+{
+    int64_t trips;
+    if (!count_loop_trips(operator, *value, bound, step, &trips))
+        return 0;
+
+    COUNT_STAT(closed_form_iterations, trips);
+    int current = *value;
+    for (int64_t i = 0; i < trips; i++)
+    {
+        current += step;
+        emit_update(name, current);
+        if (compiler->budget && compiler->budget->exhausted)
+            break;
+    }
+    *value = current;
+    return 1;
+}
+
+// Get the first statement run by an IF, ELSE, or WHILE, whose block may also be a single unbraced statement
+ASTNode *control_body(ASTNode *block)
+{
+    return block && block->type == AST_STATEMENT_BLOCK ? ast_left(block) : block;
+}
+
+// Evaluate an operand AST node (integer, identifier, parameter, or expression) to its current value
+int evaluate_operand(ASTNode *operand)
+{
+    switch (operand->type)
+    {
+    case AST_INTEGER:
+        return operand->value;
+    case AST_IDENTIFIER:
+        return get_symbol(operand->value)->value;
+    case AST_PARAMETER:
+        return map_initial_value(ast_text(operand));
+    case AST_EXPRESSION:
+    {
+        ASTNode *left = ast_left(operand);
+        ASTNode *operator_node = ast_right(left);
+        return do_math(evaluate_operand(left), ast_text(operator_node), evaluate_operand(ast_right(operator_node)));
+    }
+    default:
+        return 0;
+    }
+}
+
 // Parse condition from an AST node and get the variable, operator, and comparison integer, then return the symbol for the variable
 Symbol *parse_the_condition(ASTNode *condition, const char **operator, int * compare_value)
 {
-    ASTNode *var_name = condition->left;
-    *operator= var_name->right->value;
-    *compare_value = atoi(var_name->right->right->value);
+    ASTNode *var_name = ast_left(condition);
+    *operator= ast_text(ast_right(var_name));
+    *compare_value = evaluate_operand(ast_right(ast_right(var_name)));
     return get_symbol(var_name->value);
 }
 
 // Process an assignment statement from an AST node and update the assigned variable's value
 void process_assignment(ASTNode *statement)
 {
-    if (!statement || !statement->left || !statement->left->right)
+    if (!statement || !statement->left || !ast_left(statement)->right)
         return;
 
-    ASTNode *identifier = statement->left;
-    ASTNode *operator_node = identifier->right;
+    ASTNode *identifier = ast_left(statement);
+    ASTNode *operator_node = ast_right(identifier);
 
-    ASTNode *operand = operator_node ? operator_node->right : NULL;
+    ASTNode *operand = operator_node ? ast_right(operator_node) : NULL;
     if (!operand)
     {
         fprintf(stderr, "Error: Assignment missing operand\n");
@@ -32,48 +194,49 @@ void process_assignment(ASTNode *statement)
     Symbol *assigned_var = get_symbol(identifier->value);
     if (!assigned_var)
     {
-        fprintf(stderr, "Error: Undefined variable '%s'\n", identifier->value);
+        fprintf(stderr, "Error: Undefined variable '%s'\n", ast_text(identifier));
         return;
     }
 
     // Update the assigned variable's value and print the Gcode comment indicating it
-    assigned_var->value = strcmp(operator_node->value, "=") == 0 ? atoi(operand->value) : do_math(assigned_var->value, operator_node->value, atoi(operand->value));
-    printf("; Updated %s to %d\n", identifier->value, assigned_var->value);
+    int operand_value = evaluate_operand(operand);
+    assigned_var->value = strcmp(ast_text(operator_node), "=") == 0 ? operand_value : do_math(assigned_var->value, ast_text(operator_node), operand_value);
+    emit_update(assigned_var->identifier, assigned_var->value);
 }
 
+// Execute one statement and output its Gcode. Control statements run their own blocks, so children are never walked
+static int execute_statement(ASTNode *node, int depth, void *data);
+
+static const ASTVisitor gcode_visitor = {execute_statement, NULL, NULL};
+
 // Process a sequence of statement AST nodes
 void process_statements(ASTNode *statement)
 {
-    while (statement)
-    {
-        // Either process AST assignments separately or generate Gcode, then move on to the next statement
-        statement->type == AST_ASSIGNMENT ? process_assignment(statement) : generate_gcode(statement);
-        statement = statement->right;
-    }
+    walk_ast(statement, &gcode_visitor);
 }
 
-// Generate Gcode based on a given AST node
-void generate_gcode(ASTNode *node)
+static int execute_statement(ASTNode *node, int depth, void *data)
 {
-    if (!node)
-        return; // Prevent null pointer access
+    // An ELSE runs as part of the IF before it, so it is not counted on its own
+    ExecutionBudget *budget = compiler->budget;
+    if (budget && node->type != AST_ELSE_STATEMENT && spend_statement(budget, ast_index(node), budget->loop))
+        stop_execution(budget);
 
     switch (node->type)
     {
     case AST_COMMAND:
-        if (node->left && node->left->right)
-            initialize_variable(node->left->value, node->left->right->value);
+        if (node->left && ast_left(node)->right)
+            initialize_variable(ast_left(node)->value, ast_text(ast_right(ast_left(node))));
         break;
     case AST_ASSIGNMENT:
-        if (node->left && node->left->right)
+        if (node->left && ast_left(node)->right)
             process_assignment(node);
         break;
     case AST_PRINT:
         if (node->left)
         {
-            Symbol *symbol = get_symbol(node->left->value);
-            if (symbol)
-                printf("M117 %s%d ; Printed value of %s\n", node->left->value, symbol->value, node->left->value);
+            Symbol *symbol = get_symbol(ast_left(node)->value);
+            emit_print(symbol->identifier, symbol->value);
         }
         break;
     case AST_IF_STATEMENT:
@@ -81,51 +244,64 @@ void generate_gcode(ASTNode *node)
         if (!node->left)
         {
             fprintf(stderr, "Error: IF statement missing condition\n");
-            return;
+            break;
         }
 
         // Parse the IF statement's condition
         const char *operator;
         int compare_value;
-        Symbol *cond_symbol = parse_the_condition(node->left, &operator, & compare_value);
-        if (!cond_symbol)
-        {
-            fprintf(stderr, "Error: Undefined variable in IF condition\n");
-            return;
-        }
+        Symbol *cond_symbol = parse_the_condition(ast_left(node), &operator, & compare_value);
 
-        // If the condition evaluates to true, process the IF block's statements
+        // If the condition evaluates to true, process the IF block's statements, otherwise those of an attached ELSE
         if (evaluate_condition(cond_symbol->value, operator, compare_value))
-            process_statements(node->left->right->left);
+            process_statements(control_body(ast_right(ast_left(node))));
+        else if (node->right && ast_right(node)->type == AST_ELSE_STATEMENT)
+            process_statements(control_body(ast_left(ast_right(node))));
         break;
     }
+    case AST_COUNTED_LOOP:
     case AST_WHILE:
     {
         if (!node->left)
         {
             fprintf(stderr, "Error: WHILE node missing condition\n");
-            return;
+            break;
         }
 
         // Parse the WHILE loop's condition
         const char *operator;
         int compare_value;
-        Symbol *loop_var = parse_the_condition(node->left, &operator, & compare_value);
-        if (!loop_var)
-        {
-            fprintf(stderr, "Error: Undefined variable in WHILE condition\n");
-            return;
-        }
+        Symbol *loop_var = parse_the_condition(ast_left(node), &operator, & compare_value);
 
-        // While the condition evaluates to true, process the WHILE block's statements
+        // A counted loop skips straight to its outcome unless it would never end
+        int step;
+        if (node->type == AST_COUNTED_LOOP && match_counted_loop(node, &step) && emit_counted_loop(loop_var->identifier, &loop_var->value, operator, compare_value, step))
+            break;
+
+        // While the condition evaluates to true, process the WHILE block's statements. Each iteration counts as a
+        // statement of its own, so even a loop with an empty body runs out of budget
+        uint64_t iterations = 0;
+        uint32_t outer_loop = budget ? budget->loop : AST_NULL;
         while (evaluate_condition(loop_var->value, operator, compare_value))
-            process_statements(node->left->right->left);
+        {
+            if (budget && spend_statement(budget, ast_index(node), ast_index(node)))
+                stop_execution(budget);
+            process_statements(control_body(ast_right(ast_left(node))));
+            iterations++;
+        }
+        if (budget)
+            budget->loop = outer_loop;
+        COUNT_STAT(loop_iterations, iterations);
         break;
     }
     default:
         break;
     }
+    return 0;
+}
 
-    // Recursively process sibling AST nodes
-    generate_gcode(node->right);
+// Generate Gcode for a sequence of statements, starting at the given AST node
+void generate_gcode(ASTNode *node)
+{
+    process_statements(node);
 }
@@ -7,14 +7,36 @@
 #include <stdlib.h>
 #include "parser.h"
 #include "scanner.h"
+#include "sink.h"
+#include "symbols.h"
 
-// Symbol table for tracking variable states
+// Kinds of line the code generators emit. A line the peephole stage removed is marked GCODE_DROPPED
+typedef enum
+{
+    GCODE_DROPPED,
+    GCODE_INITIALIZE, // G92 setting a variable's axis, commented with the parameter it came from
+    GCODE_UPDATE,     // Comment recording an assignment
+    GCODE_PRINT,      // M117 showing a variable's value
+} GcodeLineKind;
+
+// A generated line before formatting. name points into the symbol table, parameter into the AST or the bytecode
 typedef struct
 {
-    char identifier[10];
+    GcodeLineKind kind;
     int value;
-} Symbol;
+    const char *name;
+    const char *parameter;
+} GcodeLine;
 
+ASTNode *control_body(ASTNode *block);
+int emit_counted_loop(const char *name, int *value, const char *operator, int bound, int step);
+void emit_initialize(const char *name, const char *parameter, int value);
+void emit_print(const char *name, int value);
+void emit_update(const char *name, int value);
+int evaluate_operand(ASTNode *operand);
+size_t gcode_line_length(const GcodeLine *line, int comments);
 void generate_gcode(ASTNode *node);
+void output_gcode_line(GcodeSink *sink, const GcodeLine *line, int comments);
+void write_gcode_line(GcodeSink *sink, const GcodeLine *line, int comments);
 
 #endif
\ No newline at end of file
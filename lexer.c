@@ -0,0 +1,201 @@
+#include <string.h>
+#include "lexer.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Byte classes whose runs are skipped in blocks
+typedef enum
+{
+    CLASS_BLANK, // Space, tab, or carriage return, which separate tokens
+    CLASS_DIGIT,
+    CLASS_WORD,  // Letters, digits, and underscores, which continue a keyword or identifier
+} ByteClass;
+
+typedef struct
+{
+    const char *text;
+    size_t length; // 0 for an empty slot
+    State type;
+} Keyword;
+
+// Every word the flex rules give a token other than LEXICAL_ERROR, in the slot keyword_slot() gives it
+static const Keyword keywords[LEXER_KEYWORD_SLOTS] = {
+    [1] = {"ELSE", 4, ELSE},
+    [2] = {"IF", 2, IF},
+    [3] = {"WHILE", 5, WHILE},
+    [4] = {"Z", 1, IDENTIFIER},
+    [5] = {"CREATE", 6, COMMAND},
+    [8] = {"INFILL", 6, SETTING},
+    [10] = {"SET", 3, COMMAND},
+    [12] = {"FAST", 4, PARAMETER},
+    [13] = {"MEDIUM", 6, PARAMETER},
+    [14] = {"PRINT", 5, PRINT},
+    [15] = {"STRONG", 6, PARAMETER},
+    [16] = {"HIGH", 4, PARAMETER},
+    [25] = {"LOW", 3, PARAMETER},
+    [26] = {"X", 1, IDENTIFIER},
+    [27] = {"SLOW", 4, PARAMETER},
+    [28] = {"LAYER_HEIGHT", 12, SETTING},
+    [30] = {"SPEED", 5, SETTING},
+    [31] = {"Y", 1, IDENTIFIER},
+};
+
+// Perfect hash of the keyword table: a word's length and last letter are enough to tell every entry apart
+static inline unsigned keyword_slot(const char *word, size_t length)
+{
+    return (length * 2 + (unsigned char)word[length - 1] * 5) & (LEXER_KEYWORD_SLOTS - 1);
+}
+
+static inline int in_class(unsigned char byte, ByteClass class)
+{
+    switch (class)
+    {
+    case CLASS_BLANK:
+        return byte == ' ' || byte == '\t' || byte == '\r';
+    case CLASS_DIGIT:
+        return byte >= '0' && byte <= '9';
+    default:
+        return (byte >= '0' && byte <= '9') || ((byte | 0x20) >= 'a' && (byte | 0x20) <= 'z') || byte == '_';
+    }
+}
+
+#ifdef __SSE2__
+// Bit i is set when byte i of block lies in [low, high]. Moving the range down to start at -128 lets one signed
+// comparison check both ends
+static inline unsigned bytes_in_range(__m128i block, unsigned char low, unsigned char high)
+{
+    __m128i moved = _mm_add_epi8(block, _mm_set1_epi8((char)(0x80 - low)));
+    return _mm_movemask_epi8(_mm_cmplt_epi8(moved, _mm_set1_epi8((char)(0x80 + high - low + 1))));
+}
+
+static inline unsigned bytes_equal(__m128i block, char byte)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(byte)));
+}
+
+// Bit i is set when byte i of block belongs to class
+static inline unsigned class_mask(__m128i block, ByteClass class)
+{
+    switch (class)
+    {
+    case CLASS_BLANK:
+        return bytes_equal(block, ' ') | bytes_equal(block, '\t') | bytes_equal(block, '\r');
+    case CLASS_DIGIT:
+        return bytes_in_range(block, '0', '9');
+    default:
+        // Setting bit 5 folds uppercase letters onto lowercase, leaving digits and underscores where they are
+        return bytes_in_range(block, '0', '9') | bytes_in_range(_mm_or_si128(block, _mm_set1_epi8(0x20)), 'a', 'z') |
+               bytes_equal(block, '_');
+    }
+}
+#endif
+
+// Length of the run of bytes of one class that starts at text. Whole blocks are classified while 16 bytes of the
+// source remain, so no load reaches past its end
+static inline size_t span_class(const char *text, const char *end, ByteClass class)
+{
+    const char *start = text;
+#ifdef __SSE2__
+    while (end - text >= 16)
+    {
+        unsigned mask = class_mask(_mm_loadu_si128((const __m128i *)text), class);
+        if (mask != 0xFFFF)
+            return text - start + __builtin_ctz(~mask);
+        text += 16;
+    }
+#endif
+    while (text < end && in_class(*text, class))
+        text++;
+    return text - start;
+}
+
+// The token a word scans as. Like flex, which prefers the longest match, a keyword only counts as the whole word, so
+// CREATEX is one invalid word
+static State word_type(const char *word, size_t length)
+{
+    if (length > LEXER_LONGEST_KEYWORD)
+        return LEXICAL_ERROR;
+    const Keyword *keyword = &keywords[keyword_slot(word, length)];
+    return keyword->length == length && memcmp(keyword->text, word, length) == 0 ? keyword->type : LEXICAL_ERROR;
+}
+
+// Scan the next token into the compilation's token window. Returns 0 at the end of the source, like yylex()
+int lex_token(Source *source)
+{
+    const char *start = source_at(source, source->position);
+    const char *end = source_at(source, source->length);
+    const char *text = start;
+    text += span_class(text, end, CLASS_BLANK);
+    if (text == end)
+    {
+        source->position = source->length;
+        return 0;
+    }
+
+    // Two-character comparisons win over their first character, as the longest match does in flex
+    unsigned char byte = *text;
+    int pair = text + 1 < end && text[1] == '=';
+    size_t length = 1;
+    State type;
+    if (in_class(byte, CLASS_DIGIT))
+    {
+        length = span_class(text, end, CLASS_DIGIT);
+        type = INTEGER;
+    }
+    else if (in_class(byte, CLASS_WORD) && byte != '_')
+    {
+        length = span_class(text, end, CLASS_WORD);
+        type = word_type(text, length);
+    }
+    else
+    {
+        switch (byte)
+        {
+        case '\n':
+            type = NEW_LINE;
+            break;
+        case '(':
+            type = OPEN_PAREN;
+            break;
+        case ')':
+            type = CLOSE_PAREN;
+            break;
+        case '{':
+            type = OPEN_BRACE;
+            break;
+        case '}':
+            type = CLOSE_BRACE;
+            break;
+        case '+':
+        case '-':
+        case '*':
+        case '/':
+            type = OPERATOR;
+            break;
+        case '=':
+            type = pair ? EQUAL : ASSIGN;
+            length += pair;
+            break;
+        case '<':
+            type = pair ? LESS_EQUAL : LESS_THAN;
+            length += pair;
+            break;
+        case '>':
+            type = pair ? GREATER_EQUAL : GREATER_THAN;
+            length += pair;
+            break;
+        case '!':
+            type = pair ? NOT_EQUAL : LEXICAL_ERROR;
+            length += pair;
+            break;
+        default:
+            type = LEXICAL_ERROR;
+            break;
+        }
+    }
+
+    source->position += text + length - start;
+    return add_token(type, length);
+}
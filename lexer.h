@@ -0,0 +1,13 @@
+// lexer.h
+#ifndef LEXER_H
+#define LEXER_H
+
+#include "scanner.h"
+#include "source.h"
+
+#define LEXER_KEYWORD_SLOTS 32 // Size of the keyword table, which holds every keyword and identifier without collisions
+#define LEXER_LONGEST_KEYWORD 12 // Length of LAYER_HEIGHT, so longer words skip the table
+
+int lex_token(Source *source);
+
+#endif
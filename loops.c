@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+#include "gcode.h"
+#include "utility.h"
+
+#define LOOP_GROWTH_LIMIT 256 // Most nodes unrolling or peeling may add to the AST for one WHILE
+#define PEEL_MIN_OPERATIONS 3 // Fewest arithmetic operations per iteration peeling must save to be worth a copy of the body
+
+// Check whether a statement steps a variable by a constant, like `X = X + 1`, and get that step
+int match_loop_step(ASTNode *statement, uint32_t slot, int *step)
+{
+    if (statement->type != AST_ASSIGNMENT || !statement->left || !ast_left(statement)->right)
+        return 0;
+    ASTNode *target = ast_left(statement);
+    ASTNode *operand = ast_right(ast_right(target));
+    if (target->value != slot || !operand || operand->type != AST_EXPRESSION || !operand->left)
+        return 0;
+
+    // Its value must be the variable plus or minus an integer, or an integer plus the variable
+    ASTNode *left = ast_left(operand);
+    ASTNode *operator_node = ast_right(left);
+    ASTNode *right = ast_right(operator_node);
+    char operator = ast_text(operator_node)[0];
+    if (left->type == AST_IDENTIFIER && left->value == slot && right->type == AST_INTEGER && (operator == '+' || operator == '-') && right->value != INT32_MIN)
+        *step = operator == '+' ? right->value : -right->value;
+    else if (right->type == AST_IDENTIFIER && right->value == slot && left->type == AST_INTEGER && operator == '+')
+        *step = left->value;
+    else
+        return 0;
+    return 1;
+}
+
+// Check whether a WHILE only steps its own variable by a constant, like `WHILE (X < 100) { X = X + 1 }`, and get that step
+int match_counted_loop(ASTNode *loop, int *step)
+{
+    if ((loop->type != AST_WHILE && loop->type != AST_COUNTED_LOOP) || !loop->left)
+        return 0;
+
+    // The body must be a single assignment to the loop variable
+    ASTNode *condition = ast_left(loop);
+    ASTNode *body = control_body(ast_right(condition));
+    return body && !body->right && match_loop_step(body, ast_left(condition)->value, step);
+}
+
+// Work out how many times `variable operator bound` holds while the variable starts at start and moves by step each time.
+// Returns 0 if the loop would never end or its variable would overflow, as the loop has to run step by step then
+int count_loop_trips(const char *operator, int start, int bound, int step, int64_t *trips)
+{
+    int64_t distance;
+    if (!evaluate_condition(start, operator, bound))
+    {
+        *trips = 0;
+        return 1;
+    }
+
+    switch (operator[0])
+    {
+    case '<':
+        // Count the steps until the variable passes the bound
+        if (step <= 0)
+            return 0;
+        distance = (int64_t)bound - start + (operator[1] == '=');
+        *trips = (distance + step - 1) / step;
+        break;
+    case '>':
+        if (step >= 0)
+            return 0;
+        distance = (int64_t)start - bound + (operator[1] == '=');
+        *trips = (distance - step - 1) / -step;
+        break;
+    case '=':
+        // The variable equals the bound now, and the first step moves it away
+        if (step == 0)
+            return 0;
+        *trips = 1;
+        break;
+    case '!':
+        // The variable has to land exactly on the bound
+        distance = (int64_t)bound - start;
+        if (step == 0 || distance % step != 0 || distance / step <= 0)
+            return 0;
+        *trips = distance / step;
+        break;
+    default:
+        return 0;
+    }
+
+    int64_t last = start + *trips * step;
+    return last >= INT32_MIN && last <= INT32_MAX;
+}
+
+// Clear *changes once a statement assigns or creates the variable in *slot
+static int find_assignment(ASTNode *node, int depth, void *data)
+{
+    uint32_t *slot = data;
+    if ((node->type == AST_ASSIGNMENT || node->type == AST_COMMAND) && node->left && ast_left(node)->type == AST_IDENTIFIER &&
+        (uint32_t)ast_left(node)->value == *slot)
+    {
+        *slot = UINT32_MAX;
+        return 0;
+    }
+    return *slot != UINT32_MAX;
+}
+
+// Check whether a WHILE, once entered, can never end. Both engines read the bound once before the first iteration, so a
+// loop runs forever when nothing in its body assigns its variable, or when its only assignment steps it by 0
+int loop_never_ends(ASTNode *loop)
+{
+    if ((loop->type != AST_WHILE && loop->type != AST_COUNTED_LOOP) || !loop->left || !ast_left(loop)->left)
+        return 0;
+    int step;
+    if (match_counted_loop(loop, &step))
+        return step == 0;
+
+    ASTNode *condition = ast_left(loop);
+    uint32_t slot = ast_left(condition)->value;
+    ASTVisitor visitor = {find_assignment, NULL, &slot};
+    walk_ast(control_body(ast_right(condition)), &visitor);
+    return slot != UINT32_MAX;
+}
+
+// Mark a WHILE as a counted loop so the engines can run it in closed form, and warn about any WHILE that never ends
+static int mark_counted_loop(ASTNode *node, int depth, void *data)
+{
+    int step;
+    if (node->type == AST_WHILE && match_counted_loop(node, &step))
+    {
+        fprintf(compiler->diagnostics, "\n* Counted loop on %s with step %d\n", ast_text(ast_left(ast_left(node))), step);
+        node->type = AST_COUNTED_LOOP;
+    }
+    if ((node->type == AST_WHILE || node->type == AST_COUNTED_LOOP) && loop_never_ends(node))
+        fprintf(compiler->diagnostics, "\n* Warning: WHILE on %s never ends once entered, as nothing in its body changes %s\n",
+                ast_text(ast_left(ast_left(node))), ast_text(ast_left(ast_left(node))));
+    return 1;
+}
+
+// Find the WHILE loops whose trip count and final value can be computed instead of iterated
+void mark_counted_loops(ASTNode *root)
+{
+    ASTVisitor visitor = {mark_counted_loop, NULL, NULL};
+    walk_ast(root, &visitor);
+}
+
+// A WHILE body as the loop optimizer sees it before copying it
+typedef struct
+{
+    uint32_t *assignments; // Statements in the body assigning each symbol slot, nested ones included
+    uint32_t nodes;        // Nodes in the body, which every copy of it adds to the arena again
+} LoopBody;
+
+static int measure_body(ASTNode *node, int depth, void *data)
+{
+    LoopBody *body = data;
+    body->nodes++;
+    if ((node->type == AST_ASSIGNMENT || node->type == AST_COMMAND) && node->left)
+        body->assignments[ast_left(node)->value]++;
+    return 1;
+}
+
+// Check whether an operand reads a variable the loop body assigns
+static int reads_assigned(ASTNode *operand, const LoopBody *body)
+{
+    if (operand->type == AST_IDENTIFIER)
+        return body->assignments[operand->value] != 0;
+    if (operand->type != AST_EXPRESSION)
+        return 0;
+    ASTNode *operator_node = ast_right(ast_left(operand));
+    return reads_assigned(ast_left(operand), body) || reads_assigned(ast_right(operator_node), body);
+}
+
+// Check whether a top-level statement of a loop body gives its variable the same computed value on every iteration:
+// nothing else in the body assigns the variable, and nothing in the body assigns what the expression reads
+static int is_invariant_assignment(ASTNode *statement, const LoopBody *body)
+{
+    if (statement->type != AST_ASSIGNMENT || !statement->left || !ast_left(statement)->right)
+        return 0;
+    ASTNode *target = ast_left(statement);
+    ASTNode *operand = ast_right(ast_right(target));
+    return operand && operand->type == AST_EXPRESSION && body->assignments[target->value] == 1 && !reads_assigned(operand, body);
+}
+
+// Arithmetic operations evaluating an operand takes
+static int count_operations(ASTNode *operand)
+{
+    if (operand->type != AST_EXPRESSION)
+        return 0;
+    ASTNode *operator_node = ast_right(ast_left(operand));
+    return 1 + count_operations(ast_left(operand)) + count_operations(ast_right(operator_node));
+}
+
+// Turn the invariant assignments among the top-level statements of a copy of the body into `Y = Y`. An earlier copy
+// that ran in the same pass has computed the value already, and each copy still writes its update line
+static void reuse_invariants(uint32_t first, const LoopBody *body)
+{
+    for (ASTNode *statement = ast_node(first); statement; statement = ast_right(statement))
+    {
+        if (!is_invariant_assignment(statement, body))
+            continue;
+        ASTNode *target = ast_left(statement);
+        ASTNode *operand = ast_right(ast_right(target));
+        operand->type = AST_IDENTIFIER;
+        operand->value = target->value;
+        operand->left = AST_NULL;
+    }
+}
+
+static uint32_t last_statement(uint32_t statement)
+{
+    while (ast_node(statement)->right)
+        statement = ast_node(statement)->right;
+    return statement;
+}
+
+// Append a fresh copy of the body, with chains of its own, to the statements ending at *last, and turn its invariant
+// assignments into copies if reuse is set. The body is cut off from what follows it while it is copied
+static void append_copy(uint32_t *first, uint32_t *last, uint32_t body_first, uint32_t body_last, const LoopBody *body, int reuse)
+{
+    uint32_t after = ast_node(body_last)->right;
+    ast_node(body_last)->right = AST_NULL;
+    uint32_t copy = copy_ast(&compiler->ast_arena, body_first);
+    ast_node(body_last)->right = after;
+    if (reuse)
+        reuse_invariants(copy, body);
+    if (*last)
+        ast_node(*last)->right = copy;
+    else
+        *first = copy;
+    *last = last_statement(copy);
+}
+
+// Put a WHILE's body in a block of its own, as copies of the body are added to it
+static void ensure_block(ASTNode *condition)
+{
+    if (ast_right(condition)->type == AST_STATEMENT_BLOCK)
+        return;
+    uint32_t index = ast_index(condition);
+    uint32_t block = create_ast_node(AST_STATEMENT_BLOCK, "STATEMENT_BLOCK");
+    ast_node(block)->left = ast_node(index)->right;
+    ast_node(index)->right = block;
+}
+
+// Work out the value of a condition's bound when the loop is reached, which both engines read once before the first
+// iteration. Returns 0 if it is not known
+static int known_bound(ASTNode *bound, const ConstantState *state, int *value)
+{
+    if (bound->type == AST_INTEGER)
+        *value = bound->value;
+    else if (bound->type == AST_PARAMETER)
+        return lookup_initial_value(ast_text(bound), value);
+    else if (bound->type == AST_IDENTIFIER && state->known[bound->value])
+        *value = state->values[bound->value];
+    else
+        return 0;
+    return 1;
+}
+
+// Work out how many times a WHILE runs when its variable's value on reaching it is known and a top-level statement of
+// its body, which runs once per iteration, is the only one that steps it
+static int known_trips(ASTNode *loop, const ConstantState *state, const LoopBody *body, int64_t *trips)
+{
+    ASTNode *condition = ast_left(loop);
+    ASTNode *variable = ast_left(condition);
+    ASTNode *operator_node = ast_right(variable);
+    uint32_t slot = variable->value;
+    int bound, step;
+    if (!state->known[slot] || body->assignments[slot] != 1 || !known_bound(ast_right(operator_node), state, &bound))
+        return 0;
+    for (ASTNode *statement = control_body(ast_right(condition)); statement; statement = ast_right(statement))
+    {
+        if (match_loop_step(statement, slot, &step))
+            return count_loop_trips(ast_text(operator_node), state->values[slot], bound, step, trips);
+    }
+    return 0;
+}
+
+// Nodes that unrolling a loop by factor adds: the copies before it and the extra copies in its body
+static int64_t unrolled_nodes(int64_t trips, int factor, uint32_t nodes)
+{
+    return (trips % factor + factor - 1) * (int64_t)nodes;
+}
+
+// Unroll or peel a WHILE whose inner loops are done, given what is known about the variables when it is reached.
+// Returns the first statement replacing it and sets *last to the last, which are the loop itself if nothing changed
+static uint32_t optimize_loop(uint32_t loop, const ConstantState *state, uint32_t *last)
+{
+    ASTNode *node = ast_node(loop);
+    *last = loop;
+    int step;
+    if (node->type != AST_WHILE || !node->left || !ast_left(node)->right || match_counted_loop(node, &step) || loop_never_ends(node))
+        return loop;
+
+    uint32_t condition = node->left;
+    uint32_t body_first = ast_index(control_body(ast_right(ast_node(condition))));
+    uint32_t body_last = last_statement(body_first);
+    LoopBody body = {calloc(compiler->symbol_table.count + 1, sizeof(uint32_t)), 0};
+    ASTVisitor visitor = {measure_body, NULL, &body};
+    walk_ast(ast_node(body_first), &visitor);
+
+    // Both transformations evaluate the condition again later, so its bound must be one the body cannot change
+    ASTNode *bound = ast_right(ast_right(ast_left(ast_node(condition))));
+    int64_t trips = -1;
+    int invariants = 0;
+    if (bound->type != AST_IDENTIFIER || !body.assignments[bound->value])
+    {
+        if (!known_trips(node, state, &body, &trips))
+            trips = -1;
+        for (ASTNode *statement = ast_node(body_first); statement; statement = ast_right(statement))
+        {
+            if (is_invariant_assignment(statement, &body))
+                invariants += count_operations(ast_right(ast_right(ast_left(statement))));
+        }
+    }
+
+    // A loop short enough to copy whole leaves no condition to check at all
+    uint32_t first = loop;
+    int factor = compiler->unroll_factor;
+    if (factor > 1 && trips > 0 && trips <= factor && trips * body.nodes <= LOOP_GROWTH_LIMIT)
+    {
+        first = body_first;
+        *last = body_last;
+        for (int64_t i = 1; i < trips; i++)
+            append_copy(&first, last, body_first, body_last, &body, 1);
+        fprintf(compiler->diagnostics, "\n* Unrolled WHILE on %s into %lld copies of its body\n",
+                ast_text(ast_left(ast_node(condition))), (long long)trips);
+        free(body.assignments);
+        return first;
+    }
+
+    // Otherwise run the iterations the factor does not divide first, and then check the condition once per factor
+    // iterations, taking the largest factor whose copies fit and save more condition checks than they add nodes
+    while (trips > factor && factor > 1 && (unrolled_nodes(trips, factor, body.nodes) > LOOP_GROWTH_LIMIT ||
+                                            trips - trips / factor < unrolled_nodes(trips, factor, body.nodes)))
+        factor--;
+    if (trips > factor && factor > 1)
+    {
+        uint32_t prologue_last = AST_NULL;
+        first = AST_NULL;
+        for (int64_t i = 0; i < trips % factor; i++)
+            append_copy(&first, &prologue_last, body_first, body_last, &body, i > 0);
+        if (first)
+            ast_node(prologue_last)->right = loop;
+        else
+            first = loop;
+
+        ensure_block(ast_node(condition));
+        uint32_t copies_last = body_last;
+        for (int i = 1; i < factor; i++)
+            append_copy(&body_first, &copies_last, body_first, body_last, &body, 1);
+        fprintf(compiler->diagnostics, "\n* Unrolled WHILE on %s by %d, running %lld iterations before it\n",
+                ast_text(ast_left(ast_node(condition))), factor, (long long)(trips % factor));
+    }
+
+    // Peel the first iteration of a loop with invariant assignments off into an IF, so later iterations copy the values.
+    // Each assignment still runs and writes its update line, so only the arithmetic is saved, and a copy of the body is
+    // only worth it when there is enough of that
+    else if (invariants >= PEEL_MIN_OPERATIONS && body.nodes <= LOOP_GROWTH_LIMIT)
+    {
+        for (ASTNode *statement = ast_node(body_first); statement; statement = ast_right(statement))
+        {
+            if (is_invariant_assignment(statement, &body))
+                fprintf(compiler->diagnostics, "\n* Peeled the first iteration off WHILE on %s, so later ones reuse %s\n",
+                        ast_text(ast_left(ast_node(condition))), ast_text(ast_left(statement)));
+        }
+
+        uint32_t peeled = AST_NULL, peeled_last = AST_NULL;
+        append_copy(&peeled, &peeled_last, body_first, body_last, &body, 0);
+        reuse_invariants(body_first, &body);
+        ast_node(peeled_last)->right = loop;
+        ast_node(loop)->right = AST_NULL;
+
+        uint32_t guard = create_ast_node(AST_CONDITION, "CONDITION");
+        uint32_t test = copy_ast(&compiler->ast_arena, ast_node(condition)->left);
+        ast_node(guard)->left = test;
+        uint32_t block = create_ast_node(AST_STATEMENT_BLOCK, "STATEMENT_BLOCK");
+        ast_node(block)->left = peeled;
+        ast_node(guard)->right = block;
+        first = create_ast_node(AST_IF_STATEMENT, "IF_STATEMENT");
+        ast_node(first)->left = guard;
+        *last = first;
+    }
+    free(body.assignments);
+    return first;
+}
+
+static uint32_t optimize_list(uint32_t first, ConstantState *state);
+
+// Optimize the loops in the block of an IF, ELSE, or WHILE, which can be entered with any values. Returns the block,
+// wrapped in a STATEMENT_BLOCK if a single unbraced statement became several
+static uint32_t optimize_block(uint32_t block)
+{
+    ConstantState state;
+    init_state(&state, compiler->symbol_table.count);
+    memset(state.known, 0, state.count + 1);
+    if (ast_node(block)->type == AST_STATEMENT_BLOCK)
+    {
+        uint32_t first = optimize_list(ast_node(block)->left, &state);
+        ast_node(block)->left = first;
+    }
+    else
+    {
+        uint32_t first = optimize_list(block, &state);
+        if (first != block)
+        {
+            block = create_ast_node(AST_STATEMENT_BLOCK, "STATEMENT_BLOCK");
+            ast_node(block)->left = first;
+        }
+    }
+    free_state(&state);
+    return block;
+}
+
+// Optimize the loops of a statement list, inner ones first, and return its new first statement. state holds what is
+// known about the variables where the list starts and is left holding what is known where it ends
+static uint32_t optimize_list(uint32_t first, ConstantState *state)
+{
+    uint32_t previous = AST_NULL;
+    for (uint32_t index = first; index;)
+    {
+        ASTNode *node = ast_node(index);
+        uint32_t next = node->right;
+        uint32_t replaced = index, last = index;
+        ASTNode *target = ast_left(node);
+        switch (node->type)
+        {
+        case AST_COMMAND:
+            if (target && target->right)
+                state->known[target->value] = lookup_initial_value(ast_text(ast_right(target)), &state->values[target->value]);
+            break;
+        case AST_ASSIGNMENT:
+        {
+            ASTNode *operand = target && target->right ? ast_right(ast_right(target)) : NULL;
+            if (!operand)
+                break;
+            state->known[target->value] = operand->type == AST_INTEGER;
+            state->values[target->value] = operand->value;
+            break;
+        }
+        case AST_ELSE_STATEMENT:
+        {
+            uint32_t block = optimize_block(node->left);
+            ast_node(index)->left = block;
+            ASTVisitor forget = {forget_assigned, NULL, state};
+            walk_ast(ast_node(block), &forget);
+            break;
+        }
+        case AST_IF_STATEMENT:
+        case AST_WHILE:
+        {
+            if (!target || !target->right)
+                break;
+            uint32_t block = optimize_block(target->right);
+            ast_node(ast_node(index)->left)->right = block;
+
+            // What the body assigns is unknown after it, but a loop is unrolled from what is known before it
+            int loop = ast_node(index)->type == AST_WHILE;
+            ConstantState entry;
+            if (loop)
+                entry = copy_state(state);
+            ASTVisitor forget = {forget_assigned, NULL, state};
+            walk_ast(ast_node(block), &forget);
+            if (loop)
+            {
+                replaced = optimize_loop(index, &entry, &last);
+                free_state(&entry);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+
+        if (previous)
+            ast_node(previous)->right = replaced;
+        else
+            first = replaced;
+        ast_node(last)->right = next;
+        previous = last;
+        index = next;
+    }
+    return first;
+}
+
+// Unroll WHILE loops whose trip counts are known and peel the first iteration off loops with invariant assignments.
+// state holds what the pass knows about the variables where the statements start and is left holding what it knows
+// where they end, so a program optimized in pieces gets the same loops as one optimized whole. Returns the new first
+// statement
+ASTNode *optimize_loops(ASTNode *root, ConstantState *state)
+{
+    return ast_node(optimize_list(ast_index(root), state));
+}
@@ -1,26 +1,231 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include "ast.h"
-#include "gcode.h"
-#include "utility.h"
-
-int yylex();
+#include <string.h>
+#include <unistd.h>
+#include "batch.h"
+#include "binary.h"
+#include "budget.h"
+#include "cache.h"
+#include "compiler.h"
+#include "peephole.h"
+#include "server.h"
 
 int main(int argc, char **argv)
 {
-    extern FILE *yyin;
-    yyin = fopen(argv[1], "r");
-    yylex();
+    int streaming = 0;
+    int use_tree_walker = 0;
+    int fast_lexer = 0;
+    int batch = 0;
+    int jobs = 0;
+    int unroll_factor = DEFAULT_UNROLL_FACTOR;
+    int stats = 0; // 1 for --stats, 2 for --stats=json
+    int server = 0;
+    const char *manifest = NULL;
+    const char *cache_directory = NULL;
+    long cache_megabytes = 1024;
+    int cache_totals = 0;
+    const char *output_path = NULL;
+    const char *ast_output = NULL;
+    int load_ast = 0;
+    int peephole = 0; // 1 for --peephole, 2 for --strip-comments
+    int binary = 0;   // 1 for --binary, 2 for --compress
+    int decode = 0;
+    ExecutionLimits limits = {0};
+    int output_fd = STDOUT_FILENO;
+    int arg = 1;
+
+    // Read the options that come before the input files
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        if (strcmp(argv[arg], "--stream") == 0)
+            streaming = 1;
+        else if (strcmp(argv[arg], "--tree") == 0)
+            use_tree_walker = 1;
+        else if (strcmp(argv[arg], "--fast-lexer") == 0)
+            fast_lexer = 1;
+        else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc)
+            output_path = argv[++arg];
+        else if (strcmp(argv[arg], "--fd") == 0 && arg + 1 < argc)
+            output_fd = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--batch") == 0)
+            batch = 1;
+        else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+            jobs = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--unroll") == 0 && arg + 1 < argc)
+            unroll_factor = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--manifest") == 0 && arg + 1 < argc)
+            manifest = argv[++arg];
+        else if (strcmp(argv[arg], "--server") == 0)
+            server = 1;
+        else if (strcmp(argv[arg], "--emit-ast") == 0 && arg + 1 < argc)
+            ast_output = argv[++arg];
+        else if (strcmp(argv[arg], "--load-ast") == 0)
+            load_ast = 1;
+        else if (strcmp(argv[arg], "--peephole") == 0)
+            peephole = peephole ? peephole : 1;
+        else if (strcmp(argv[arg], "--strip-comments") == 0)
+            peephole = 2;
+        else if (strcmp(argv[arg], "--binary") == 0)
+            binary = binary ? binary : 1;
+        else if (strcmp(argv[arg], "--compress") == 0)
+            binary = 2;
+        else if (strcmp(argv[arg], "--decode") == 0)
+            decode = 1;
+        else if (strcmp(argv[arg], "--max-statements") == 0 && arg + 1 < argc)
+            limits.statements = strtoull(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "--max-lines") == 0 && arg + 1 < argc)
+            limits.lines = strtoull(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "--max-bytes") == 0 && arg + 1 < argc)
+            limits.bytes = strtoull(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "--timeout") == 0 && arg + 1 < argc)
+            limits.seconds = atof(argv[++arg]);
+        else if (strcmp(argv[arg], "--cache") == 0 && arg + 1 < argc)
+            cache_directory = argv[++arg];
+        else if (strcmp(argv[arg], "--cache-limit") == 0 && arg + 1 < argc)
+            cache_megabytes = atol(argv[++arg]);
+        else if (strcmp(argv[arg], "--cache-stats") == 0)
+            cache_totals = 1;
+        else if (strcmp(argv[arg], "--stats") == 0)
+            stats = 1;
+        else if (strcmp(argv[arg], "--stats=json") == 0)
+            stats = 2;
+        else
+            break;
+    }
+
+    int limited = limits.statements || limits.lines || limits.bytes || limits.seconds > 0;
+
+    // Compilations share Gcode through the cache directory, keeping at most the given number of megabytes
+    GcodeCache cache;
+    if (cache_directory && open_cache(&cache, cache_directory, (uint64_t)cache_megabytes << 20) != 0)
+    {
+        perror(cache_directory);
+        return EXIT_FAILURE;
+    }
+    if (cache_totals)
+    {
+        CacheTotals totals;
+        if (!cache_directory || read_cache_totals(&cache, &totals) != 0)
+        {
+            fprintf(stderr, "Error: --cache-stats needs a readable --cache directory.\n");
+            return EXIT_FAILURE;
+        }
+        printf("%llu hits, %llu misses, %llu bytes stored\n", (unsigned long long)totals.hits,
+               (unsigned long long)totals.misses, (unsigned long long)totals.bytes);
+        return EXIT_SUCCESS;
+    }
+
+    // A batch compiles every listed file, or every file in a manifest, into its own output file. Its statistics would
+    // mix every thread's files, so --stats is left to single compilations
+    if ((batch || manifest) && !stats)
+    {
+        int count = argc - arg;
+        char **paths = argv + arg;
+        if (manifest && !(paths = read_manifest(manifest, &count)))
+            return EXIT_FAILURE;
+        BatchOptions options = {streaming, use_tree_walker, fast_lexer, unroll_factor, peephole, binary};
+        return run_batch(paths, count, jobs, &options, cache_directory ? &cache : NULL, limited ? &limits : NULL);
+    }
+
+    // A server keeps compiling the programs sent on stdin, reusing the parts each one shares with the last
+    if (server)
+        return run_server(stdin, output_fd, use_tree_walker, limited ? &limits : NULL);
+
+    // Only a whole-program compilation has an optimized AST to save
+    if (arg != argc - 1 || batch || manifest || (ast_output && (streaming || cache_directory || load_ast)) || (decode && (binary || load_ast)))
+    {
+        fprintf(stderr, "Usage: %s [--stream] [--tree] [--fast-lexer] [--unroll n] [--stats[=json]] [--peephole | --strip-comments] [--binary | --compress] [limits] [--cache dir [--cache-limit MB]] [-o file | --fd n] <file.ddd>\n", argv[0]);
+        fprintf(stderr, "       %s --batch [-j threads] [--stream] [--tree] [--fast-lexer] [--unroll n] [--peephole | --strip-comments] [--binary | --compress] [limits] [--cache dir [--cache-limit MB]] <file.ddd>...\n", argv[0]);
+        fprintf(stderr, "       %s --manifest list.txt [-j threads] [--stream] [--tree] [--fast-lexer] [--unroll n] [--peephole | --strip-comments] [--binary | --compress] [limits] [--cache dir [--cache-limit MB]]\n", argv[0]);
+        fprintf(stderr, "       %s [--tree] [--fast-lexer] [--unroll n] [--stats[=json]] [-o file | --fd n] --emit-ast file.ast <file.ddd>\n", argv[0]);
+        fprintf(stderr, "       %s --load-ast [--tree] [--stats[=json]] [--peephole | --strip-comments] [--binary | --compress] [limits] [-o file | --fd n] <file.ast>\n", argv[0]);
+        fprintf(stderr, "       %s --decode [-o file | --fd n] <file.bin>\n", argv[0]);
+        fprintf(stderr, "       %s --cache dir --cache-stats\n", argv[0]);
+        fprintf(stderr, "       %s --server [--tree] [limits] [--fd n]\n", argv[0]);
+        fprintf(stderr, "limits: --max-statements n, --max-lines n, --max-bytes n, --timeout seconds\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *path = argv[arg];
+    FILE *input = load_ast || decode ? NULL : fopen(path, "r");
+    if (!load_ast && !decode && !input)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    // Gcode goes to the sink and everything else to stderr, so the Gcode stream stays clean
+    GcodeSink output_sink;
+    if (output_path)
+    {
+        if (sink_open_file(&output_sink, output_path) != 0)
+        {
+            perror(output_path);
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        sink_open_fd(&output_sink, output_fd);
+    }
 
-    ASTNode *ast = build_ast();
-    printf("Original Abstract Syntax Tree:\n");
-    print_ast(ast, 0);
+    // Decoding turns binary Gcode back into the text it stands for, without compiling anything
+    if (decode)
+    {
+        int status = decode_binary_file(path, &output_sink) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        if (sink_close(&output_sink) != 0)
+        {
+            fprintf(stderr, "Error: Failed to write Gcode output.\n");
+            return EXIT_FAILURE;
+        }
+        return status;
+    }
 
-    optimize_ast(ast);
-    printf("\nOptimized Abstract Syntax Tree:\n");
-    print_ast(ast, 0);
+    CompilerContext context;
+    CompilerStats compiler_stats = {0};
+    init_compiler(&context, &output_sink, stderr);
+    context.streaming = streaming;
+    context.use_tree_walker = use_tree_walker;
+    context.fast_lexer = fast_lexer;
+    context.stats = stats ? &compiler_stats : NULL;
+    context.ast_output = ast_output;
+    context.jobs = jobs;
+    context.unroll_factor = unroll_factor;
+    Peephole peephole_window;
+    if (peephole)
+    {
+        init_peephole(&peephole_window, peephole == 2);
+        context.peephole = &peephole_window;
+    }
+    BinaryGcode binary_encoder;
+    if (binary)
+    {
+        init_binary_gcode(&binary_encoder, peephole != 2, binary == 2);
+        context.binary_output = &binary_encoder;
+    }
+    ExecutionBudget budget;
+    if (limited)
+    {
+        start_budget(&budget, &limits, &output_sink);
+        context.budget = &budget;
+    }
+    int status;
+    if (load_ast)
+        status = compile_ast_file(&context, path);
+    else if (cache_directory)
+        status = compile_cached(&cache, &context, input);
+    else
+        status = compile_input(&context, input);
+    free_compiler(&context);
+    if (input)
+        fclose(input);
+    if (stats)
+        print_stats(&compiler_stats, stderr, stats == 2);
 
-    printf("\nGenerated GCode:\n");
-    generate_gcode(ast);
-    return 0;
+    if (sink_close(&output_sink) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write Gcode output.\n");
+        return EXIT_FAILURE;
+    }
+    return status;
 }
@@ -0,0 +1,381 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+#include "bytecode.h"
+#include "gcode.h"
+#include "parallel.h"
+#include "utility.h"
+
+// Segments shared out between the emission threads. The calling thread writes them to its sink in program order
+typedef struct
+{
+    CompilerContext *parent;
+    Segment *segments;
+    uint32_t count;
+    uint32_t next;      // Index of the next segment to start
+    uint32_t written;   // Segments already written to the parent's sink
+    uint32_t window;    // Segments that may be started ahead of the next one to write
+    atomic_int stopped; // Set once a segment failed, so no more are started and the running ones are cancelled
+    int *final_values;  // Variable values after the last segment
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} SegmentQueue;
+
+// Get the value an operand holds before the program runs, if it can be known without running anything
+static int known_value(ASTNode *operand, const ConstantState *state, int *value)
+{
+    switch (operand->type)
+    {
+    case AST_INTEGER:
+        *value = operand->value;
+        return 1;
+    case AST_IDENTIFIER:
+        *value = state->values[operand->value];
+        return state->known[operand->value];
+    case AST_PARAMETER:
+        return lookup_initial_value(ast_text(operand), value);
+    case AST_EXPRESSION:
+    {
+        if (!operand->left || !ast_left(operand)->right)
+            return 0;
+        ASTNode *left = ast_left(operand);
+        ASTNode *operator_node = ast_right(left);
+        const char *operator = ast_text(operator_node);
+        int a, b;
+        if (!operator_node->right || !known_value(left, state, &a) || !known_value(ast_right(operator_node), state, &b))
+            return 0;
+
+        // A division or shift that fails is left for the engine to report when it gets there
+        int operation = arithmetic_operator(operator);
+        if (!operation || (operation == '/' && (b == 0 || (a == INT32_MIN && b == -1))) ||
+            ((operation == '<' || operation == '>') && !valid_shift(b)))
+            return 0;
+        *value = do_math(a, operator, b);
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+static uint64_t track_statements(ASTNode *statement, ConstantState *state);
+
+// Follow what one statement does to the known values, like propagate_statement() but without rewriting or reporting
+// anything, and estimate the Gcode lines it emits
+static uint64_t track_statement(ASTNode *node, ConstantState *state)
+{
+    switch (node->type)
+    {
+    case AST_COMMAND:
+    {
+        ASTNode *target = ast_left(node);
+        if (target && target->right)
+            state->known[target->value] = lookup_initial_value(ast_text(ast_right(target)), &state->values[target->value]);
+        return 1;
+    }
+    case AST_ASSIGNMENT:
+    {
+        ASTNode *target = ast_left(node);
+        if (target && target->right && ast_right(target)->right)
+            state->known[target->value] = known_value(ast_right(ast_right(target)), state, &state->values[target->value]);
+        return 1;
+    }
+    case AST_IF_STATEMENT:
+    {
+        if (!node->left)
+            return 1;
+        ASTNode *condition = ast_left(node);
+        ASTNode *variable = ast_left(condition);
+        ASTNode *operator_node = ast_right(variable);
+        ASTNode *body = control_body(ast_right(condition));
+        ASTNode *else_body = node->right && ast_right(node)->type == AST_ELSE_STATEMENT ? control_body(ast_left(ast_right(node))) : NULL;
+
+        // A condition known before the run picks its branch, otherwise only what both branches agree on is known after
+        int bound;
+        if (state->known[variable->value] && known_value(ast_right(operator_node), state, &bound))
+            return 1 + track_statements(evaluate_condition(state->values[variable->value], ast_text(operator_node), bound) ? body : else_body, state);
+        ConstantState taken = copy_state(state);
+        uint64_t lines = track_statements(body, &taken);
+        uint64_t else_lines = track_statements(else_body, state);
+        meet_states(state, &taken);
+        free_state(&taken);
+        return 1 + (lines > else_lines ? lines : else_lines);
+    }
+    case AST_WHILE:
+    case AST_COUNTED_LOOP:
+    {
+        if (!node->left)
+            return 1;
+        ASTNode *condition = ast_left(node);
+        ASTNode *variable = ast_left(condition);
+        ASTNode *operator_node = ast_right(variable);
+        ASTNode *body = control_body(ast_right(condition));
+        uint32_t slot = variable->value;
+
+        // The bound is read once on entry, so a loop that starts from known values either never runs, or runs a known
+        // number of times when it is counted
+        int bound, step;
+        int64_t trips;
+        int known = state->known[slot] && known_value(ast_right(operator_node), state, &bound);
+        if (known && !evaluate_condition(state->values[slot], ast_text(operator_node), bound))
+            return 1;
+        if (known && match_counted_loop(node, &step) && count_loop_trips(ast_text(operator_node), state->values[slot], bound, step, &trips))
+        {
+            state->values[slot] += (int)(trips * step);
+            return 1 + trips;
+        }
+
+        ASTVisitor forget = {forget_assigned, NULL, state};
+        walk_ast(body, &forget);
+        ConstantState iteration = copy_state(state);
+        uint64_t lines = track_statements(body, &iteration);
+        free_state(&iteration);
+        return 1 + (lines < (1ULL << 40) ? lines * PARALLEL_LOOP_GUESS : lines);
+    }
+    default:
+        return 0;
+    }
+}
+
+static uint64_t track_statements(ASTNode *statement, ConstantState *state)
+{
+    uint64_t lines = 0;
+    for (; statement; statement = ast_right(statement))
+        lines += track_statement(statement, state);
+    return lines;
+}
+
+// Whether every variable has a known value, which makes the point a place to start a segment
+static int fully_known(const ConstantState *state)
+{
+    for (uint32_t slot = 0; slot < state->count; slot++)
+        if (!state->known[slot])
+            return 0;
+    return 1;
+}
+
+// Cut the top-level statements into segments of roughly target lines each. A segment can only start where every
+// variable is known, and never at an ELSE, which belongs to the IF before it
+static Segment *cut_segments(ASTNode *root, uint32_t *count, uint32_t jobs)
+{
+    ConstantState state;
+    uint32_t symbols = compiler->symbol_table.count;
+    init_state(&state, symbols);
+    for (uint32_t slot = 0; slot < symbols; slot++)
+        state.values[slot] = get_symbol(slot)->value;
+    uint64_t *lines = NULL;
+    uint32_t statements = 0;
+    uint64_t total = 0;
+    for (ASTNode *statement = root; statement; statement = ast_right(statement), statements++)
+    {
+        if ((statements & (statements - 1)) == 0)
+            lines = realloc(lines, (statements ? statements * 2 : 1) * sizeof(*lines));
+        lines[statements] = track_statement(statement, &state);
+        total += lines[statements];
+    }
+
+    // The run starts from the symbol table, and later segments from the values tracked up to their first statement
+    uint64_t target = total / ((uint64_t)jobs * PARALLEL_SEGMENTS_PER_THREAD) + 1;
+    Segment *segments = calloc(1, sizeof(*segments));
+    *count = 1;
+    segments[0].first = root;
+    segments[0].values = malloc((symbols + 1) * sizeof(int));
+    sink_open_memory(&segments[0].output);
+    for (uint32_t slot = 0; slot < symbols; slot++)
+        state.values[slot] = segments[0].values[slot] = get_symbol(slot)->value;
+    memset(state.known, 1, symbols);
+    uint64_t filled = 0;
+    ASTNode *previous = NULL;
+    uint32_t index = 0;
+    for (ASTNode *statement = root; statement; previous = statement, statement = ast_right(statement), index++)
+    {
+        if (filled >= target && statement->type != AST_ELSE_STATEMENT && fully_known(&state))
+        {
+            segments = realloc(segments, (*count + 1) * sizeof(*segments));
+            segments[*count - 1].last = previous;
+            segments[*count] = (Segment){statement};
+            segments[*count].values = malloc((symbols + 1) * sizeof(int));
+            memcpy(segments[*count].values, state.values, symbols * sizeof(int));
+            sink_open_memory(&segments[*count].output);
+            (*count)++;
+            filled = 0;
+        }
+        track_statement(statement, &state);
+        filled += lines[index];
+    }
+    segments[*count - 1].last = previous;
+
+    free_state(&state);
+    free(lines);
+    return segments;
+}
+
+// Emit one segment from its starting values with the selected engine, into the segment's own sink
+static int emit_segment(Segment *segment)
+{
+    CompilerContext *context = compiler;
+    for (uint32_t slot = 0; slot < context->symbol_table.count; slot++)
+        get_symbol(slot)->value = segment->values[slot];
+    context->gcode_output = &segment->output;
+
+    if (setjmp(context->failure) != 0)
+    {
+        release_program(context);
+        return -1;
+    }
+    if (context->use_tree_walker)
+    {
+        generate_gcode(segment->first);
+    }
+    else
+    {
+        context->program = compile_bytecode(segment->first);
+        run_bytecode(context->program);
+        free_bytecode(context->program);
+        context->program = NULL;
+    }
+    return 1;
+}
+
+// Keep starting the next segment, staying at most a window ahead of the writer, until every one has run
+static void *emission_worker(void *data)
+{
+    SegmentQueue *queue = data;
+    CompilerContext *parent = queue->parent;
+
+    // Each thread runs on a copy of the context with its own variable values, sharing the AST and the variable names.
+    // A budget without limits lets the engines notice within a few thousand steps that the queue has stopped, as a
+    // later segment may run far longer than the serial run would have before it failed, or never end
+    CompilerContext context = *parent;
+    ExecutionLimits unlimited = {0};
+    ExecutionBudget budget;
+    GcodeSink empty = {0};
+    start_budget(&budget, &unlimited, &empty);
+    budget.cancel = &queue->stopped;
+    context.budget = &budget;
+    CompilerStats stats = {0};
+    context.symbol_table.symbols = malloc((parent->symbol_table.count + 1) * sizeof(Symbol));
+    memcpy(context.symbol_table.symbols, parent->symbol_table.symbols, parent->symbol_table.count * sizeof(Symbol));
+    context.symbol_table.buckets = NULL;
+    context.stats = parent->stats ? &stats : NULL;
+    context.program = NULL;
+    context.registers = NULL;
+    compiler = &context;
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;)
+    {
+        while (!queue->stopped && queue->next < queue->count && queue->next >= queue->written + queue->window)
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        if (queue->stopped || queue->next == queue->count)
+            break;
+        uint32_t index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        int status = emit_segment(&queue->segments[index]);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->segments[index].status = status;
+        if (status > 0 && index == queue->count - 1)
+            for (uint32_t slot = 0; slot < context.symbol_table.count; slot++)
+                queue->final_values[slot] = get_symbol(slot)->value;
+        pthread_cond_broadcast(&queue->changed);
+    }
+
+    // Counters are added to the parent's once the thread is done, as several threads update them
+    if (parent->stats)
+    {
+        parent->stats->gcode_lines += stats.gcode_lines;
+        parent->stats->loop_iterations += stats.loop_iterations;
+        parent->stats->closed_form_iterations += stats.closed_form_iterations;
+        parent->stats->symbol_lookups += stats.symbol_lookups;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    free(context.symbol_table.symbols);
+    return NULL;
+}
+
+// Emit a whole program on compiler->jobs threads when it splits into segments that start from known values, writing
+// their Gcode in program order so the output is byte-identical to a serial run. Returns 0 without running anything when
+// the program does not split, or when an option needs the lines in order as they are generated
+int run_parallel(ASTNode *root)
+{
+    CompilerContext *context = compiler;
+    if (context->jobs < 2 || !root || context->peephole || context->binary_output || context->budget || context->ast_arena.mapping)
+        return 0;
+
+    uint32_t count;
+    Segment *segments = cut_segments(root, &count, context->jobs);
+    if (count < 2)
+    {
+        free(segments[0].values);
+        free(segments);
+        return 0;
+    }
+
+    uint32_t jobs = context->jobs < count ? context->jobs : count;
+    fprintf(context->diagnostics, "\n* Emitting %u segments on %u threads\n", count, jobs);
+
+    // Each engine walks sibling links until the end of the list, so every segment but the last is cut off from the next
+    for (uint32_t i = 0; i + 1 < count; i++)
+    {
+        segments[i].next = segments[i].last->right;
+        segments[i].last->right = AST_NULL;
+    }
+
+    SegmentQueue queue = {context, segments, count, 0, 0, jobs * PARALLEL_WINDOW_PER_THREAD};
+    queue.final_values = malloc((context->symbol_table.count + 1) * sizeof(int));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+    pthread_t *threads = malloc(jobs * sizeof(*threads));
+    for (uint32_t t = 0; t < jobs; t++)
+        pthread_create(&threads[t], NULL, emission_worker, &queue);
+
+    // Write each segment as soon as it and every one before it are done. A failed segment holds the Gcode generated
+    // before its error, which a serial run would have written too, and nothing after it is written
+    int failed = 0;
+    for (uint32_t i = 0; i < count && !failed; i++)
+    {
+        pthread_mutex_lock(&queue.lock);
+        while (segments[i].status == 0)
+            pthread_cond_wait(&queue.changed, &queue.lock);
+        pthread_mutex_unlock(&queue.lock);
+
+        failed = segments[i].status < 0;
+        if (segments[i].output.length)
+            sink_write(context->gcode_output, segments[i].output.buffer, segments[i].output.length);
+        sink_close(&segments[i].output);
+
+        pthread_mutex_lock(&queue.lock);
+        queue.written++;
+        queue.stopped = failed;
+        pthread_cond_broadcast(&queue.changed);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    for (uint32_t t = 0; t < jobs; t++)
+        pthread_join(threads[t], NULL);
+
+    // Put the program back together, and leave the variables as a serial run would
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (i + 1 < count)
+            segments[i].last->right = segments[i].next;
+        sink_close(&segments[i].output);
+        free(segments[i].values);
+    }
+    if (!failed)
+        for (uint32_t slot = 0; slot < context->symbol_table.count; slot++)
+            get_symbol(slot)->value = queue.final_values[slot];
+    free(queue.final_values);
+    free(segments);
+    free(threads);
+    pthread_cond_destroy(&queue.changed);
+    pthread_mutex_destroy(&queue.lock);
+
+    if (failed)
+        fail_compilation();
+    return 1;
+}
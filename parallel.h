@@ -0,0 +1,26 @@
+// parallel.h
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdint.h>
+#include "ast.h"
+#include "sink.h"
+
+#define PARALLEL_SEGMENTS_PER_THREAD 8 // Segments cut per emission thread, so threads that finish early find more work
+#define PARALLEL_WINDOW_PER_THREAD 4   // Finished segments that may wait per thread before the next one is started
+#define PARALLEL_LOOP_GUESS 64         // Iterations assumed for a loop whose trip count is unknown when weighing segments
+
+// A run of top-level statements whose starting variable values are all known before the program runs
+typedef struct
+{
+    ASTNode *first;
+    ASTNode *last;        // Its sibling link is cut while the segments run, so each engine stops at the segment's end
+    uint32_t next;        // The link that was cut
+    int *values;          // Variable values the segment starts from, by slot
+    GcodeSink output;     // Gcode of the segment, held until every earlier segment has been written
+    int status;           // 0 while pending, 1 once emitted, -1 if the run failed partway
+} Segment;
+
+int run_parallel(ASTNode *root);
+
+#endif
@@ -1,27 +1,37 @@
 #include <stdio.h>
-#include <string.h>
 #include "utility.h"
 #include "parser.h"
 
+// Create a node holding the lexeme of the token with the given index, read in place from the source
+static uint32_t create_token_node(ASTNodeType type, int index)
+{
+    size_t length;
+    const char *text = token_text(get_token(index), &length);
+    return create_span_node(type, text, length);
+}
+
 // Parse a condition from tokens
-ASTNode *parse_condition(int *i)
+uint32_t parse_condition(int *i)
 {
     // Check if the tokens form a valid condition
-    if (tokens[*i].type == IDENTIFIER &&
-        is_comparison_operator(tokens[*i + 1].type) &&
-        is_valid_operand(tokens[*i + 2].type))
+    if (get_token(*i)->type == IDENTIFIER &&
+        is_comparison_operator(get_token(*i + 1)->type) &&
+        is_valid_operand(get_token(*i + 2)->type))
     {
         // Create the condition node
-        ASTNode *node = create_ast_node(AST_CONDITION, "CONDITION");
+        uint32_t node = create_ast_node(AST_CONDITION, "CONDITION");
 
         // Create the identifier node
-        node->left = create_ast_node(AST_IDENTIFIER, tokens[*i].value);
+        uint32_t identifier = create_token_node(AST_IDENTIFIER, *i);
+        ast_node(node)->left = identifier;
 
         // Create the operator node
-        node->left->right = create_ast_node(AST_OPERATOR, tokens[*i + 1].value);
+        uint32_t operator_node = create_token_node(AST_OPERATOR, *i + 1);
+        ast_node(identifier)->right = operator_node;
 
-        // Determine the right operand's type and create the node
-        node->left->right->right = create_ast_node(map_token_to_ast_type(tokens[*i + 2].type), tokens[*i + 2].value);
+        // Determine the right operand's type and create the node, before resolving a pointer the arena may move
+        uint32_t operand = create_token_node(map_token_to_ast_type(get_token(*i + 2)->type), *i + 2);
+        ast_node(operator_node)->right = operand;
 
         // Advance the token index past the condition
         *i += 3;
@@ -29,248 +39,290 @@ ASTNode *parse_condition(int *i)
     }
 
     // Report a syntax error if the condition is invalid
-    fprintf(stderr, "Syntax error: Invalid condition.\n");
-    return NULL;
+    syntax_error(*i, "Invalid condition.");
+    return AST_NULL;
 }
 
 // Parse an IF statement or WHILE loop
-ASTNode *parse_control_statement(int *i)
+uint32_t parse_control_statement(int *i)
 {
     // Determine expected AST node type and token type
     ASTNodeType node_type;
     const char *node_name;
-    int if_statement_detected = tokens[*i].type == IF;
+    int if_statement_detected = get_token(*i)->type == IF;
     if (if_statement_detected)
     {
         node_type = AST_IF_STATEMENT;
         node_name = "IF_STATEMENT";
     }
-    else if (tokens[*i].type == WHILE)
+    else if (get_token(*i)->type == WHILE)
     {
         node_type = AST_WHILE;
         node_name = "WHILE";
     }
     else
     {
-        return NULL;
+        return AST_NULL;
     }
 
     // Check for control keyword followed by an opening parenthesis
-    if (tokens[*i + 1].type == OPEN_PAREN)
+    if (get_token(*i + 1)->type == OPEN_PAREN)
     {
-        ASTNode *control_node = create_ast_node(node_type, node_name);
+        uint32_t control_node = create_ast_node(node_type, node_name);
         *i += 2; // Advance token index past control keyword and the opening parenthesis
 
         // Parse the condition inside the parentheses
-        ASTNode *condition = parse_condition(i);
+        uint32_t condition = parse_condition(i);
         if (!condition)
-            return NULL;
-        control_node->left = condition;
+            return AST_NULL;
+        ast_node(control_node)->left = condition;
 
         // Expect a closing parenthesis
         if (!expect_token(i, CLOSE_PAREN, "Missing ')' after condition."))
-            return NULL;
+            return AST_NULL;
 
-        // Parse the statement block
-        ASTNode *block_node = parse_statement_block(i);
+        // Parse the statement block, which control can enter from elsewhere
+        start_basic_block();
+        uint32_t block_node = parse_statement_block(i);
         if (!block_node)
         {
-            fprintf(stderr, "Syntax error: Missing statement block after %s.\n", node_name);
-            return NULL;
+            syntax_error(*i, "Missing statement block after %s.", node_name);
+            return AST_NULL;
         }
-        condition->right = block_node;
+        ast_node(condition)->right = block_node;
 
         // If it's an IF statement, check for an optional ELSE
-        if (if_statement_detected && tokens[*i].type == ELSE)
+        if (if_statement_detected && get_token(*i)->type == ELSE)
         {
             (*i)++; // Advance token index past ELSE
-            ASTNode *else_node = create_ast_node(AST_ELSE_STATEMENT, "ELSE_STATEMENT");
+            uint32_t else_node = create_ast_node(AST_ELSE_STATEMENT, "ELSE_STATEMENT");
 
             // Link ELSE_STATEMENT directly to IF_STATEMENT
-            control_node->right = else_node;
+            ast_node(control_node)->right = else_node;
 
             // Parse the ELSE statement block
-            ASTNode *else_block = parse_statement_block(i);
+            start_basic_block();
+            uint32_t else_block = parse_statement_block(i);
             if (!else_block)
             {
-                fprintf(stderr, "Syntax error: Missing statement block after ELSE.\n");
-                return NULL;
+                syntax_error(*i, "Missing statement block after ELSE.");
+                return AST_NULL;
             }
-            else_node->left = else_block; // Attach the ELSE block to ELSE_STATEMENT
+            ast_node(else_node)->left = else_block; // Attach the ELSE block to ELSE_STATEMENT
         }
 
+        // Statements after the control statement can be reached along more than one path
+        start_basic_block();
         return control_node;
     }
 
     // Control statement not found
-    fprintf(stderr, "Syntax error: Control statement not found.\n");
-    return NULL;
+    syntax_error(*i, "Control statement not found.");
+    return AST_NULL;
 }
 
 // Parse PRINT, CREATE, and SET commands
-ASTNode *parse_command(int *i)
+uint32_t parse_command(int *i)
 {
     // Handle PRINT command
-    if (tokens[*i].type == PRINT)
+    if (get_token(*i)->type == PRINT)
     {
         (*i)++; // Advance token index past PRINT
         if (!expect_token(i, IDENTIFIER, "Expected identifier after 'PRINT'."))
-            return NULL;
+            return AST_NULL;
 
         // Create PRINT node and attach IDENTIFIER node
-        ASTNode *print_node = create_ast_node(AST_PRINT, "PRINT");
-        print_node->left = create_ast_node(AST_IDENTIFIER, tokens[*i - 1].value);
+        uint32_t print_node = create_ast_node(AST_PRINT, "PRINT");
+        uint32_t identifier = create_token_node(AST_IDENTIFIER, *i - 1);
+        ast_node(print_node)->left = identifier;
         return print_node;
     }
 
     // Handle CREATE and SET commands
-    if (tokens[*i].type == COMMAND)
+    if (get_token(*i)->type == COMMAND)
     {
-        const char *command_name = tokens[*i].value;
-        (*i)++; // Advance token index past COMMAND
+        int command = (*i)++; // Advance token index past COMMAND
 
-        ASTNode *first_node;
+        uint32_t first_node;
 
         // Handle CREATE command with IDENTIFIER and PARAMETER
-        if (strcmp(command_name, "CREATE") == 0)
+        if (token_equals(get_token(command), "CREATE"))
         {
             // Expect IDENTIFIER after CREATE
-            if (tokens[*i].type != IDENTIFIER)
+            if (get_token(*i)->type != IDENTIFIER)
             {
-                fprintf(stderr, "Syntax error: Expected identifier after 'CREATE'.\n");
-                return NULL;
+                syntax_error(*i, "Expected identifier after 'CREATE'.");
+                return AST_NULL;
             }
-            first_node = create_ast_node(AST_IDENTIFIER, tokens[*i].value);
+            first_node = create_token_node(AST_IDENTIFIER, *i);
+            mark_assignment(ast_node(first_node)->value);
             (*i)++; // Advance token index past IDENTIFIER
 
             // Expect PARAMETER after IDENTIFIER
-            if (tokens[*i].type != PARAMETER)
+            if (get_token(*i)->type != PARAMETER)
             {
-                fprintf(stderr, "Syntax error: Expected parameter after identifier in 'CREATE'.\n");
-                return NULL;
+                syntax_error(*i, "Expected parameter after identifier in 'CREATE'.");
+                return AST_NULL;
             }
         }
         // Handle SET command with SETTING and PARAMETER
-        else if (strcmp(command_name, "SET") == 0)
+        else if (token_equals(get_token(command), "SET"))
         {
             // Expect SETTING after SET
-            if (tokens[*i].type != SETTING)
+            if (get_token(*i)->type != SETTING)
             {
-                fprintf(stderr, "Syntax error: Expected setting after 'SET'.\n");
-                return NULL;
+                syntax_error(*i, "Expected setting after 'SET'.");
+                return AST_NULL;
             }
-            first_node = create_ast_node(AST_SETTING, tokens[*i].value);
+            first_node = create_token_node(AST_SETTING, *i);
             (*i)++; // Advance token index past SETTING
         }
         else
         {
             // Unrecognized command
-            return NULL;
+            return AST_NULL;
         }
 
         // Create the main command node and link children
-        ASTNode *command_node = create_ast_node(AST_COMMAND, command_name);
-        command_node->left = first_node;
-        first_node->right = create_ast_node(AST_PARAMETER, tokens[*i].value);
-        ;
+        uint32_t command_node = create_token_node(AST_COMMAND, command);
+        uint32_t parameter_node = create_token_node(AST_PARAMETER, *i);
+        ast_node(command_node)->left = first_node;
+        ast_node(first_node)->right = parameter_node;
         (*i)++; // Advance token index past PARAMETER
         return command_node;
     }
 
     // Not a recognized command type
-    fprintf(stderr, "Syntax error: Command not found.\n");
-    return NULL;
+    syntax_error(*i, "Command not found.");
+    return AST_NULL;
 }
 
-// Parses a primary expression
-ASTNode *parse_primary(int *i)
+static uint32_t parse_operators(int *i, uint32_t left, int min_precedence, int *budget);
+
+// Parses a primary expression: an identifier, integer, or parameter, or a whole expression in parentheses.
+// Opening parentheses count against the expression's budget, like its operators
+uint32_t parse_primary(int *i, int *budget)
 {
-    ASTNodeType ast_type = map_token_to_ast_type(tokens[*i].type);
+    if (get_token(*i)->type == OPEN_PAREN)
+    {
+        if (--*budget < 0)
+        {
+            syntax_error(*i, "Expression is too long or nested too deeply.");
+            return AST_NULL;
+        }
+        (*i)++; // Advance token index past the opening parenthesis
+        uint32_t node = parse_primary(i, budget);
+        if (node)
+            node = parse_operators(i, node, 1, budget);
+        if (!node || !expect_token(i, CLOSE_PAREN, "Missing ')' after expression."))
+            return AST_NULL;
+        return node;
+    }
+
+    ASTNodeType ast_type = map_token_to_ast_type(get_token(*i)->type);
     if (ast_type != AST_UNKNOWN)
     {
         // Create AST node for the primary expression
-        ASTNode *node = create_ast_node(ast_type, tokens[*i].value);
+        uint32_t node = create_token_node(ast_type, *i);
         (*i)++;
         return node;
     }
-    fprintf(stderr, "Syntax error: Primary expression not found.\n");
-    return NULL;
+    syntax_error(*i, "Primary expression not found.");
+    return AST_NULL;
 }
 
-// Parses an expression with optional operator and right operand
-ASTNode *parse_expression(int *i)
+// How tightly the arithmetic operator at a token binds its operands, or 0 if the token is not an operator
+static int operator_precedence(int index, char *operator)
 {
-    // Parse left operand
-    ASTNode *left = parse_primary(i);
-    if (!left)
-        return NULL;
+    if (get_token(index)->type != OPERATOR)
+        return 0;
+    size_t length;
+    *operator = token_text(get_token(index), &length)[0];
+    return *operator == '*' || *operator == '/' ? 2 : 1;
+}
 
-    // Check if the next token is an operator
-    if (tokens[*i].type == OPERATOR)
+// Apply the operators binding at least as tightly as min_precedence to the left operand by precedence climbing.
+// Operators of equal precedence group from the left, so 10 - 4 - 3 is (10 - 4) - 3
+static uint32_t parse_operators(int *i, uint32_t left, int min_precedence, int *budget)
+{
+    char operator, next;
+    int precedence;
+    while ((precedence = operator_precedence(*i, &operator)) >= min_precedence)
     {
-        // Create operator node
-        ASTNode *op = create_ast_node(AST_OPERATOR, tokens[*i].value);
+        if (--*budget < 0)
+        {
+            syntax_error(*i, "Expression is too long or nested too deeply.");
+            return AST_NULL;
+        }
         (*i)++; // Advance token index past OPERATOR
 
-        // Parse right operand
-        ASTNode *right = parse_primary(i);
+        // Parse right operand, together with any operators that bind more tightly than this one
+        uint32_t right = parse_primary(i, budget);
         if (!right)
         {
-            fprintf(stderr, "Syntax error: Expected identifier, integer, or parameter after operator.\n");
-            return NULL;
+            syntax_error(*i, "Expected identifier, integer, parameter, or '(' after operator.");
+            return AST_NULL;
         }
+        while (right && operator_precedence(*i, &next) > precedence)
+            right = parse_operators(i, right, precedence + 1, budget);
+        if (!right)
+            return AST_NULL;
 
-        // Create expression node and link children
-        ASTNode *expr = create_ast_node(AST_EXPRESSION, "EXPRESSION");
-        expr->left = left;
-        left->right = op;
-        op->right = right;
-
-        return expr;
+        // Create expression node, sharing the operands of an equal expression already in the basic block
+        left = create_expression_node(left, operator, right);
     }
-
-    // Return left operand if no operator follows
     return left;
 }
 
+// Parses an expression of operands joined by + - * and /, with * and / binding more tightly
+uint32_t parse_expression(int *i)
+{
+    int budget = PARSER_MAX_OPERATORS;
+    uint32_t left = parse_primary(i, &budget);
+    if (!left)
+        return AST_NULL;
+    return parse_operators(i, left, 1, &budget);
+}
+
 // Parse an assignment
-ASTNode *parse_assignment(int *i)
+uint32_t parse_assignment(int *i)
 {
     // Check for IDENTIFIER followed by ASSIGN token
-    if (tokens[*i].type == IDENTIFIER && tokens[*i + 1].type == ASSIGN)
+    if (get_token(*i)->type == IDENTIFIER && get_token(*i + 1)->type == ASSIGN)
     {
         // Create AST node for the identifier
-        ASTNode *id_node = create_ast_node(AST_IDENTIFIER, tokens[*i].value);
+        uint32_t id_node = create_token_node(AST_IDENTIFIER, *i);
         (*i)++; // Advance token index past IDENTIFIER
 
         // Create AST node for the assignment operator
-        ASTNode *assign_op_node = create_ast_node(AST_ASSIGN, "=");
+        uint32_t assign_op_node = create_ast_node(AST_ASSIGN, "=");
         (*i)++; // Advance token index past ASSIGN
 
         // Parse the expression
-        ASTNode *expr_node = parse_expression(i);
+        uint32_t expr_node = parse_expression(i);
         if (!expr_node)
         {
-            fprintf(stderr, "Syntax error: Invalid expression in assignment.\n");
-            return NULL;
+            syntax_error(*i, "Invalid expression in assignment.");
+            return AST_NULL;
         }
+        mark_assignment(ast_node(id_node)->value);
 
         // Create the assignment node and link the children
-        ASTNode *assign_node = create_ast_node(AST_ASSIGNMENT, "ASSIGNMENT");
-        assign_node->left = id_node;
-        id_node->right = assign_op_node;
-        assign_op_node->right = expr_node;
+        uint32_t assign_node = create_ast_node(AST_ASSIGNMENT, "ASSIGNMENT");
+        ast_node(assign_node)->left = id_node;
+        ast_node(id_node)->right = assign_op_node;
+        ast_node(assign_op_node)->right = expr_node;
 
         return assign_node;
     }
-    fprintf(stderr, "Syntax error: Assignment statement not found.\n");
-    return NULL; // Return NULL if not a valid assignment statement
+    syntax_error(*i, "Assignment statement not found.");
+    return AST_NULL; // Return AST_NULL if not a valid assignment statement
 }
 
 // Parse a statement starting at the current token index
-ASTNode *parse_statement(int *i)
+uint32_t parse_statement(int *i)
 {
-    switch (tokens[*i].type)
+    switch (get_token(*i)->type)
     {
     case IF:
     case WHILE:
@@ -282,56 +334,59 @@ ASTNode *parse_statement(int *i)
         return parse_command(i);
     case IDENTIFIER:
         // Check for assignment following IDENTIFIER
-        return tokens[*i + 1].type == ASSIGN ? parse_assignment(i) : NULL;
+        return get_token(*i + 1)->type == ASSIGN ? parse_assignment(i) : AST_NULL;
     default:
         // Unrecognized statement type
-        fprintf(stderr, "Syntax error: Statement not found.\n");
-        return NULL;
+        syntax_error(*i, "Statement not found.");
+        return AST_NULL;
     }
 }
 
 // Parse a block of statements enclosed in curly braces or a single statement
-ASTNode *parse_statement_block(int *i)
+uint32_t parse_statement_block(int *i)
 {
     // Check if the current token is an opening curly brace
-    if (tokens[*i].type == OPEN_BRACE)
+    if (get_token(*i)->type == OPEN_BRACE)
     {
         (*i)++; // Advance token index past opening curly brace
         // Create a node representing the statement block
-        ASTNode *block_node = create_ast_node(AST_STATEMENT_BLOCK, "STATEMENT_BLOCK");
-        ASTNode *current = NULL; // Pointer to link statements
+        uint32_t block_node = create_ast_node(AST_STATEMENT_BLOCK, "STATEMENT_BLOCK");
+        uint32_t current = AST_NULL; // Index used to link statements
         // Loop until a closing curly brace is encountered
-        while (*i < token_count && tokens[*i].type != CLOSE_BRACE)
+        while (get_token(*i)->type != CLOSE_BRACE && get_token(*i)->type != END_OF_INPUT)
         {
             // Skip any newline tokens
-            while (*i < token_count && tokens[*i].type == NEW_LINE)
+            while (get_token(*i)->type == NEW_LINE)
                 (*i)++;
 
             // Parse a single statement
-            ASTNode *statement = parse_statement(i);
+            uint32_t statement = parse_statement(i);
             if (!statement)
             {
-                fprintf(stderr, "Syntax error: Invalid statement in block.\n");
-                return NULL;
+                syntax_error(*i, "Invalid statement in block.");
+                return AST_NULL;
             }
 
             // Link the parsed statement to the block node
             if (!current)
-                block_node->left = statement; // First statement in the block
+                ast_node(block_node)->left = statement; // First statement in the block
             else
-                current->right = statement; // Subsequent statements
+                ast_node(current)->right = statement; // Subsequent statements
 
-            current = statement; // Update current to the latest statement
+            // Update current to the latest statement, stepping over an attached ELSE_STATEMENT
+            current = statement;
+            while (ast_node(current)->right)
+                current = ast_node(current)->right;
 
             // Skip any trailing newline tokens
-            while (*i < token_count && tokens[*i].type == NEW_LINE)
+            while (get_token(*i)->type == NEW_LINE)
                 (*i)++;
         }
         // Verify that the block ends with a closing curly brace
-        if (*i >= token_count || tokens[*i].type != CLOSE_BRACE)
+        if (get_token(*i)->type != CLOSE_BRACE)
         {
-            fprintf(stderr, "Syntax error: Missing '}' to close statement block.\n");
-            return NULL;
+            syntax_error(*i, "Missing '}' to close statement block.");
+            return AST_NULL;
         }
         (*i)++;            // Advance token index past closing curly brace
         return block_node; // Return the parsed statement block
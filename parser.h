@@ -4,7 +4,9 @@
 
 #include "ast.h"
 
-ASTNode *parse_statement(int *i);
-ASTNode *parse_statement_block(int *i);
+#define PARSER_MAX_OPERATORS 4096 // Operators and parentheses one expression may hold, which bounds how deep evaluating it recurses
+
+uint32_t parse_statement(int *i);
+uint32_t parse_statement_block(int *i);
 
 #endif
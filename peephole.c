@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include "peephole.h"
+
+void init_peephole(Peephole *peephole, int strip_comments)
+{
+    memset(peephole, 0, sizeof(*peephole));
+    peephole->strip_comments = strip_comments;
+}
+
+// Write a kept line, counting it by its text length so the report reads the same for binary output
+static void write_line(Peephole *peephole, GcodeSink *sink, const GcodeLine *line)
+{
+    size_t length = gcode_line_length(line, !peephole->strip_comments);
+    output_gcode_line(sink, line, !peephole->strip_comments);
+    if (length)
+        peephole->lines_out++;
+    peephole->bytes_out += length;
+}
+
+// Write every line still held, in the order it was generated. Names and parameters may not outlive the engine run
+// that generated them, so this runs at the end of every run as well as before each new message
+void flush_peephole(Peephole *peephole, GcodeSink *sink)
+{
+    for (int i = 0; i < peephole->count; i++)
+        if (peephole->window[i].kind != GCODE_DROPPED)
+            write_line(peephole, sink, &peephole->window[i]);
+    peephole->count = 0;
+}
+
+// Drop the line held for the same variable and of the same kind, which the new one supersedes
+static void supersede(Peephole *peephole, const GcodeLine *line)
+{
+    for (int i = peephole->count; i-- > 0;)
+    {
+        GcodeLine *held = &peephole->window[i];
+        if (held->kind == line->kind && held->name == line->name)
+        {
+            held->kind = GCODE_DROPPED;
+            return;
+        }
+    }
+}
+
+// Make room in a full window by closing the gaps dropped lines left, or by writing out its older half
+static void make_room(Peephole *peephole, GcodeSink *sink)
+{
+    int kept = 0;
+    for (int i = 0; i < peephole->count; i++)
+        if (peephole->window[i].kind != GCODE_DROPPED)
+            peephole->window[kept++] = peephole->window[i];
+    peephole->count = kept;
+    if (kept < PEEPHOLE_WINDOW)
+        return;
+
+    for (int i = 0; i < PEEPHOLE_WINDOW / 2; i++)
+        write_line(peephole, sink, &peephole->window[i]);
+    memmove(peephole->window, peephole->window + PEEPHOLE_WINDOW / 2, (PEEPHOLE_WINDOW / 2) * sizeof(GcodeLine));
+    peephole->count = PEEPHOLE_WINDOW - PEEPHOLE_WINDOW / 2;
+}
+
+// Take one generated line. Within a window:
+//   - an update comment is dropped once a later one records a new value for the same variable;
+//   - of back-to-back G92 writes to the same axis, only the last is kept, as the firmware only ends up with that one;
+//   - an M117 showing the same message as the last one written is dropped, as the display would not change.
+// With strip_comments, update comments are dropped outright and the other lines lose their comments
+void peephole_line(Peephole *peephole, GcodeSink *sink, const GcodeLine *line)
+{
+    peephole->lines_in++;
+    peephole->bytes_in += gcode_line_length(line, 1);
+
+    switch (line->kind)
+    {
+    case GCODE_PRINT:
+        if (peephole->shown_name == line->name && peephole->shown_value == line->value)
+            return;
+        flush_peephole(peephole, sink);
+        write_line(peephole, sink, line);
+        peephole->shown_name = line->name;
+        peephole->shown_value = line->value;
+        return;
+    case GCODE_UPDATE:
+        if (peephole->strip_comments)
+            return;
+        supersede(peephole, line);
+        break;
+    case GCODE_INITIALIZE:
+        supersede(peephole, line);
+        break;
+    default:
+        return;
+    }
+
+    if (peephole->count == PEEPHOLE_WINDOW)
+        make_room(peephole, sink);
+    peephole->window[peephole->count++] = *line;
+}
+
+// Summarize what the peephole stage removed, like the optimizer's own messages
+void report_peephole(const Peephole *peephole, FILE *output)
+{
+    fprintf(output, "\nPeephole removed %llu of %llu Gcode lines (%llu of %llu bytes)\n",
+            (unsigned long long)(peephole->lines_in - peephole->lines_out), (unsigned long long)peephole->lines_in,
+            (unsigned long long)(peephole->bytes_in - peephole->bytes_out), (unsigned long long)peephole->bytes_in);
+}
@@ -0,0 +1,31 @@
+// peephole.h
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "gcode.h"
+
+#define PEEPHOLE_WINDOW 64 // Generated lines held back at most, waiting to see whether a later one supersedes them
+
+// Lines held back between the code generators and the sink, with what has been removed so far.
+// An M117 that shows a new message ends the window: everything held is written before it
+typedef struct Peephole
+{
+    GcodeLine window[PEEPHOLE_WINDOW];
+    int count;
+    int strip_comments; // Set by --strip-comments to write no comments at all
+    const char *shown_name; // Message the last M117 written shows, which repeating it leaves unchanged
+    int shown_value;
+    uint64_t lines_in;
+    uint64_t bytes_in;      // Bytes the lines would have taken without the peephole stage
+    uint64_t lines_out;
+    uint64_t bytes_out;
+} Peephole;
+
+void flush_peephole(Peephole *peephole, GcodeSink *sink);
+void init_peephole(Peephole *peephole, int strip_comments);
+void peephole_line(Peephole *peephole, GcodeSink *sink, const GcodeLine *line);
+void report_peephole(const Peephole *peephole, FILE *output);
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+#include "gcode.h"
+#include "utility.h"
+
+// Start with every variable known to be 0, as it is before it is created or assigned
+void init_state(ConstantState *state, uint32_t count)
+{
+    state->values = calloc(count + 1, sizeof(int));
+    state->known = malloc(count + 1);
+    state->count = count;
+    memset(state->known, 1, count + 1);
+}
+
+ConstantState copy_state(const ConstantState *state)
+{
+    ConstantState copy = {malloc(state->count * sizeof(int)), malloc(state->count), state->count};
+    memcpy(copy.values, state->values, state->count * sizeof(int));
+    memcpy(copy.known, state->known, state->count);
+    return copy;
+}
+
+void free_state(ConstantState *state)
+{
+    free(state->values);
+    free(state->known);
+}
+
+// Check whether two states know the same values, so whatever was derived from one holds for the other
+int same_state(const ConstantState *a, const ConstantState *b)
+{
+    if (a->count != b->count)
+        return 0;
+    for (uint32_t slot = 0; slot < a->count; slot++)
+    {
+        if (a->known[slot] != b->known[slot] || (a->known[slot] && a->values[slot] != b->values[slot]))
+            return 0;
+    }
+    return 1;
+}
+
+// Keep only the values that two paths joining at the same point agree on
+void meet_states(ConstantState *into, const ConstantState *other)
+{
+    for (uint32_t slot = 0; slot < into->count; slot++)
+    {
+        if (into->known[slot] && (!other->known[slot] || other->values[slot] != into->values[slot]))
+            into->known[slot] = 0;
+    }
+}
+
+// Replace an identifier or parameter operand with the literal it is known to hold
+static void substitute_operand(ASTNode *operand, const ConstantState *state)
+{
+    int value;
+    if (operand->type == AST_IDENTIFIER && state->known[operand->value])
+        value = state->values[operand->value];
+    else if (operand->type == AST_PARAMETER && lookup_initial_value(ast_text(operand), &value))
+        ;
+    else
+        return;
+
+    fprintf(compiler->diagnostics, "\n* Propagated %s = %d\n", ast_text(operand), value);
+    operand->type = AST_INTEGER;
+    operand->value = value;
+}
+
+// Rewrite the operands of one expression, then fold or simplify it
+static void propagate_expression(ASTNode *node, int depth, void *data)
+{
+    const ConstantState *state = data;
+    if (node->type != AST_EXPRESSION || !node->left || !ast_left(node)->right)
+        return;
+
+    ASTNode *left = ast_left(node);
+    ASTNode *operator_node = ast_right(left);
+    ASTNode *right = ast_right(operator_node);
+    substitute_operand(left, state);
+    substitute_operand(right, state);
+    simplify_expression(node);
+}
+
+// Rewrite an operand in place, whether it is a single value or a whole expression
+static void propagate_operand(ASTNode *operand, ConstantState *state)
+{
+    if (operand->type == AST_EXPRESSION)
+    {
+        ASTVisitor visitor = {NULL, propagate_expression, state};
+        walk_ast(operand, &visitor);
+    }
+    else
+    {
+        substitute_operand(operand, state);
+    }
+}
+
+// Forget every variable that a loop body assigns, including inside nested blocks
+int forget_assigned(ASTNode *node, int depth, void *data)
+{
+    ConstantState *state = data;
+    if ((node->type == AST_ASSIGNMENT || node->type == AST_COMMAND) && node->left)
+        state->known[ast_left(node)->value] = 0;
+    return 1;
+}
+
+// Propagate known values into one statement and record what it assigns
+static int propagate_statement(ASTNode *node, int depth, void *data)
+{
+    ConstantState *state = data;
+
+    switch (node->type)
+    {
+    case AST_COMMAND:
+    {
+        // CREATE and SET start their variable at the parameter's value
+        ASTNode *target = ast_left(node);
+        if (!target || !target->right)
+            break;
+        state->known[target->value] = lookup_initial_value(ast_text(ast_right(target)), &state->values[target->value]);
+        break;
+    }
+    case AST_ASSIGNMENT:
+    {
+        ASTNode *target = ast_left(node);
+        if (!target || !target->right || !ast_right(target)->right)
+            break;
+        ASTNode *operand = ast_right(ast_right(target));
+        propagate_operand(operand, state);
+        state->known[target->value] = operand->type == AST_INTEGER;
+        state->values[target->value] = operand->value;
+        break;
+    }
+    case AST_IF_STATEMENT:
+    {
+        if (!node->left)
+            break;
+        ASTNode *condition = ast_left(node);
+        substitute_operand(ast_right(ast_right(ast_left(condition))), state);
+
+        // Each branch starts from the state before the IF, and only values both paths agree on survive it
+        ConstantState taken = copy_state(state);
+        propagate_statements(control_body(ast_right(condition)), &taken);
+        if (node->right && ast_right(node)->type == AST_ELSE_STATEMENT)
+            propagate_statements(control_body(ast_left(ast_right(node))), state);
+        meet_states(state, &taken);
+        free_state(&taken);
+        break;
+    }
+    case AST_WHILE:
+    case AST_COUNTED_LOOP:
+    {
+        if (!node->left)
+            break;
+        ASTNode *condition = ast_left(node);
+        ASTNode *body = control_body(ast_right(condition));
+
+        // The comparison value is read once before the first iteration, so the entry state applies to it
+        ASTNode *bound = ast_right(ast_right(ast_left(condition)));
+        substitute_operand(bound, state);
+
+        // A counted loop that starts from a known value ends at a known value too
+        uint32_t slot = ast_left(condition)->value;
+        int step;
+        int64_t trips;
+        if (match_counted_loop(node, &step) && state->known[slot] && bound->type == AST_INTEGER &&
+            count_loop_trips(ast_text(ast_right(ast_left(condition))), state->values[slot], bound->value, step, &trips))
+        {
+            state->values[slot] += (int)(trips * step);
+            fprintf(compiler->diagnostics, "\n* Loop on %s runs %lld times and leaves it at %d\n", ast_text(ast_left(condition)), (long long)trips, state->values[slot]);
+            break;
+        }
+
+        // Anything the body assigns may differ on every iteration, so it is unknown at the top of the loop and after it
+        ASTVisitor forget = {forget_assigned, NULL, state};
+        walk_ast(body, &forget);
+        ConstantState iteration = copy_state(state);
+        propagate_statements(body, &iteration);
+        free_state(&iteration);
+        break;
+    }
+    default:
+        break;
+    }
+    return 0;
+}
+
+// Propagate a state through a statement sequence, leaving the state that holds after its last statement
+void propagate_statements(ASTNode *statement, ConstantState *state)
+{
+    ASTVisitor visitor = {propagate_statement, NULL, state};
+    walk_ast(statement, &visitor);
+}
+
+// Track the values variables are known to hold through the statement sequence and rewrite their uses into literals
+void propagate_constants(ASTNode *root)
+{
+    ConstantState state;
+    init_state(&state, compiler->symbol_table.count);
+    propagate_statements(root, &state);
+    free_state(&state);
+}
@@ -1,4 +1,4 @@
 #!/bin/bash
 flex "scanner.l"
-gcc lex.yy.c ast.c main.c parser.c utility.c gcode.c -o main -lfl
-./main $1
\ No newline at end of file
+gcc lex.yy.c ast.c astfile.c batch.c binary.c budget.c bytecode.c cache.c cfg.c compiler.c lexer.c loops.c main.c parallel.c parser.c peephole.c propagate.c server.c simplify.c sink.c source.c stats.c symbols.c utility.c gcode.c -o main -pthread
+./main "$@"
\ No newline at end of file
@@ -1,7 +1,11 @@
 // scanner.h
 #ifndef SCANNER_H
 #define SCANNER_H
-#define MAX_TOKENS 1000
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TOKEN_WINDOW 64 // Number of recently scanned tokens kept for parser lookahead
 
 typedef enum
 {
@@ -10,6 +14,7 @@ typedef enum
     CLOSE_PAREN,
     COMMAND,
     ELSE,
+    END_OF_INPUT,
     EQUAL,
     GREATER_EQUAL,
     GREATER_THAN,
@@ -31,13 +36,22 @@ typedef enum
     WHILE,
 } State;
 
+// A scanned token, whose lexeme is read in place from the source the compilation keeps
 typedef struct
 {
-    State type;
-    char value[100];
+    uint32_t offset; // Where the lexeme starts in the source
+    uint16_t length; // Bytes in the lexeme, cut at UINT16_MAX for an absurdly long invalid word or number
+    uint8_t type;    // The State the token stands for
 } Token;
 
-extern Token tokens[MAX_TOKENS];
-extern int token_count;
+int add_token(State type, size_t length);
+void close_scanner();
+Token *get_token(int index);
+void open_scanner(FILE *input);
+int open_scanner_buffer(char *data, size_t size);
+void open_scanner_bytes(const char *data, size_t length);
+int token_equals(const Token *token, const char *text);
+void token_location(const Token *token, int *line, int *column);
+const char *token_text(const Token *token, size_t *length);
 
 #endif
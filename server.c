@@ -0,0 +1,432 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+#include "bytecode.h"
+#include "gcode.h"
+#include "server.h"
+
+// Where one chunk of a request's source starts and how long it is
+typedef struct
+{
+    const char *start;
+    size_t length;
+} ChunkSpan;
+
+// Split a source into chunks at every newline outside braces, the only places a top-level statement can end.
+// Blank stretches between them are dropped, so adding or removing empty lines changes no chunk
+static ChunkSpan *split_chunks(const char *source, size_t length, uint32_t *count)
+{
+    ChunkSpan *spans = NULL;
+    uint32_t capacity = 0;
+    int depth = 0;
+    int blank = 1;
+    size_t start = 0;
+
+    *count = 0;
+    for (size_t i = 0; i <= length; i++)
+    {
+        char c = i < length ? source[i] : '\n';
+        if (c == '{')
+            depth++;
+        else if (c == '}' && depth > 0)
+            depth--;
+
+        if (c == '\n' && (depth == 0 || i == length))
+        {
+            if (!blank)
+            {
+                if (*count == capacity)
+                {
+                    capacity = capacity ? capacity * 2 : 256;
+                    spans = realloc(spans, capacity * sizeof(*spans));
+                }
+                spans[(*count)++] = (ChunkSpan){source + start, i - start};
+            }
+            start = i + 1;
+            blank = 1;
+        }
+        else if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+        {
+            blank = 0;
+        }
+    }
+    return spans;
+}
+
+static int same_text(const ServerChunk *chunk, const ChunkSpan *span)
+{
+    return chunk->length == span->length && memcmp(chunk->text, span->start, span->length) == 0;
+}
+
+static void free_chunk(ServerChunk *chunk)
+{
+    free(chunk->text);
+    free_state(&chunk->entry);
+    free_state(&chunk->exit);
+    free_state(&chunk->loop_in);
+    free_state(&chunk->loop_out);
+    free(chunk->live_out);
+    free(chunk->live_in);
+    free(chunk->entry_values);
+    free(chunk->exit_values);
+    sink_close(&chunk->output);
+}
+
+// Drop every chunk and the AST they share, so the next request compiles from scratch
+static void reset_server(CompileServer *server)
+{
+    for (uint32_t i = 0; i < server->chunk_count; i++)
+        free_chunk(&server->chunks[i]);
+    free(server->chunks);
+    server->chunks = NULL;
+    server->chunk_count = server->chunk_capacity = 0;
+    server->symbol_count = 0;
+    free_ast();
+    server->compacted_nodes = 0;
+}
+
+// Copy every tree the chunks still use into a fresh arena, leaving behind the ones replaced by earlier requests
+static void compact_arena(CompileServer *server)
+{
+    ASTArena old = compiler->ast_arena;
+    memset(&compiler->ast_arena, 0, sizeof(compiler->ast_arena));
+    for (uint32_t i = 0; i < server->chunk_count; i++)
+    {
+        ServerChunk *chunk = &server->chunks[i];
+        chunk->folded = copy_ast(&old, chunk->folded);
+        chunk->propagated = chunk->stage >= 1 ? copy_ast(&old, chunk->propagated) : AST_NULL;
+        chunk->optimized = chunk->stage >= 2 ? copy_ast(&old, chunk->optimized) : AST_NULL;
+    }
+    free(old.nodes);
+    free(old.text);
+    free(old.atoms);
+    free(old.shapes);
+    free(old.assigned);
+    server->compacted_nodes = compiler->ast_arena.count;
+}
+
+// Output the Gcode of a chunk's optimized statements with the server's engine
+static void generate_chunk(ASTNode *statements)
+{
+    if (compiler->use_tree_walker)
+    {
+        generate_gcode(statements);
+        return;
+    }
+    compiler->program = compile_bytecode(statements);
+    run_bytecode(compiler->program);
+    free_bytecode(compiler->program);
+    compiler->program = NULL;
+}
+
+// Bring every chunk up to date, redoing each stage only for chunks whose input to it changed, and append the Gcode
+static int update_chunks(CompileServer *server, uint32_t first_new, uint32_t end_new, GcodeSink *output, ServerReport *report)
+{
+    report->chunks = server->chunk_count;
+
+    // Only the chunks whose text changed are scanned, parsed, and folded
+    for (uint32_t i = first_new; i < end_new; i++)
+    {
+        ServerChunk *chunk = &server->chunks[i];
+        open_scanner_bytes(chunk->text, chunk->length);
+        chunk->folded = build_ast();
+        close_scanner();
+        if (!chunk->folded)
+            return EXIT_FAILURE;
+        fold_constants(ast_node(chunk->folded));
+        report->parsed++;
+    }
+    uint32_t symbols = compiler->symbol_table.count;
+
+    // Every stage's results were consistent along the whole program after the last request, so chunks on either side
+    // of the edit only need visiting until one sees the same input as before. A new variable invalidates all of them
+    uint32_t start = symbols == server->symbol_count ? first_new : 0;
+    server->symbol_count = symbols;
+
+    // Constants flow forwards, so a chunk is propagated again only when the constants known before it changed, to
+    // propagation or to the loop optimizer
+    ConstantState state, loops;
+    if (start > 0)
+    {
+        state = copy_state(&server->chunks[start - 1].exit);
+        loops = copy_state(&server->chunks[start - 1].loop_out);
+    }
+    else
+    {
+        init_state(&state, symbols);
+        init_state(&loops, symbols);
+    }
+    uint32_t propagated_end = server->chunk_count;
+    for (uint32_t i = start; i < server->chunk_count; i++)
+    {
+        ServerChunk *chunk = &server->chunks[i];
+        if (chunk->stage >= 1 && same_state(&chunk->entry, &state) && same_state(&chunk->loop_in, &loops))
+        {
+            propagated_end = i;
+            break;
+        }
+
+        free_state(&chunk->entry);
+        free_state(&chunk->exit);
+        free_state(&chunk->loop_in);
+        free_state(&chunk->loop_out);
+        chunk->entry = copy_state(&state);
+        chunk->loop_in = copy_state(&loops);
+        chunk->propagated = copy_ast(&compiler->ast_arena, chunk->folded);
+        chunk->propagated = ast_index(optimize_loops(ast_node(chunk->propagated), &loops));
+        propagate_statements(ast_node(chunk->propagated), &state);
+        mark_counted_loops(ast_node(chunk->propagated));
+        chunk->exit = copy_state(&state);
+        chunk->loop_out = copy_state(&loops);
+        chunk->stage = 1;
+        report->propagated++;
+    }
+    free_state(&state);
+    free_state(&loops);
+
+    // Liveness flows backwards, so a chunk's dead stores are found again only when what is read after it changed
+    uint32_t words = symbols / 64 + 1;
+    uint64_t *live = calloc(words, sizeof(uint64_t));
+    if (propagated_end < server->chunk_count)
+        memcpy(live, server->chunks[propagated_end].live_in, words * sizeof(uint64_t));
+    uint32_t analyzed_start = 0;
+    for (uint32_t i = propagated_end; i-- > 0;)
+    {
+        ServerChunk *chunk = &server->chunks[i];
+        if (chunk->stage >= 2 && chunk->set_words == words && memcmp(chunk->live_out, live, words * sizeof(uint64_t)) == 0)
+        {
+            analyzed_start = i + 1;
+            break;
+        }
+
+        chunk->live_out = realloc(chunk->live_out, words * sizeof(uint64_t));
+        chunk->live_in = realloc(chunk->live_in, words * sizeof(uint64_t));
+        chunk->set_words = words;
+        memcpy(chunk->live_out, live, words * sizeof(uint64_t));
+        ASTNode *copy = ast_node(copy_ast(&compiler->ast_arena, chunk->propagated));
+        chunk->optimized = ast_index(eliminate_dead_stores(copy, chunk->live_out, chunk->live_in));
+        chunk->stage = 2;
+        report->analyzed++;
+        memcpy(live, chunk->live_in, words * sizeof(uint64_t));
+    }
+    free(live);
+
+    // A chunk's Gcode only depends on its statements and the variable values it starts from
+    int *values = calloc(symbols + 1, sizeof(int));
+    size_t values_size = symbols * sizeof(int);
+    if (analyzed_start > 0)
+        memcpy(values, server->chunks[analyzed_start - 1].exit_values, values_size);
+    for (uint32_t i = analyzed_start; i < server->chunk_count; i++)
+    {
+        ServerChunk *chunk = &server->chunks[i];
+        if (chunk->stage >= 3 && chunk->value_count == symbols && memcmp(chunk->entry_values, values, values_size) == 0)
+            break;
+
+        chunk->entry_values = realloc(chunk->entry_values, values_size + sizeof(int));
+        chunk->exit_values = realloc(chunk->exit_values, values_size + sizeof(int));
+        chunk->value_count = symbols;
+        memcpy(chunk->entry_values, values, values_size);
+        for (uint32_t slot = 0; slot < symbols; slot++)
+            get_symbol(slot)->value = values[slot];
+
+        // The byte limit counts what the request writes, across every chunk it generates
+        chunk->output.length = 0;
+        compiler->gcode_output = &chunk->output;
+        if (compiler->budget)
+            compiler->budget->first_byte = chunk->output.written - server->generated_bytes;
+        generate_chunk(ast_node(chunk->optimized));
+        server->generated_bytes += chunk->output.length;
+        compiler->gcode_output = &server->unused_output;
+        if (chunk->output.failed)
+        {
+            free(values);
+            return EXIT_FAILURE;
+        }
+
+        for (uint32_t slot = 0; slot < symbols; slot++)
+            chunk->exit_values[slot] = get_symbol(slot)->value;
+        chunk->stage = 3;
+        report->generated++;
+        memcpy(values, chunk->exit_values, values_size);
+    }
+    free(values);
+
+    // A limit the last statements used up only dropped lines, with no later statement left to stop at
+    if (compiler->budget && compiler->budget->exhausted)
+        stop_execution(compiler->budget);
+
+    for (uint32_t i = 0; i < server->chunk_count; i++)
+        if (server->chunks[i].output.length)
+            sink_write(output, server->chunks[i].output.buffer, server->chunks[i].output.length);
+    return EXIT_SUCCESS;
+}
+
+// Keep a compilation warm between requests. AST dumps and optimizer messages are discarded, errors still go to stderr.
+// limits, or NULL for none, bound the statements each request runs, the Gcode it regenerates, and its wall time, so a
+// program that never ends fails its request and leaves the server running
+void init_server(CompileServer *server, int use_tree_walker, const ExecutionLimits *limits)
+{
+    memset(server, 0, sizeof(*server));
+    sink_open_memory(&server->unused_output);
+    init_compiler(&server->context, &server->unused_output, fopen("/dev/null", "w"));
+    server->context.use_tree_walker = use_tree_walker;
+    if (limits)
+    {
+        server->limits = *limits;
+        server->context.budget = &server->budget;
+    }
+}
+
+void free_server(CompileServer *server)
+{
+    CompilerContext *previous = compiler;
+    compiler = &server->context;
+    reset_server(server);
+    compiler = previous;
+    fclose(server->context.diagnostics);
+    free_compiler(&server->context);
+    sink_close(&server->unused_output);
+}
+
+// Compile a new version of the program, reusing whatever the chunks it shares with the previous version still allow.
+// Chunks matching at the start and end of both versions are kept; the ones between them are parsed again
+int server_compile(CompileServer *server, const char *source, size_t length, GcodeSink *output, ServerReport *report)
+{
+    CompilerContext *previous = compiler;
+    compiler = &server->context;
+    memset(report, 0, sizeof(*report));
+
+    uint32_t span_count;
+    ChunkSpan *spans = split_chunks(source, length, &span_count);
+    uint32_t prefix = 0;
+    while (prefix < span_count && prefix < server->chunk_count && same_text(&server->chunks[prefix], &spans[prefix]))
+        prefix++;
+    uint32_t suffix = 0;
+    while (suffix < span_count - prefix && suffix < server->chunk_count - prefix &&
+           same_text(&server->chunks[server->chunk_count - 1 - suffix], &spans[span_count - 1 - suffix]))
+        suffix++;
+
+    // Move the kept chunks to their new positions and replace the ones in between
+    ServerChunk *chunks = calloc(span_count + 1, sizeof(ServerChunk));
+    if (server->chunks)
+    {
+        memcpy(chunks, server->chunks, prefix * sizeof(ServerChunk));
+        memcpy(chunks + span_count - suffix, server->chunks + server->chunk_count - suffix, suffix * sizeof(ServerChunk));
+    }
+    for (uint32_t i = prefix; i < server->chunk_count - suffix; i++)
+        free_chunk(&server->chunks[i]);
+    for (uint32_t i = prefix; i < span_count - suffix; i++)
+    {
+        chunks[i].text = malloc(spans[i].length + 1);
+        memcpy(chunks[i].text, spans[i].start, spans[i].length);
+        chunks[i].length = spans[i].length;
+        sink_open_memory(&chunks[i].output);
+    }
+    free(server->chunks);
+    free(spans);
+    server->chunks = chunks;
+    server->chunk_count = server->chunk_capacity = span_count;
+
+    if (server->context.budget)
+        start_budget(&server->budget, &server->limits, &server->unused_output);
+    server->generated_bytes = 0;
+
+    volatile int status = EXIT_FAILURE;
+    if (setjmp(server->context.failure) == 0)
+        status = update_chunks(server, prefix, span_count - suffix, output, report);
+    if (server->context.scanner)
+        close_scanner();
+    release_program(&server->context);
+    server->context.gcode_output = &server->unused_output;
+
+    // A failed request leaves chunks half updated, so the next one starts over
+    if (status != EXIT_SUCCESS)
+        reset_server(server);
+    else if (compiler->ast_arena.count > 2 * server->compacted_nodes + 65536)
+        compact_arena(server);
+    compiler = previous;
+    return status;
+}
+
+// Read and drop the source of a request that will not be compiled, so the next request line is found. Fails if the
+// stream ends first
+static int skip_request(FILE *input, size_t length)
+{
+    char buffer[4096];
+    while (length)
+    {
+        size_t part = length < sizeof(buffer) ? length : sizeof(buffer);
+        if (fread(buffer, 1, part, input) != part)
+            return 0;
+        length -= part;
+    }
+    return 1;
+}
+
+// Answer requests on a stream until it ends or sends QUIT. Each request is a line "COMPILE <bytes>" followed by that
+// many bytes of source. The reply is "OK <bytes> <chunks> <parsed> <propagated> <analyzed> <generated>" and the Gcode,
+// or a single "ERROR" line
+int run_server(FILE *input, int output_fd, int use_tree_walker, const ExecutionLimits *limits)
+{
+    CompileServer server;
+    init_server(&server, use_tree_walker, limits);
+    GcodeSink response;
+    GcodeSink gcode;
+    sink_open_fd(&response, output_fd);
+    sink_open_memory(&gcode);
+
+    char line[128];
+    char *source = NULL;
+    size_t capacity = 0;
+    while (fgets(line, sizeof(line), input) && strcmp(line, "QUIT\n") != 0)
+    {
+        size_t length;
+        if (sscanf(line, "COMPILE %zu", &length) != 1)
+        {
+            sink_write_string(&response, "ERROR Unknown request\n");
+            sink_flush(&response);
+            continue;
+        }
+        if (length >= capacity)
+        {
+            // A source too large to hold is skipped, and the stream stays usable for the next request
+            char *grown = length <= SERVER_MAX_REQUEST ? realloc(source, length + 1) : NULL;
+            if (!grown)
+            {
+                sink_write_string(&response, "ERROR Request too large\n");
+                if (sink_flush(&response) != 0 || !skip_request(input, length))
+                    break;
+                continue;
+            }
+            source = grown;
+            capacity = length + 1;
+        }
+        if (fread(source, 1, length, input) != length)
+            break;
+
+        ServerReport report;
+        gcode.length = 0;
+        if (server_compile(&server, source, length, &gcode, &report) == EXIT_SUCCESS)
+        {
+            char header[128];
+            int header_length = snprintf(header, sizeof(header), "OK %zu %u %u %u %u %u\n", gcode.length, report.chunks,
+                                         report.parsed, report.propagated, report.analyzed, report.generated);
+            sink_write(&response, header, header_length);
+            if (gcode.length)
+                sink_write(&response, gcode.buffer, gcode.length);
+        }
+        else
+        {
+            sink_write_string(&response, "ERROR Compilation failed\n");
+        }
+        if (sink_flush(&response) != 0)
+            break;
+    }
+
+    free(source);
+    sink_close(&gcode);
+    free_server(&server);
+    return sink_close(&response) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
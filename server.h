@@ -0,0 +1,66 @@
+// server.h
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "budget.h"
+#include "compiler.h"
+#include "utility.h"
+
+#define SERVER_MAX_REQUEST ((size_t)256 << 20) // Most bytes of source one COMPILE request may send
+
+// One run of top-level statements that starts and ends on a line outside any braces, with every result derived from it.
+// Each stage is only redone when its input differs from the one it was last computed from
+typedef struct
+{
+    char *text; // Copy of the chunk's source, compared with the same chunk of the next request
+    size_t length;
+    uint32_t folded;         // Parsed and folded statements, never modified afterwards
+    ConstantState entry;     // Constants known before the chunk when it was last propagated
+    ConstantState exit;      // Constants known after it
+    ConstantState loop_in;   // What the loop optimizer, which tracks constants on its own, knew before the chunk
+    ConstantState loop_out;  // What it knew after it
+    uint32_t propagated;     // Copy of folded with loops unrolled, entry's constants substituted, and counted loops marked
+    uint64_t *live_out;      // Variables read after the chunk when its dead stores were last removed
+    uint64_t *live_in;       // Variables the optimized chunk reads before writing them
+    uint32_t set_words;
+    uint32_t optimized;      // Copy of propagated without the stores that are dead given live_out
+    int *entry_values;       // Variable values the chunk's Gcode was generated from
+    int *exit_values;        // Variable values it left behind
+    uint32_t value_count;
+    GcodeSink output;        // Gcode the chunk emitted from entry_values
+    int stage;               // How many of the stages after parsing still hold: propagation, dead stores, and Gcode
+} ServerChunk;
+
+// How much of the program one request had to redo
+typedef struct
+{
+    uint32_t chunks;
+    uint32_t parsed;
+    uint32_t propagated;
+    uint32_t analyzed;
+    uint32_t generated;
+} ServerReport;
+
+// A compilation kept alive between requests, holding every chunk of the last program compiled
+typedef struct
+{
+    CompilerContext context;
+    GcodeSink unused_output;  // Placeholder for the context's sink while no chunk is generating
+    ServerChunk *chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+    uint32_t symbol_count;    // Variables the chunks' states and value arrays were sized for
+    uint32_t compacted_nodes; // Arena size after the last compaction, which is redone once garbage outgrows it
+    ExecutionLimits limits;   // Limits on the work of each request
+    ExecutionBudget budget;   // What the request being compiled has used of them
+    size_t generated_bytes;   // Gcode the chunks regenerated so far by the request have written
+} CompileServer;
+
+void free_server(CompileServer *server);
+void init_server(CompileServer *server, int use_tree_walker, const ExecutionLimits *limits);
+int run_server(FILE *input, int output_fd, int use_tree_walker, const ExecutionLimits *limits);
+int server_compile(CompileServer *server, const char *source, size_t length, GcodeSink *output, ServerReport *report);
+
+#endif
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "ast.h"
+#include "gcode.h"
+#include "utility.h"
+
+#define DESCRIPTION_LENGTH 96 // Longest text a rewrite message shows for one expression; the rest is cut to "..."
+
+// Text of an operand as a rewrite message shows it
+typedef struct
+{
+    char text[DESCRIPTION_LENGTH];
+    size_t length;
+} Description;
+
+static void add_text(Description *description, const char *text)
+{
+    size_t length = strlen(text);
+    size_t room = sizeof(description->text) - 1 - description->length;
+    if (length > room)
+    {
+        length = room;
+        if (room >= 3)
+            memcpy(description->text + sizeof(description->text) - 4, "...", 3);
+    }
+    memcpy(description->text + description->length, text, length);
+    description->length += length;
+    description->text[description->length] = '\0';
+}
+
+// Write an operand out as source text, wrapping the operands that are expressions themselves in parentheses
+static void describe_operand(Description *description, ASTNode *operand, int nested)
+{
+    char number[16];
+    if (description->length + 1 >= sizeof(description->text))
+        return;
+    switch (operand->type)
+    {
+    case AST_INTEGER:
+        snprintf(number, sizeof(number), "%d", operand->value);
+        add_text(description, number);
+        break;
+    case AST_EXPRESSION:
+    {
+        ASTNode *left = ast_left(operand);
+        ASTNode *operator_node = ast_right(left);
+        add_text(description, nested ? "(" : "");
+        describe_operand(description, left, 1);
+        add_text(description, " ");
+        add_text(description, ast_text(operator_node));
+        add_text(description, " ");
+        describe_operand(description, ast_right(operator_node), 1);
+        add_text(description, nested ? ")" : "");
+        break;
+    }
+    default:
+        add_text(description, ast_text(operand));
+        break;
+    }
+}
+
+// Check whether two operands always evaluate to the same value, as equal expressions read at the same time do
+static int same_operand(ASTNode *a, ASTNode *b)
+{
+    if (a->type != b->type)
+        return 0;
+    if (a->type != AST_EXPRESSION)
+        return a->value == b->value;
+    if (a->left == b->left)
+        return 1;
+    ASTNode *a_operator = ast_right(ast_left(a));
+    ASTNode *b_operator = ast_right(ast_left(b));
+    return a_operator->value == b_operator->value && same_operand(ast_left(a), ast_left(b)) &&
+           same_operand(ast_right(a_operator), ast_right(b_operator));
+}
+
+// Make a node compute what operand does, keeping its place among its siblings
+static void replace_with(ASTNode *node, const ASTNode *operand)
+{
+    node->type = operand->type;
+    node->value = operand->value;
+    node->left = operand->left;
+}
+
+static void replace_with_integer(ASTNode *node, int value)
+{
+    node->type = AST_INTEGER;
+    node->value = value;
+    node->left = AST_NULL;
+}
+
+// Exchange the operands of a chain, which leaves + and * computing the same value
+static void swap_operands(ASTNode *left, ASTNode *right)
+{
+    ASTNode held = *left;
+    replace_with(left, right);
+    replace_with(right, &held);
+}
+
+// Give an operand chain a new operator and literal right operand
+static void set_operation(ASTNode *operator_node, ASTNode *right, const char *operator, int value)
+{
+    set_node_text(ast_index(operator_node), operator);
+    right->value = value;
+}
+
+// The power of two an integer is, from 2 to 2^30, or 0 if it is not one
+static int power_of_two(int value)
+{
+    if (value < 2 || (value & (value - 1)) != 0)
+        return 0;
+    return __builtin_ctz(value);
+}
+
+// An expression `operand operator literal` whose literal stands for a sum or product, or 0 if it is not one
+static int literal_term(ASTNode *operand, char kind, ASTNode **inner, uint32_t *literal)
+{
+    if (operand->type != AST_EXPRESSION)
+        return 0;
+    ASTNode *left = ast_left(operand);
+    ASTNode *operator_node = ast_right(left);
+    ASTNode *right = ast_right(operator_node);
+    char operator = arithmetic_operator(ast_text(operator_node));
+    if (right->type != AST_INTEGER)
+        return 0;
+    *inner = left;
+    if (kind == '+' && (operator == '+' || operator == '-'))
+        *literal = operator == '+' ? (uint32_t)right->value : -(uint32_t)right->value;
+    else if (kind == '*' && operator == '*')
+        *literal = (uint32_t)right->value;
+    else if (kind == '*' && operator == '<')
+        *literal = 1u << right->value;
+    else
+        return 0;
+    return 1;
+}
+
+// Rewrite rules, in the order they are tried
+typedef enum
+{
+    RULE_NONE,
+    RULE_ZERO,        // X - X and X * 0 are 0
+    RULE_IDENTITY,    // X + 0, X - 0, X * 1, and X / 1 are X
+    RULE_SUM,         // (X + a) + b is X + (a + b)
+    RULE_PRODUCT,     // (X * a) * b is X * (a * b)
+    RULE_SHIFT,       // X * 2^n is X << n, and X / 2^n is X >> n
+} RewriteRule;
+
+// Pick the rule that applies to `left operator right`, whose literal, if it has one, is on the right
+static RewriteRule match_rule(ASTNode *left, char operator, ASTNode *right, ASTNode **inner, uint32_t *literal)
+{
+    if (right->type != AST_INTEGER)
+        return operator == '-' && same_operand(left, right) && !may_fail(left) ? RULE_ZERO : RULE_NONE;
+
+    // Dropping X must not drop a failure that working it out would have caused
+    int value = right->value;
+    if (operator == '*' && value == 0)
+        return may_fail(left) ? RULE_NONE : RULE_ZERO;
+    if (((operator == '+' || operator == '-') && value == 0) || ((operator == '*' || operator == '/') && value == 1))
+        return RULE_IDENTITY;
+    if ((operator == '+' || operator == '-') && literal_term(left, '+', inner, literal))
+        return RULE_SUM;
+    if (operator == '*' && literal_term(left, '*', inner, literal))
+        return RULE_PRODUCT;
+    if ((operator == '*' || operator == '/') && power_of_two(value))
+        return RULE_SHIFT;
+    return RULE_NONE;
+}
+
+// Apply the rule that matches an expression, reporting it. Returns 1 if the expression was rewritten
+static int rewrite_expression(ASTNode *node)
+{
+    ASTNode *left = ast_left(node);
+    ASTNode *operator_node = ast_right(left);
+    ASTNode *right = ast_right(operator_node);
+    char operator = arithmetic_operator(ast_text(operator_node));
+    if (left->type == AST_INTEGER && right->type == AST_INTEGER)
+        return 0;
+
+    // + and * keep their literal on the right, so the rules only look there
+    int swap = (operator == '+' || operator == '*') && left->type == AST_INTEGER;
+    ASTNode *inner;
+    uint32_t combined;
+    RewriteRule rule = match_rule(swap ? right : left, operator, swap ? left : right, &inner, &combined);
+    if (rule == RULE_NONE)
+    {
+        if (swap)
+            swap_operands(left, right);
+        return 0;
+    }
+
+    Description before = {"", 0};
+    describe_operand(&before, node, 0);
+    if (swap)
+        swap_operands(left, right);
+    int literal = right->value;
+    switch (rule)
+    {
+    case RULE_ZERO:
+        replace_with_integer(node, 0);
+        break;
+    case RULE_IDENTITY:
+        replace_with(node, left);
+        break;
+    case RULE_SUM:
+        // Sums and products of literals wrap as the engines' arithmetic does
+        combined += operator == '+' ? (uint32_t)literal : -(uint32_t)literal;
+        replace_with(left, inner);
+        if ((int32_t)combined < 0 && (int32_t)combined != INT32_MIN)
+            set_operation(operator_node, right, "-", -(int32_t)combined);
+        else
+            set_operation(operator_node, right, "+", (int32_t)combined);
+        break;
+    case RULE_PRODUCT:
+        replace_with(left, inner);
+        set_operation(operator_node, right, "*", (int32_t)(combined * (uint32_t)literal));
+        break;
+    default:
+        set_operation(operator_node, right, operator == '*' ? "<<" : ">>", power_of_two(literal));
+        break;
+    }
+
+    Description after = {"", 0};
+    describe_operand(&after, node, 0);
+    fprintf(compiler->diagnostics, "\n* Folded %s to %s\n", before.text, after.text);
+    return 1;
+}
+
+// Fold an expression whose operands have become literals, or else reduce it by rewrite rules, such as X * 1 to X,
+// X - X to 0, or X * 8 to X << 3, until none applies. Literals that come from rewriting are not the program's own, so a
+// division by one that is zero is left for the run time to report, as do_math would have. Returns 1 if the expression
+// was rewritten
+int simplify_expression(ASTNode *node)
+{
+    if (node->type != AST_EXPRESSION || !node->left || !ast_left(node)->right)
+        return 0;
+    ASTNode *operator_node = ast_right(ast_left(node));
+    ASTNode *right = ast_right(operator_node);
+    if (ast_text(operator_node)[0] == '/' && right->type == AST_INTEGER && right->value == 0)
+        return 0;
+    if (fold_expression(node))
+        return 1;
+
+    int rewritten = 0;
+    while (node->type == AST_EXPRESSION && rewrite_expression(node))
+        rewritten = 1;
+    return rewritten;
+}
+
+static void simplify_visitor(ASTNode *node, int depth, void *data)
+{
+    simplify_expression(node);
+}
+
+// Simplify every expression in the AST, visiting operands before the expressions that use them
+void simplify_expressions(ASTNode *root)
+{
+    ASTVisitor visitor = {NULL, simplify_visitor, NULL};
+    walk_ast(root, &visitor);
+}
@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include "sink.h"
+
+// Write a buffered Gcode stream to an already open file descriptor
+void sink_open_fd(GcodeSink *sink, int fd)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = fd;
+    sink->capacity = SINK_BUFFER_SIZE;
+    sink->buffer = malloc(sink->capacity);
+    if (!sink->buffer)
+        sink->failed = 1;
+}
+
+// Create or truncate a file and write the Gcode stream to it, returning 0 on success
+int sink_open_file(GcodeSink *sink, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    sink_open_fd(sink, fd);
+    sink->owns_fd = 1;
+    return 0;
+}
+
+// Collect the Gcode stream in a growable memory buffer, left in sink->buffer for the caller
+void sink_open_memory(GcodeSink *sink)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = -1;
+}
+
+// Write out everything buffered so far. Memory sinks keep their contents
+int sink_flush(GcodeSink *sink)
+{
+    if (sink->fd < 0)
+        return sink->failed ? -1 : 0;
+
+    size_t written = 0;
+    while (written < sink->length && !sink->failed)
+    {
+        ssize_t result = write(sink->fd, sink->buffer + written, sink->length - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            sink->failed = 1;
+        else
+            written += result;
+    }
+    sink->length = 0;
+    return sink->failed ? -1 : 0;
+}
+
+// Append raw bytes, flushing a descriptor sink or growing a memory sink when the buffer fills
+void sink_write(GcodeSink *sink, const char *data, size_t length)
+{
+    if (sink->copy)
+        sink_write(sink->copy, data, length);
+    sink->written += length;
+    if (sink->length + length > sink->capacity)
+    {
+        if (sink->fd >= 0)
+        {
+            sink_flush(sink);
+
+            // Anything larger than the whole buffer goes straight out
+            if (length > sink->capacity)
+            {
+                sink->length = length;
+                char *buffer = sink->buffer;
+                sink->buffer = (char *)data;
+                sink_flush(sink);
+                sink->buffer = buffer;
+                return;
+            }
+        }
+        else
+        {
+            size_t capacity = sink->capacity ? sink->capacity : 4096;
+            while (sink->length + length > capacity)
+                capacity *= 2;
+            char *buffer = realloc(sink->buffer, capacity);
+            if (!buffer)
+            {
+                sink->failed = 1;
+                return;
+            }
+            sink->buffer = buffer;
+            sink->capacity = capacity;
+        }
+    }
+
+    if (sink->buffer)
+    {
+        memcpy(sink->buffer + sink->length, data, length);
+        sink->length += length;
+    }
+}
+
+// Append everything left to read from a file. A descriptor sink has the kernel copy it with sendfile where it can
+int sink_write_fd(GcodeSink *sink, int fd)
+{
+    ssize_t result;
+    if (sink->fd >= 0 && !sink->copy && sink_flush(sink) == 0)
+    {
+        while ((result = sendfile(sink->fd, fd, NULL, 1 << 30)) > 0 || (result < 0 && errno == EINTR))
+            sink->written += result > 0 ? result : 0;
+        if (result == 0)
+            return 0;
+
+        // Some outputs, such as older kernels' pipes, cannot take sendfile and are written by hand below
+        if (errno != EINVAL && errno != ENOSYS)
+        {
+            sink->failed = 1;
+            return -1;
+        }
+    }
+
+    char buffer[1 << 16];
+    while ((result = read(fd, buffer, sizeof(buffer))) != 0)
+    {
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+        {
+            sink->failed = 1;
+            return -1;
+        }
+        sink_write(sink, buffer, result);
+    }
+    return sink->failed ? -1 : 0;
+}
+
+void sink_write_string(GcodeSink *sink, const char *text)
+{
+    sink_write(sink, text, strlen(text));
+}
+
+// Append a decimal integer without going through printf
+void sink_write_int(GcodeSink *sink, int value)
+{
+    char digits[12];
+    char *end = digits + sizeof(digits);
+    char *start = end;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+    do
+    {
+        *--start = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0)
+        *--start = '-';
+
+    sink_write(sink, start, end - start);
+}
+
+// Flush and release a sink, returning -1 if any write failed. A memory sink's buffer is freed as well
+int sink_close(GcodeSink *sink)
+{
+    int status = sink_flush(sink);
+    if (sink->owns_fd && close(sink->fd) != 0)
+        status = -1;
+    free(sink->buffer);
+    sink->buffer = NULL;
+    sink->length = sink->capacity = 0;
+    return status;
+}
@@ -0,0 +1,32 @@
+// sink.h
+#ifndef SINK_H
+#define SINK_H
+
+#include <stddef.h>
+
+#define SINK_BUFFER_SIZE (1 << 20) // Bytes buffered before a file descriptor sink issues a write
+
+// Destination for generated Gcode: a file descriptor behind a large buffer, or a growable memory buffer
+typedef struct GcodeSink
+{
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    size_t written; // Bytes accepted since the sink was opened
+    int fd;      // Descriptor written on flush, or -1 for a memory sink
+    int owns_fd; // Close the descriptor in sink_close()
+    int failed;  // Set once a write or allocation fails
+    struct GcodeSink *copy; // Also receives every byte written, or NULL
+} GcodeSink;
+
+int sink_close(GcodeSink *sink);
+int sink_flush(GcodeSink *sink);
+void sink_open_fd(GcodeSink *sink, int fd);
+int sink_open_file(GcodeSink *sink, const char *path);
+void sink_open_memory(GcodeSink *sink);
+void sink_write(GcodeSink *sink, const char *data, size_t length);
+int sink_write_fd(GcodeSink *sink, int fd);
+void sink_write_int(GcodeSink *sink, int value);
+void sink_write_string(GcodeSink *sink, const char *text);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "source.h"
+
+// Drop the bytes before the oldest one a token may still point to, counting the lines they held so the ones kept can
+// still be located
+static void drop_scanned(Source *source)
+{
+    size_t count = source->keep - source->base;
+    const char *text = source->copy;
+    const char *end = text + count;
+    while ((text = memchr(text, '\n', end - text)) != NULL)
+    {
+        source->base_line++;
+        source->base_start = source->base + (++text - source->copy);
+    }
+    memmove(source->copy, end, source->length - source->keep);
+    source->base = source->keep;
+}
+
+// Append bytes read from the input to the in-memory copy of the source, making room by dropping the bytes already
+// scanned before growing it
+static void append_source(Source *source, const char *bytes, size_t count)
+{
+    if (source->length - source->base + count > source->capacity && source->keep > source->base)
+        drop_scanned(source);
+    if (source->length - source->base + count > source->capacity)
+    {
+        while (source->length - source->base + count > source->capacity)
+            source->capacity = source->capacity ? source->capacity * 2 : 1 << 16;
+        source->copy = realloc(source->copy, source->capacity);
+        if (!source->copy)
+        {
+            fprintf(stderr, "Error: Out of memory for the source.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(source->copy + (source->length - source->base), bytes, count);
+    source->length += count;
+    source->data = source->copy;
+}
+
+// Scan a source held in memory in place. It must stay untouched until the source is closed
+void open_source_memory(Source *source, const char *data, size_t length)
+{
+    memset(source, 0, sizeof(*source));
+    source->data = data;
+    source->length = length;
+    source->base_line = 1;
+}
+
+// Keep the rest of an open file as the source. A large regular file is mapped from where the stream stands, so bytes a
+// caller has already read stay skipped. Anything else is read to its end now if whole is set, or else as flex asks
+// for more, so a program arriving on a pipe compiles while it is still being written
+void open_source_file(Source *source, FILE *input, int whole)
+{
+    open_source_memory(source, "", 0);
+    int fd = fileno(input);
+    long offset = ftell(input);
+    struct stat info;
+    if (offset >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size - offset >= SOURCE_MAP_THRESHOLD)
+    {
+        void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+            source->mapping = mapping;
+            source->mapping_size = info.st_size;
+            source->data = (const char *)mapping + offset;
+            source->length = info.st_size - offset;
+            return;
+        }
+    }
+
+    source->input = input;
+    if (whole)
+    {
+        char buffer[1 << 16];
+        while (feed_source(source, buffer, sizeof(buffer)) > 0)
+            ;
+        source->fed = 0;
+    }
+}
+
+// Hand flex up to size more bytes of the source, reading them from the input once the bytes in memory run out.
+// Returns 0 at the end of the source
+size_t feed_source(Source *source, char *buffer, size_t size)
+{
+    size_t count = source->length - source->fed;
+    if (count == 0 && source->input)
+    {
+        count = fread(buffer, 1, size, source->input);
+        if (count == 0)
+        {
+            source->failed = ferror(source->input) != 0;
+            source->input = NULL;
+            return 0;
+        }
+        append_source(source, buffer, count);
+    }
+    else
+    {
+        if (count > size)
+            count = size;
+        memcpy(buffer, source_at(source, source->fed), count);
+    }
+    source->fed += count;
+    return count;
+}
+
+// Work out the line and column an offset in the source falls on, both counted from 1. Only errors need them, so the
+// lines are counted when asked rather than while scanning, except in the bytes already dropped
+void locate_source(const Source *source, size_t offset, int *line, int *column)
+{
+    if (offset > source->length)
+        offset = source->length;
+    if (offset < source->base)
+        offset = source->base;
+    const char *text = source->data;
+    const char *end = source_at(source, offset);
+    size_t line_start = source->base_start;
+    *line = source->base_line;
+    while ((text = memchr(text, '\n', end - text)) != NULL)
+    {
+        (*line)++;
+        line_start = source->base + (++text - source->data);
+    }
+    *column = (int)(offset - line_start) + 1;
+}
+
+void close_source(Source *source)
+{
+    if (source->mapping)
+        munmap(source->mapping, source->mapping_size);
+    free(source->copy);
+    memset(source, 0, sizeof(*source));
+}
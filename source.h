@@ -0,0 +1,42 @@
+// source.h
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define SOURCE_MAP_THRESHOLD (1 << 16) // Smallest file that is mapped rather than read, as mapping costs more than a short read
+
+// The text of the program being compiled, so tokens can point into it. A mapped or in-memory source is kept whole. One
+// read from a stream as flex asks for it only keeps the bytes back to the oldest token, so its memory stays bounded
+typedef struct
+{
+    const char *data;    // The source's bytes from offset base to length
+    size_t base;         // Offset of data[0]: the bytes before it were scanned and dropped
+    size_t length;       // Offset just past the last byte read so far
+    size_t position;     // Offset of the next byte to scan
+    size_t fed;          // Offset of the next byte to hand flex, which reads ahead of position
+    size_t keep;         // Offset of the oldest byte a token may still point to
+    int base_line;       // Line data[0] falls on, counted from 1
+    size_t base_start;   // Offset that line starts at
+    FILE *input;         // Stream the rest of the source is still read from as flex asks for it, or NULL
+    void *mapping;       // Mapping of the input file, or NULL
+    size_t mapping_size;
+    char *copy;          // Source read into memory when the input cannot be mapped, or NULL
+    size_t capacity;
+    int failed;          // Set when the input could not be read
+} Source;
+
+// The byte at an offset of the source, which must not be before its base
+static inline const char *source_at(const Source *source, size_t offset)
+{
+    return source->data + (offset - source->base);
+}
+
+void close_source(Source *source);
+size_t feed_source(Source *source, char *buffer, size_t size);
+void locate_source(const Source *source, size_t offset, int *line, int *column);
+void open_source_file(Source *source, FILE *input, int whole);
+void open_source_memory(Source *source, const char *data, size_t length);
+
+#endif
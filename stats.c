@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include "compiler.h"
+
+static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_SCAN] = "scan",
+    [PHASE_BUILD_AST] = "build_ast",
+    [PHASE_FOLD_CONSTANTS] = "fold_constants",
+    [PHASE_OPTIMIZE_LOOPS] = "optimize_loops",
+    [PHASE_PROPAGATE_CONSTANTS] = "propagate_constants",
+    [PHASE_COUNTED_LOOPS] = "mark_counted_loops",
+    [PHASE_DEAD_CODE] = "eliminate_dead_code",
+    [PHASE_LOWER] = "compile_bytecode",
+    [PHASE_GENERATE] = "generate_gcode",
+};
+
+// Report the measurements of a compilation as aligned text or as a single JSON object
+void print_stats(const CompilerStats *stats, FILE *output, int json)
+{
+    const char *names[] = {"tokens", "ast_nodes", "ast_bytes", "symbol_lookups", "loop_iterations", "closed_form_iterations", "gcode_lines", "gcode_bytes", "peephole_lines_removed", "peephole_bytes_removed", "cache_hits", "cache_misses"};
+    const uint64_t counts[] = {stats->tokens, stats->ast_nodes, stats->ast_bytes, stats->symbol_lookups,
+                               stats->loop_iterations, stats->closed_form_iterations, stats->gcode_lines, stats->gcode_bytes,
+                               stats->peephole_lines_removed, stats->peephole_bytes_removed, stats->cache_hits, stats->cache_misses};
+    int count_total = sizeof(counts) / sizeof(counts[0]);
+
+    if (json)
+    {
+        fprintf(output, "{");
+        for (int phase = 0; phase < PHASE_COUNT; phase++)
+            fprintf(output, "\"%s_s\":%.6f,", phase_names[phase], stats->seconds[phase]);
+        for (int i = 0; i < count_total; i++)
+            fprintf(output, "\"%s\":%llu%s", names[i], (unsigned long long)counts[i], i + 1 < count_total ? "," : "}\n");
+        return;
+    }
+
+    fprintf(output, "\nCompilation statistics:\n");
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+        fprintf(output, "  %-24s %12.3f ms\n", phase_names[phase], stats->seconds[phase] * 1e3);
+    for (int i = 0; i < count_total; i++)
+        fprintf(output, "  %-24s %12llu\n", names[i], (unsigned long long)counts[i]);
+}
@@ -0,0 +1,51 @@
+// stats.h
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Phases timed by --stats. Scanning happens on demand while the AST is built, so build_ast excludes it
+typedef enum
+{
+    PHASE_SCAN,
+    PHASE_BUILD_AST,
+    PHASE_FOLD_CONSTANTS,
+    PHASE_OPTIMIZE_LOOPS,
+    PHASE_PROPAGATE_CONSTANTS,
+    PHASE_COUNTED_LOOPS,
+    PHASE_DEAD_CODE,
+    PHASE_LOWER,
+    PHASE_GENERATE,
+    PHASE_COUNT,
+} StatsPhase;
+
+// What --stats measures for one compilation. The context only points to one while --stats is on
+typedef struct
+{
+    double seconds[PHASE_COUNT];
+    uint64_t tokens;
+    uint64_t ast_nodes;
+    uint64_t ast_bytes;              // Node and text storage reserved by create_ast_node()
+    uint64_t symbol_lookups;
+    uint64_t loop_iterations;        // WHILE iterations run step by step
+    uint64_t closed_form_iterations; // Iterations of counted loops evaluated in closed form
+    uint64_t gcode_lines;
+    uint64_t gcode_bytes;
+    uint64_t peephole_lines_removed; // Generated lines the --peephole stage did not write
+    uint64_t peephole_bytes_removed;
+    uint64_t cache_hits;             // Compilations answered from the --cache directory
+    uint64_t cache_misses;
+} CompilerStats;
+
+// Add to a counter of the current compilation, at the cost of a single test while --stats is off
+#define COUNT_STAT(field, amount)               \
+    do                                          \
+    {                                           \
+        if (compiler->stats)                    \
+            compiler->stats->field += (amount); \
+    } while (0)
+
+void print_stats(const CompilerStats *stats, FILE *output, int json);
+
+#endif
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "symbols.h"
+#include "utility.h"
+
+// Rebuild the hash buckets at double the size so lookups stay short as the table grows
+static void grow_buckets()
+{
+    free(compiler->symbol_table.buckets);
+    compiler->symbol_table.bucket_capacity = compiler->symbol_table.bucket_capacity ? compiler->symbol_table.bucket_capacity * 2 : 64;
+    compiler->symbol_table.buckets = calloc(compiler->symbol_table.bucket_capacity, sizeof(*compiler->symbol_table.buckets));
+    if (!compiler->symbol_table.buckets)
+    {
+        fprintf(stderr, "Error: Out of memory for the symbol table.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t slot = 0; slot < compiler->symbol_table.count; slot++)
+    {
+        uint32_t bucket = hash_text(compiler->symbol_table.symbols[slot].identifier, strlen(compiler->symbol_table.symbols[slot].identifier)) & (compiler->symbol_table.bucket_capacity - 1);
+        while (compiler->symbol_table.buckets[bucket])
+            bucket = (bucket + 1) & (compiler->symbol_table.bucket_capacity - 1);
+        compiler->symbol_table.buckets[bucket] = slot + 1;
+    }
+}
+
+// Return the slot of the variable named by length bytes of identifier, adding it with a default value of 0 the first
+// time it is seen
+uint32_t intern_symbol(const char *identifier, size_t length)
+{
+    COUNT_STAT(symbol_lookups, 1);
+
+    // Keep the buckets at most half full
+    if (compiler->symbol_table.count * 2 >= compiler->symbol_table.bucket_capacity)
+        grow_buckets();
+
+    // Probe linearly from the identifier's hash until it or an empty bucket is found
+    uint32_t bucket = hash_text(identifier, length) & (compiler->symbol_table.bucket_capacity - 1);
+    while (compiler->symbol_table.buckets[bucket])
+    {
+        uint32_t slot = compiler->symbol_table.buckets[bucket] - 1;
+        const char *name = compiler->symbol_table.symbols[slot].identifier;
+        if (strlen(name) == length && memcmp(name, identifier, length) == 0)
+            return slot;
+        bucket = (bucket + 1) & (compiler->symbol_table.bucket_capacity - 1);
+    }
+
+    // Add a new symbol if not found
+    if (compiler->symbol_table.count == compiler->symbol_table.capacity)
+    {
+        compiler->symbol_table.capacity = compiler->symbol_table.capacity ? compiler->symbol_table.capacity * 2 : 16;
+        compiler->symbol_table.symbols = realloc(compiler->symbol_table.symbols, compiler->symbol_table.capacity * sizeof(*compiler->symbol_table.symbols));
+        if (!compiler->symbol_table.symbols)
+        {
+            fprintf(stderr, "Error: Out of memory for the symbol table.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint32_t slot = compiler->symbol_table.count++;
+    compiler->symbol_table.symbols[slot].identifier = strndup(identifier, length);
+    compiler->symbol_table.symbols[slot].value = 0; // Default value
+    compiler->symbol_table.buckets[bucket] = slot + 1;
+    return slot;
+}
+
+// Release every variable once the compilation is finished
+void free_symbols()
+{
+    for (uint32_t slot = 0; slot < compiler->symbol_table.count; slot++)
+        free(compiler->symbol_table.symbols[slot].identifier);
+    free(compiler->symbol_table.symbols);
+    free(compiler->symbol_table.buckets);
+    memset(&compiler->symbol_table, 0, sizeof(compiler->symbol_table));
+}
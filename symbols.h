@@ -0,0 +1,28 @@
+// symbols.h
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <stdint.h>
+
+// Symbol table entry for tracking a variable's state
+typedef struct
+{
+    char *identifier; // Full variable name, owned by the symbol table
+    int value;
+} Symbol;
+
+// Interned variables, each addressed by a dense slot that the parser resolves once.
+// The table lives in the compiler context, and compiler.h provides get_symbol()
+typedef struct
+{
+    Symbol *symbols;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *buckets; // Open-addressing hash of slots (plus one), keyed by identifier
+    uint32_t bucket_capacity;
+} SymbolTable;
+
+void free_symbols();
+uint32_t intern_symbol(const char *identifier, size_t length);
+
+#endif
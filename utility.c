@@ -1,19 +1,47 @@
 #include "scanner.h"
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include "ast.h"
+#include "cfg.h"
 #include "gcode.h"
 #include "utility.h"
 
-Symbol symbol_table[100];
-char used_variables[100][100];
-int symbol_count = 0;
-int used_var_count = 0;
+// The operation an arithmetic operator's text stands for: its character for + - * /, '<' for "<<", '>' for ">>", or 0
+// for any other text, including the comparisons that start with the same characters as the shifts
+int arithmetic_operator(const char *operator)
+{
+    switch (operator[0])
+    {
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+        return operator[1] == '\0' ? operator[0] : 0;
+    case '<':
+    case '>':
+        return operator[1] == operator[0] && operator[2] == '\0' ? operator[0] : 0;
+    default:
+        return 0;
+    }
+}
+
+// Check whether a shift count is one simplify_expression writes, from 1 to MAX_SHIFT, so 2^count fits an int
+int valid_shift(int count)
+{
+    return count >= 1 && count <= MAX_SHIFT;
+}
 
 // Helper function to do math based on the given operator
 int do_math(int current_value, const char *operator, int operand)
 {
-    switch (operator[0])
+    int operation = arithmetic_operator(operator);
+    if ((operation == '<' || operation == '>') && !valid_shift(operand))
+    {
+        fprintf(stderr, "Error: Shift count %d is out of range\n", operand);
+        fail_compilation();
+    }
+    switch (operation)
     {
     case '+':
         return current_value + operand;
@@ -25,124 +53,257 @@ int do_math(int current_value, const char *operator, int operand)
         if (operand == 0)
         {
             fprintf(stderr, "Error: Division by zero\n");
-            exit(EXIT_FAILURE);
+            fail_compilation();
         }
         return current_value / operand;
+    case '<':
+        // Multiplication by 2^operand, written as a shift by simplify_expression
+        return (int)((unsigned)current_value << operand);
+    case '>':
+        // Division by 2^operand, rounding toward zero like '/'
+        return (current_value + ((current_value >> 31) & ((1 << operand) - 1))) >> operand;
     default:
         fprintf(stderr, "Error: Unsupported operator '%s'\n", operator);
-        exit(EXIT_FAILURE);
+        fail_compilation();
     }
 }
 
-// Fold constant expressions in the AST
-void fold_constants(ASTNode *node)
+// Fold an expression node whose operands are both constants into a single integer, returning 1 if it was folded
+int fold_expression(ASTNode *node)
 {
-    if (!node)
-        return;
-
-    // Recursively process child nodes
-    fold_constants(node->left);
-    fold_constants(node->right);
-
-    // Fold constants if the node is an expression
-    if (node->type == AST_EXPRESSION && node->left && node->left->right)
+    if (node->type == AST_EXPRESSION && node->left && ast_left(node)->right)
     {
-        ASTNode *left = node->left;
-        ASTNode *operator_node = node->left->right;
-        ASTNode *right = operator_node ? operator_node->right : NULL;
+        ASTNode *left = ast_left(node);
+        ASTNode *operator_node = ast_right(left);
+        ASTNode *right = operator_node ? ast_right(operator_node) : NULL;
 
         // Check that both children are constants
         if (left && right && left->type == AST_INTEGER && right->type == AST_INTEGER)
         {
-            int result = do_math(atoi(left->value), operator_node->value, atoi(right->value));
-            printf("\n* Folded %d %s %d to %d\n", atoi(left->value), operator_node->value, atoi(right->value), result);
+            int result = do_math(left->value, ast_text(operator_node), right->value);
+            fprintf(compiler->diagnostics, "\n* Folded %d %s %d to %d\n", left->value, ast_text(operator_node), right->value, result);
 
             // Replace the expression node with an integer
             node->type = AST_INTEGER;
-            snprintf(node->value, sizeof(node->value), "%d", result);
+            node->value = result;
 
-            // Mark child nodes as NULL
-            node->left = node->right = NULL;
+            // Detach the folded operands, which are reclaimed when the arena is reset
+            node->left = AST_NULL;
+            return 1;
         }
     }
+    return 0;
 }
 
-// Check if a variable is already marked as used
-int is_variable_used(const char *var_name)
+static void fold_visitor(ASTNode *node, int depth, void *data)
 {
-    for (int i = 0; i < used_var_count; i++)
-    {
-        if (strcmp(used_variables[i], var_name) == 0)
-            return 1;
-    }
-    return 0;
+    fold_expression(node);
 }
 
-// Mark a variable as used
-void variable_is_used(const char *var_name)
+// Fold constant expressions in the AST, visiting operands before the expressions that use them, then simplify the
+// expressions that still read variables
+void fold_constants(ASTNode *node)
 {
-    if (!is_variable_used(var_name) && used_var_count < 100)
-        strcpy(used_variables[used_var_count++], var_name);
+    ASTVisitor visitor = {NULL, fold_visitor, NULL};
+    walk_ast(node, &visitor);
+    simplify_expressions(node);
 }
 
-// Determine all used variables in the AST
-void determine_used_variables(ASTNode *node)
+// Check whether an item stores a value that no later statement reads before it is overwritten
+static int is_dead_store(const CFGItem *item, const uint64_t *live)
 {
-    if (!node)
-        return;
-
-    // If PRINT or EXPRESSION references an identifier, mark it as used
-    if ((node->type == AST_PRINT || node->type == AST_EXPRESSION) && node->left && node->left->type == AST_IDENTIFIER)
-        variable_is_used(node->left->value);
+    ASTNode *node = ast_node(item->node);
+    int value;
+    if (item->kind != CFG_STATEMENT || !node->left || !ast_left(node)->right || set_contains(live, ast_left(node)->value))
+        return 0;
 
-    // If IF or WHILE references an identifier, mark it as used
-    if ((node->type == AST_IF_STATEMENT || node->type == AST_WHILE) && node->left && node->left->left && node->left->left->type == AST_IDENTIFIER)
-        variable_is_used(node->left->left->value);
+    // SET changes a printer setting, and an unsupported parameter stops the program, so only plain CREATEs can go
+    if (node->type == AST_COMMAND)
+        return strcmp(ast_text(node), "CREATE") == 0 && lookup_initial_value(ast_text(ast_right(ast_left(node))), &value);
+    return node->type == AST_ASSIGNMENT && ast_right(ast_left(node))->right && !may_fail(ast_right(ast_right(ast_left(node))));
+}
 
-    // Recursively check child nodes
-    determine_used_variables(node->left);
-    determine_used_variables(node->right);
+// Mark dead stores in the graph, repeating the analysis until removing them exposes no more
+static void mark_dead_stores(ControlFlowGraph *cfg)
+{
+    uint64_t *live = malloc(cfg->set_words * sizeof(uint64_t));
+    int changed;
+    do
+    {
+        changed = 0;
+        analyze_liveness(cfg);
+        for (uint32_t b = 0; b < cfg->block_count; b++)
+        {
+            BasicBlock *block = &cfg->blocks[b];
+            memcpy(live, cfg->live_out + (size_t)b * cfg->set_words, cfg->set_words * sizeof(uint64_t));
+            for (uint32_t i = block->item_count; i-- > 0;)
+            {
+                CFGItem *item = &cfg->items[block->first_item + i];
+                if (!item->removed && is_dead_store(item, live))
+                {
+                    item->removed = 1;
+                    changed = 1;
+                }
+                transfer_liveness(item, live);
+            }
+        }
+    } while (changed);
+    free(live);
 }
 
-// Eliminate dead code from the AST
-ASTNode *eliminate_dead_code(ASTNode *node)
+// Flags for the arena indices spanned by a graph's items, so a small sequence does not need one per node in the arena
+typedef struct
 {
-    if (!node)
-        return NULL;
+    char *flags;
+    uint32_t first; // Arena index of flags[0]
+    uint32_t count;
+} DeadSet;
 
-    // Recursively eliminate dead code in child nodes
-    node->left = eliminate_dead_code(node->left);
-    node->right = eliminate_dead_code(node->right);
+// Check whether a statement was marked as a dead store, and report it if so
+static int is_dead_statement(ASTNode *node, const DeadSet *dead)
+{
+    uint32_t index = ast_index(node);
+    if (index < dead->first || index - dead->first >= dead->count || !dead->flags[index - dead->first])
+        return 0;
 
     // Remove unused variable initializations
-    if (node->type == AST_COMMAND && strcmp(node->value, "CREATE") == 0 && node->left && !is_variable_used(node->left->value))
+    if (node->type == AST_COMMAND)
+        fprintf(compiler->diagnostics, "\n* Removed unused initialization %s\n", ast_text(ast_left(node)));
+
+    // Remove unused variable assignments
+    else
+        fprintf(compiler->diagnostics, "\n* Removed unused assignment %s\n", ast_text(ast_left(node)));
+    return 1;
+}
+
+// Unlink dead statements from a statement list and return its new first statement.
+// The list is checked from its last statement back to its first, so removals are reported in the same order as before
+static ASTNode *remove_dead_statements(ASTNode *first, const DeadSet *dead)
+{
+    // Reverse the list in place
+    uint32_t reversed = AST_NULL;
+    ASTNode *node = first;
+    while (node)
     {
-        printf("\n* Removed unused variable %s\n", node->left->value);
-        // Skip node
-        return node->right;
+        ASTNode *next = ast_right(node);
+        node->right = reversed;
+        reversed = ast_index(node);
+        node = next;
     }
 
-    // Remove unused variable assignments
-    if (node->type == AST_ASSIGNMENT && node->left && !is_variable_used(node->left->value))
+    // Walk it back, restoring the original order while skipping dead statements.
+    // A removed statement still points at the rest of the filtered list
+    uint32_t kept = AST_NULL;
+    node = ast_node(reversed);
+    while (node)
     {
-        printf("\n* Removed unused assignment %s\n", node->left->value);
-        // Skip node
-        return node->right;
+        ASTNode *next = ast_right(node);
+        node->right = kept;
+        if (!is_dead_statement(node, dead))
+            kept = ast_index(node);
+        node = next;
     }
+    return ast_node(kept);
+}
 
-    // Return the node if not dead code
+// Filter a statement block once all of its nested blocks have been filtered
+static void eliminate_dead_block(ASTNode *node, int depth, void *data)
+{
+    if (node->type == AST_STATEMENT_BLOCK)
+        node->left = ast_index(remove_dead_statements(ast_left(node), data));
+}
+
+// Eliminate dead stores from a statement sequence, given the variables read after it, and return its new first statement.
+// live_out and live_in are sets of symbol slots, and live_in receives the variables read before being written, if given
+static ASTNode *remove_dead_stores(ASTNode *node, const uint64_t *live_out, uint64_t *live_in, uint32_t *removed_count, uint32_t *removed_in_loop_count)
+{
+    ControlFlowGraph *cfg = build_cfg(node);
+    cfg->exit_live = live_out;
+    mark_dead_stores(cfg);
+    if (live_in)
+        memcpy(live_in, cfg->live_in, cfg->set_words * sizeof(uint64_t));
+
+    // Each removed statement would have written one line of Gcode every time it ran
+    DeadSet dead = {NULL, UINT32_MAX, 0};
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < cfg->item_count; i++)
+    {
+        if (cfg->items[i].node < dead.first)
+            dead.first = cfg->items[i].node;
+        if (cfg->items[i].node > last)
+            last = cfg->items[i].node;
+    }
+    if (cfg->item_count)
+        dead.count = last - dead.first + 1;
+    dead.flags = calloc(dead.count + 1, 1);
+    uint32_t removed = 0, removed_in_loops = 0;
+    for (uint32_t i = 0; i < cfg->item_count; i++)
+    {
+        if (cfg->items[i].removed)
+        {
+            dead.flags[cfg->items[i].node - dead.first] = 1;
+            removed++;
+            removed_in_loops += cfg->items[i].in_loop != 0;
+        }
+    }
+    free_cfg(cfg);
+
+    ASTVisitor visitor = {NULL, eliminate_dead_block, &dead};
+    walk_ast(node, &visitor);
+    node = remove_dead_statements(node, &dead);
+    free(dead.flags);
+
+    *removed_count = removed;
+    *removed_in_loop_count = removed_in_loops;
     return node;
 }
 
-// Optimize the AST
-void optimize_ast(ASTNode *root)
+ASTNode *eliminate_dead_stores(ASTNode *node, const uint64_t *live_out, uint64_t *live_in)
 {
-    printf("\nFolding constants...\n");
+    uint32_t removed, removed_in_loops;
+    return remove_dead_stores(node, live_out, live_in, &removed, &removed_in_loops);
+}
+
+// Eliminate dead stores from the AST using liveness over its control-flow graph, and return its new first statement
+ASTNode *eliminate_dead_code(ASTNode *node)
+{
+    uint32_t removed, removed_in_loops;
+    node = remove_dead_stores(node, NULL, NULL, &removed, &removed_in_loops);
+    fprintf(compiler->diagnostics, "\nDead statements removed: %u (Gcode lines removed: %u per run, %u per loop iteration)\n", removed, removed - removed_in_loops, removed_in_loops);
+    return node;
+}
+
+// Optimize the AST and return its new first statement
+ASTNode *optimize_ast(ASTNode *root)
+{
+    fprintf(compiler->diagnostics, "\nFolding constants...\n");
+    double start = stats_clock();
     fold_constants(root);
+    record_phase(PHASE_FOLD_CONSTANTS, start);
+
+    fprintf(compiler->diagnostics, "\nOptimizing loops...\n");
+    start = stats_clock();
+    ConstantState known;
+    init_state(&known, compiler->symbol_table.count);
+    root = optimize_loops(root, &known);
+    free_state(&known);
+    record_phase(PHASE_OPTIMIZE_LOOPS, start);
+
+    fprintf(compiler->diagnostics, "\nPropagating constants...\n");
+    start = stats_clock();
+    propagate_constants(root);
+    record_phase(PHASE_PROPAGATE_CONSTANTS, start);
 
-    printf("\nEliminating dead code...\n");
-    determine_used_variables(root);
+    fprintf(compiler->diagnostics, "\nEvaluating counted loops...\n");
+    start = stats_clock();
+    mark_counted_loops(root);
+    record_phase(PHASE_COUNTED_LOOPS, start);
+
+    fprintf(compiler->diagnostics, "\nEliminating dead code...\n");
+    start = stats_clock();
     root = eliminate_dead_code(root);
+    record_phase(PHASE_DEAD_CODE, start);
+    return root;
 }
 
 // Helper function to evaluate comparison operators
@@ -167,31 +328,36 @@ int evaluate_condition(int left, const char *operator, int right)
 // Helper function to expect and consume a token of a specific type
 int expect_token(int *i, State expected_type, const char *error_message)
 {
-    if (tokens[*i].type != expected_type)
+    if (get_token(*i)->type != expected_type)
     {
-        fprintf(stderr, "Syntax error: %s\n", error_message);
+        syntax_error(*i, "%s", error_message);
         return 0;
     }
     (*i)++; // Consume the token
     return 1;
 }
 
-// Helper function to get or create a symbol
-Symbol *get_symbol(const char *identifier)
+// Report a syntax error at the token with the given index, giving the line and column where it starts
+void syntax_error(int index, const char *format, ...)
 {
-    for (int i = 0; i < symbol_count; i++)
-    {
-        if (strcmp(symbol_table[i].identifier, identifier) == 0)
-        {
-            return &symbol_table[i];
-        }
-    }
+    int line, column;
+    token_location(get_token(index), &line, &column);
+    fprintf(stderr, "Syntax error at line %d, column %d: ", line, column);
+    va_list arguments;
+    va_start(arguments, format);
+    vfprintf(stderr, format, arguments);
+    va_end(arguments);
+    fprintf(stderr, "\n");
+    compiler->syntax_errors++;
+}
 
-    // Add a new symbol if not found
-    Symbol *new_symbol = &symbol_table[symbol_count++];
-    strncpy(new_symbol->identifier, identifier, sizeof(new_symbol->identifier) - 1);
-    new_symbol->value = 0; // Default value
-    return new_symbol;
+// Helper function to hash length bytes of text (FNV-1a) for the symbol and text tables
+uint32_t hash_text(const char *text, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    return hash;
 }
 
 // Helper function to check if a token type is a comparison operator
@@ -208,23 +374,62 @@ int is_valid_operand(State type)
     return type == IDENTIFIER || type == INTEGER || type == PARAMETER;
 }
 
-// Helper function to map parameters to numerical values
-int map_initial_value(const char *value)
+// Helper function to look up a parameter's numerical value, returning 0 if it has none
+int lookup_initial_value(const char *value, int *result)
 {
     if (strcmp(value, "HIGH") == 0)
-        return 10;
+        *result = 10;
     else if (strcmp(value, "MEDIUM") == 0)
-        return 5;
+        *result = 5;
     else if (strcmp(value, "LOW") == 0)
-        return 1;
+        *result = 1;
+    else
+        return 0;
+    return 1;
+}
+
+// Helper function to map parameters to numerical values
+int map_initial_value(const char *value)
+{
+    int result;
+    if (lookup_initial_value(value, &result))
+        return result;
     fprintf(stderr, "Error: Unsupported initialization value '%s'\n", value);
-    exit(EXIT_FAILURE);
+    fail_compilation();
+}
+
+// Check whether evaluating an operand could stop the program, with a division by zero or an unsupported parameter,
+// which must still happen even if its value is never used
+int may_fail(ASTNode *operand)
+{
+    int value;
+    switch (operand->type)
+    {
+    case AST_PARAMETER:
+        return !lookup_initial_value(ast_text(operand), &value);
+    case AST_EXPRESSION:
+    {
+        if (!operand->left || !ast_left(operand)->right)
+            return 0;
+        ASTNode *left = ast_left(operand);
+        ASTNode *operator_node = ast_right(left);
+        ASTNode *right = ast_right(operator_node);
+        int operation = arithmetic_operator(ast_text(operator_node));
+        if (operation == '/' && (right->type != AST_INTEGER || right->value == 0))
+            return 1;
+        if ((operation == '<' || operation == '>') && (right->type != AST_INTEGER || !valid_shift(right->value)))
+            return 1;
+        return may_fail(left) || may_fail(right);
+    }
+    default:
+        return 0;
+    }
 }
 
 // Helper function to initialize variables with set values and output relevant Gcode
-void initialize_variable(const char *var_name, const char *value)
+void initialize_variable(uint32_t slot, const char *value)
 {
-    Symbol *symbol = get_symbol(var_name);
+    Symbol *symbol = get_symbol(slot);
     symbol->value = map_initial_value(value);
-    printf("G92 %s%d ; Initialize %s to %s (%d)\n", var_name, symbol->value, var_name, value, symbol->value);
+    emit_initialize(symbol->identifier, value, symbol->value);
 }
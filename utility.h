@@ -1,17 +1,54 @@
 // utility.h
 #ifndef UTILITY_H
 #define UTILITY_H
+#include <stdint.h>
+#include <stdio.h>
 #include "scanner.h"
 #include "gcode.h"
 
+#define MAX_SHIFT 30 // Largest count a << or >> may shift by, as 2^31 does not fit an int
+
+// Values known for every symbol slot at one point in the program
+typedef struct
+{
+    int *values;
+    char *known;
+    uint32_t count;
+} ConstantState;
+
+int arithmetic_operator(const char *operator);
+ConstantState copy_state(const ConstantState *state);
+int count_loop_trips(const char *operator, int start, int bound, int step, int64_t *trips);
 int do_math(int current_value, const char *operator, int operand);
+ASTNode *eliminate_dead_code(ASTNode *node);
+ASTNode *eliminate_dead_stores(ASTNode *node, const uint64_t *live_out, uint64_t *live_in);
 int evaluate_condition(int left, const char *operator, int right);
 int expect_token(int *i, State expected_type, const char *error_message);
-Symbol *get_symbol(const char *identifier);
-void initialize_variable(const char *var_name, const char *value);
+void fold_constants(ASTNode *node);
+int fold_expression(ASTNode *node);
+int forget_assigned(ASTNode *node, int depth, void *data);
+void free_state(ConstantState *state);
+uint32_t hash_text(const char *text, size_t length);
+void init_state(ConstantState *state, uint32_t count);
+void initialize_variable(uint32_t slot, const char *value);
 int is_comparison_operator(State type);
 int is_valid_operand(State type);
+int lookup_initial_value(const char *value, int *result);
+int loop_never_ends(ASTNode *loop);
 int map_initial_value(const char *value);
-void optimize_ast(ASTNode *root);
+void mark_counted_loops(ASTNode *root);
+int match_counted_loop(ASTNode *loop, int *step);
+int match_loop_step(ASTNode *statement, uint32_t slot, int *step);
+int may_fail(ASTNode *operand);
+void meet_states(ConstantState *into, const ConstantState *other);
+ASTNode *optimize_ast(ASTNode *root);
+ASTNode *optimize_loops(ASTNode *root, ConstantState *state);
+void propagate_constants(ASTNode *root);
+void propagate_statements(ASTNode *statement, ConstantState *state);
+int same_state(const ConstantState *a, const ConstantState *b);
+int simplify_expression(ASTNode *node);
+void simplify_expressions(ASTNode *root);
+void syntax_error(int index, const char *format, ...);
+int valid_shift(int count);
 
 #endif